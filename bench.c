@@ -0,0 +1,645 @@
+#include "toolbelt.c"
+
+// usage: bench [section] [payload.json]
+
+typedef json_t* (*bench_parse_cb)(char*);
+
+char*
+bench_payload (char *path, size_t *size)
+{
+  if (path)
+  {
+    char *payload = file_slurp(path, size);
+    ensure(payload) errorf("cannot read %s", path);
+    return payload;
+  }
+
+  text_t *text = textf("[");
+  for (int i = 0; i < 200000; i++)
+    textf_ins(text, "{\"id\": %d, \"name\": \"item %d\", \"tags\": [\"a\", \"b\\\"c\"], \"price\": %d.%02d, \"active\": %s},",
+      i, i, i % 1000, i % 100, i % 2 ? "true": "false");
+  text_unsep(text, ",");
+  text_ins(text, "]");
+
+  *size = text_count(text);
+  return text_unwrap(text);
+}
+
+void
+bench_parse (char *name, bench_parse_cb parse, char *payload, size_t size)
+{
+  int rounds = 5;
+  uint64_t parsing = 0, freeing = 0;
+
+  for (int i = 0; i < rounds; i++)
+  {
+    uint64_t t0 = ustamp();
+    json_t *json = parse(payload);
+    uint64_t t1 = ustamp();
+    json_free(json);
+    uint64_t t2 = ustamp();
+
+    parsing += t1 - t0;
+    freeing += t2 - t1;
+  }
+
+  printf("%-18s %8.3f GB/s parse %8.3f ms free\n", name,
+    (double)size * rounds / parsing / 1000, (double)freeing / rounds / 1000);
+}
+
+void
+bench_msgpack (char *payload, size_t size)
+{
+  int rounds = 5;
+  uint64_t text_encoding = 0, text_decoding = 0, encoding = 0, decoding = 0;
+  size_t text_size = 0, packed_size = 0;
+
+  json_t *json = json_parse_fast(payload);
+
+  for (int i = 0; i < rounds; i++)
+  {
+    text_t *text = text_new("");
+    json_writer_t writer;
+    json_writer_text(&writer, text);
+
+    uint64_t t0 = ustamp();
+    json_writer_json(&writer, json);
+    json_writer_clear(&writer);
+    uint64_t t1 = ustamp();
+    json_free(json_parse_fast(text_get(text)));
+    uint64_t t2 = ustamp();
+    char *packed = msgpack_encode(json, &packed_size);
+    uint64_t t3 = ustamp();
+    json_free(msgpack_decode(packed, packed_size));
+    uint64_t t4 = ustamp();
+
+    text_encoding += t1 - t0;
+    text_decoding += t2 - t1;
+    encoding += t3 - t2;
+    decoding += t4 - t3;
+    text_size = text_count(text);
+
+    free(packed);
+    text_free(text);
+  }
+
+  json_free(json);
+
+  printf("%-18s %10lu bytes %8.3f ms encode %8.3f ms decode\n", "json text", text_size,
+    (double)text_encoding / rounds / 1000, (double)text_decoding / rounds / 1000);
+  printf("%-18s %10lu bytes %8.3f ms encode %8.3f ms decode\n", "msgpack", packed_size,
+    (double)encoding / rounds / 1000, (double)decoding / rounds / 1000);
+}
+
+int
+bench_path_sum (json_t *json, void *payload)
+{
+  *(int64_t*)payload += json_integer(json);
+  return 0;
+}
+
+void
+bench_path (char *payload, size_t size)
+{
+  json_path_t *path = json_path_compile("$[*].id");
+  int64_t sum1 = 0, sum2 = 0;
+
+  uint64_t t0 = ustamp();
+  json_t *json = json_parse_fast(payload);
+  json_path_each(path, json, bench_path_sum, &sum1);
+  json_free(json);
+  uint64_t t1 = ustamp();
+  json_t *matches = json_path_select(path, payload);
+  json_array_each(matches, json_t *match)
+    sum2 += json_integer(match);
+  json_free(matches);
+  uint64_t t2 = ustamp();
+
+  printf("%-18s %8.3f ms parse+walk %8.3f ms select (%ld %ld)\n", "$[*].id",
+    (double)(t1 - t0) / 1000, (double)(t2 - t1) / 1000, sum1, sum2);
+
+  json_path_free(path);
+}
+
+void
+bench_tape (char *payload, size_t size)
+{
+  int rounds = 5;
+  uint64_t parsing = 0, mapping = 0;
+
+  json_t *json = json_parse_fast(payload);
+  ensure(json_tape_save(json, "bench.tape") == EXIT_SUCCESS) errorf("cannot write bench.tape");
+  json_free(json);
+
+  for (int i = 0; i < rounds; i++)
+  {
+    uint64_t t0 = ustamp();
+    json = json_parse_fast(payload);
+    json_integer(json_object_get(json_array_get(json, 1000), "id"));
+    json_free(json);
+    uint64_t t1 = ustamp();
+    json = json_tape_open("bench.tape");
+    json_integer(json_object_get(json_array_get(json, 1000), "id"));
+    json_free(json);
+    uint64_t t2 = ustamp();
+
+    parsing += t1 - t0;
+    mapping += t2 - t1;
+  }
+
+  unlink("bench.tape");
+
+  printf("%-18s %8.3f ms parse+get %8.3f ms open+get\n", "json_tape",
+    (double)parsing / rounds / 1000, (double)mapping / rounds / 1000);
+}
+
+void
+bench_json (char *path)
+{
+  size_t size = 0;
+  char *payload = bench_payload(path, &size);
+
+  printf("json: %lu bytes\n", size);
+
+  bench_parse("json_parse", json_parse, payload, size);
+  bench_parse("json_parse_arena", json_parse_arena, payload, size);
+  bench_parse("json_parse_fast", json_parse_fast, payload, size);
+  bench_msgpack(payload, size);
+  bench_path(payload, size);
+  bench_tape(payload, size);
+
+  free(payload);
+}
+
+void
+bench_numbers ()
+{
+  size_t count = 1000000;
+  char **numbers = allocate(count * sizeof(char*));
+
+  for (size_t i = 0; i < count; i++)
+    numbers[i] = i % 2 ? strf("%ld", (int64_t)rand() * (i % 7)): strf("%.*f", (int)(i % 7), (double)rand() / 1000);
+
+  for (int fast = 0; fast < 2; fast++)
+  {
+    char *end = NULL;
+    int64_t integer = 0;
+    double number = 0, sum = 0;
+
+    uint64_t t0 = ustamp();
+
+    for (size_t i = 0; i < count; i++)
+    {
+      int type = fast
+        ? json_number(numbers[i], &end, &integer, &number)
+        : json_number_libc(numbers[i], &end, &integer, &number);
+
+      sum += type == JSON_INTEGER ? integer: number;
+    }
+
+    uint64_t t1 = ustamp();
+
+    printf("%-18s %8.1f ns/number (%g)\n", fast ? "json_number": "strtoll+strtod", (double)(t1 - t0) * 1000 / count, sum);
+  }
+
+  for (size_t i = 0; i < count; i++)
+    free(numbers[i]);
+  free(numbers);
+}
+
+int
+bench_ndjson_count (json_t *record, void *payload)
+{
+  *(size_t*)payload += record->count;
+  return 0;
+}
+
+void
+bench_ndjson (char *path)
+{
+  char *generated = NULL;
+
+  if (!path)
+  {
+    path = generated = "bench.ndjson";
+    FILE *file = fopen(path, "w");
+    for (int i = 0; i < 1000000; i++)
+      fprintf(file, "{\"id\": %d, \"name\": \"item %d\", \"tags\": [\"a\", \"b\"], \"price\": %d.%02d, \"active\": %s}\n",
+        i, i, i % 1000, i % 100, i % 2 ? "true": "false");
+    fclose(file);
+  }
+
+  ndjson_t *ndjson = ndjson_open(path);
+  ensure(ndjson) errorf("cannot open %s", path);
+
+  printf("ndjson: %lu bytes, %lu chunks\n", ndjson->size, ndjson->count);
+
+  int cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (int workers = 1; workers <= cores * 2; workers *= 2)
+  {
+    for (int flags = 0; flags <= NDJSON_UNORDERED; flags++)
+    {
+      size_t fields = 0;
+      uint64_t t0 = ustamp();
+      size_t records = ndjson_each(ndjson, workers, flags, bench_ndjson_count, &fields);
+      uint64_t t1 = ustamp();
+
+      printf("%2d workers %-9s %8.3f GB/s %lu records\n", workers, flags ? "unordered": "ordered",
+        (double)ndjson->size / (t1 - t0) / 1000, records);
+    }
+  }
+
+  ndjson_close(ndjson);
+
+  if (generated)
+    unlink(generated);
+}
+
+void
+bench_pool_scan (pool_t *pool, char *label)
+{
+  uint64_t sum1 = 0, sum2 = 0;
+
+  uint64_t t0 = ustamp();
+  for (off_t pos = sizeof(pool_header_t); pos < pool->head->pnext; pos += pool->head->osize)
+    if (!pool_is_free(pool, pos)) sum1 += *(uint64_t*)pool_read(pool, pos, NULL);
+  uint64_t t1 = ustamp();
+  pool_each(pool, uint64_t *val)
+    sum2 += *val;
+  uint64_t t2 = ustamp();
+
+  printf("%-18s %8.3f ms per slot %8.3f ms pool_each (%lu %lu)\n", label,
+    (double)(t1 - t0) / 1000, (double)(t2 - t1) / 1000, sum1, sum2);
+}
+
+// usage: bench pool [records]
+void
+bench_pool (char *arg)
+{
+  size_t records = arg ? strtoull(arg, NULL, 10): 100000000;
+  pool_t pool;
+
+  unlink("bench.pool");
+  unlink("bench.pool.free");
+  pool_open(&pool, "bench.pool", sizeof(uint64_t), 1<<20);
+
+  uint64_t t0 = ustamp();
+  for (uint64_t i = 0; i < records; i++)
+    pool_write(&pool, pool_alloc(&pool), &i);
+  uint64_t t1 = ustamp();
+
+  printf("pool: %lu records %8.3f ms alloc\n", records, (double)(t1 - t0) / 1000);
+
+  bench_pool_scan(&pool, "dense");
+
+  // free nine runs of 1024 records in every ten
+  for (uint64_t i = 0; i < records; i++)
+    if ((i / 1024) % 10) pool_free(&pool, sizeof(pool_header_t) + i * pool.head->osize);
+
+  bench_pool_scan(&pool, "sparse");
+
+  pool_compact_t compact;
+  pool_compact_init(&compact, &pool, 1, NULL, NULL);
+
+  uint64_t t4 = ustamp(), slowest = 0;
+  size_t steps = 0;
+
+  for (int more = 1; more; steps++)
+  {
+    uint64_t t = ustamp();
+    more = pool_compact_step(&compact, 1<<16);
+    slowest = max(slowest, ustamp() - t);
+  }
+
+  uint64_t t5 = ustamp();
+
+  printf("%-18s %8.3f ms %lu steps, slowest %.3f ms, %lu moved\n", "pool_compact",
+    (double)(t5 - t4) / 1000, steps, (double)slowest / 1000, compact.moved);
+
+  bench_pool_scan(&pool, "compacted");
+
+  pool_close(&pool);
+
+  uint64_t t2 = ustamp();
+  pool_open(&pool, "bench.pool", sizeof(uint64_t), 1<<20);
+  uint64_t t3 = ustamp();
+
+  printf("%-18s %8.3f ms\n", "pool_open", (double)(t3 - t2) / 1000);
+
+  pool_close(&pool);
+  unlink("bench.pool");
+  unlink("bench.pool.free");
+}
+
+#ifdef TOOLBELT_THREAD
+typedef struct { pool_t *pool; pthread_mutex_t *mutex; size_t commits; } bench_journal_t;
+
+void*
+bench_journal_writer (void *ptr)
+{
+  bench_journal_t *bench = ptr;
+  pool_t *pool = bench->pool;
+
+  for (size_t i = 0; i < bench->commits; i++)
+  {
+    pthread_mutex_lock(bench->mutex);
+    uint64_t val = i;
+    pool_write(pool, pool_alloc(pool), &val);
+    pthread_mutex_unlock(bench->mutex);
+    pool_commit(pool);
+  }
+  return NULL;
+}
+
+typedef struct { pool_t *pool; int cached; size_t rounds; } bench_alloc_t;
+
+void*
+bench_alloc_worker (void *ptr)
+{
+  bench_alloc_t *bench = ptr;
+  pool_cache_t cache;
+  off_t held[16];
+
+  pool_cache_init(&cache, bench->pool);
+
+  for (size_t round = 0; round < bench->rounds; round++)
+  {
+    for (int i = 0; i < 16; i++)
+      held[i] = bench->cached ? pool_cache_alloc(&cache): pool_alloc(bench->pool);
+    for (int i = 0; i < 16; i++)
+      bench->cached ? pool_cache_free(&cache, held[i]): pool_free(bench->pool, held[i]);
+  }
+
+  pool_cache_flush(&cache);
+  return NULL;
+}
+
+// threads allocating and freeing from one pool, through the pool lock and
+// through per-thread caches
+void
+bench_alloc (size_t threads, size_t rounds)
+{
+  for (int cached = 0; cached < 2; cached++)
+  {
+    pool_t pool;
+    unlink("bench.pool");
+    unlink("bench.pool.free");
+    pool_open(&pool, "bench.pool", sizeof(uint64_t), 1<<16);
+
+    bench_alloc_t bench = { &pool, cached, rounds };
+    pthread_t ids[threads];
+
+    uint64_t t0 = ustamp();
+    for (size_t i = 0; i < threads; i++)
+      pthread_create(&ids[i], NULL, bench_alloc_worker, &bench);
+    for (size_t i = 0; i < threads; i++)
+      pthread_join(ids[i], NULL);
+    uint64_t t1 = ustamp();
+
+    printf("alloc: %lu threads %-15s %8.1f ns per alloc+free\n", threads, cached ? "pool_cache": "pool_alloc",
+      (double)(t1 - t0) * 1000 / (threads * rounds * 16));
+
+    pool_close(&pool);
+  }
+  unlink("bench.pool");
+  unlink("bench.pool.free");
+}
+#endif
+
+// commit a few changed records at a time to a large pool, with pool_sync
+// and then journaled
+// usage: bench journal [records]
+void
+bench_journal (char *arg)
+{
+  size_t records = arg ? strtoull(arg, NULL, 10): 10000000;
+  size_t rounds = 100, changes = 16;
+  pool_t pool;
+
+  unlink("bench.pool");
+  unlink("bench.pool.free");
+  unlink("bench.pool.wal");
+  pool_open(&pool, "bench.pool", sizeof(uint64_t), 1<<20);
+
+  for (uint64_t i = 0; i < records; i++)
+    pool_write(&pool, pool_alloc(&pool), &i);
+
+  pool_sync(&pool);
+  srand(1);
+
+  for (int journaled = 0; journaled < 2; journaled++)
+  {
+    if (journaled)
+      pool_journal(&pool);
+
+    uint64_t t0 = ustamp();
+
+    for (size_t round = 0; round < rounds; round++)
+    {
+      for (size_t i = 0; i < changes; i++)
+      {
+        off_t pos = sizeof(pool_header_t) + (rand() % records) * sizeof(uint64_t);
+        (*(uint64_t*)pool_read(&pool, pos, NULL))++;
+        pool_write(&pool, pos, NULL);
+      }
+      pool_sync(&pool);
+    }
+
+    uint64_t t1 = ustamp();
+
+    printf("journal: %lu records %-10s %8.3f ms per commit of %lu records\n",
+      records, journaled ? "pool_commit": "pool_sync", (double)(t1 - t0) / 1000 / rounds, changes);
+  }
+
+#ifdef TOOLBELT_THREAD
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  bench_journal_t bench = { &pool, &mutex, 200 };
+  pthread_t threads[8];
+  uint64_t syncs = pool_journal_syncs(&pool);
+
+  uint64_t t2 = ustamp();
+  for (int i = 0; i < 8; i++)
+    pthread_create(&threads[i], NULL, bench_journal_writer, &bench);
+  for (int i = 0; i < 8; i++)
+    pthread_join(threads[i], NULL);
+  uint64_t t3 = ustamp();
+
+  printf("journal: 8 threads %8.1f us per commit, %lu commits in %lu syncs\n",
+    (double)(t3 - t2) / (8 * bench.commits), 8 * bench.commits, pool_journal_syncs(&pool) - syncs);
+#endif
+
+  uint64_t t4 = ustamp();
+  pool_checkpoint(&pool);
+  pool_checkpoint_wait(&pool);
+  uint64_t t5 = ustamp();
+
+  printf("journal: %-18s %8.3f ms\n", "pool_checkpoint", (double)(t5 - t4) / 1000);
+
+  pool_close(&pool);
+  unlink("bench.pool");
+  unlink("bench.pool.free");
+  unlink("bench.pool.wal");
+}
+
+// churn a pool of variable-size chunks, replacing a random live chunk with
+// one of a random size each step
+void
+bench_store (size_t records)
+{
+  store_t store;
+  unlink("bench.store");
+  unlink("bench.store.free");
+  store_open(&store, "bench.store", 0);
+
+  uint64_t *ids = allocate(records * sizeof(uint64_t));
+  char text[256];
+  size_t used = 0, check = 0;
+
+  memset(text, 'x', sizeof(text));
+  srand(1);
+
+  uint64_t t0 = ustamp();
+
+  for (size_t i = 0; i < records; i++)
+  {
+    size_t bytes = 16 + rand() % 241;
+    ids[i] = store_insert(&store, text, bytes);
+    used += bytes;
+  }
+
+  uint64_t t1 = ustamp();
+
+  for (size_t i = 0; i < records; i++)
+  {
+    size_t bytes = 0;
+    store_get(&store, ids[i], &bytes);
+    check += bytes;
+  }
+
+  uint64_t t2 = ustamp();
+
+  store_each(&store, store_record_t *rec)
+    check -= rec->length;
+
+  uint64_t t3 = ustamp();
+
+  for (size_t step = 0; step < records; step++)
+  {
+    size_t i = rand() % records;
+    size_t bytes = 16 + rand() % 241;
+    used += bytes - store_length(&store, ids[i]);
+    store_update(&store, ids[i], text, bytes);
+  }
+
+  uint64_t t4 = ustamp();
+
+  printf("store: %lu records %8.1f ns/insert %8.1f ns/get %8.1f ns/each %8.1f ns/update, %lu KB live in %lu KB (%.1f%%) %s\n",
+    records, (double)(t1 - t0) * 1000 / records, (double)(t2 - t1) * 1000 / records,
+    (double)(t3 - t2) * 1000 / records, (double)(t4 - t3) * 1000 / records,
+    used / 1024, (store.pool.head->pnext - sizeof(pool_header_t)) / 1024,
+    (double)used * 100 / (store.pool.head->pnext - sizeof(pool_header_t)), check ? "mismatch": "");
+
+  free(ids);
+  store_close(&store);
+  unlink("bench.store");
+  unlink("bench.store.free");
+}
+
+void
+bench_chunks (size_t live, size_t steps)
+{
+  pool_t pool;
+  unlink("bench.pool");
+  unlink("bench.pool.free");
+  pool_open(&pool, "bench.pool", 16, 1<<16);
+
+  off_t *pos = allocate(live * sizeof(off_t));
+  size_t *bytes = allocate(live * sizeof(size_t));
+  size_t used = 0;
+
+  srand(1);
+
+  uint64_t t0 = ustamp();
+
+  for (size_t i = 0; i < live; i++)
+  {
+    bytes[i] = 16 + rand() % 1009;
+    pos[i] = pool_alloc_chunk(&pool, bytes[i]);
+    used += bytes[i];
+  }
+
+  uint64_t t1 = ustamp();
+
+  for (size_t step = 0; step < steps; step++)
+  {
+    size_t i = rand() % live;
+    pool_free_chunk(&pool, pos[i], bytes[i]);
+    used -= bytes[i];
+
+    bytes[i] = 16 + rand() % (step % 2 ? 1009: 97);
+    pos[i] = pool_alloc_chunk(&pool, bytes[i]);
+    used += bytes[i];
+  }
+
+  uint64_t t2 = ustamp();
+
+  printf("chunks: %lu live %8.1f ns/alloc fill %8.1f ns/free+alloc churn, %lu KB live in %lu KB (%.1f%%)\n",
+    live, (double)(t1 - t0) * 1000 / live, (double)(t2 - t1) * 1000 / steps,
+    used / 1024, (pool.head->pnext - sizeof(pool_header_t)) / 1024,
+    (double)used * 100 / (pool.head->pnext - sizeof(pool_header_t)));
+
+  free(pos);
+  free(bytes);
+  pool_close(&pool);
+  unlink("bench.pool");
+  unlink("bench.pool.free");
+}
+
+int
+main (int argc, char *argv[])
+{
+  char *section = argc > 1 ? argv[1]: NULL;
+  char *path = argc > 2 ? argv[2]: NULL;
+
+#ifdef TOOLBELT_THREAD
+  multithreaded();
+#endif
+
+  if (!section || str_eq(section, "json"))
+    bench_json(path);
+
+  if (!section || str_eq(section, "numbers"))
+    bench_numbers();
+
+  if (!section || str_eq(section, "ndjson"))
+    bench_ndjson(path);
+
+  if (!section || str_eq(section, "pool"))
+    bench_pool(section ? path: NULL);
+
+#ifdef TOOLBELT_THREAD
+  if (!section || str_eq(section, "alloc"))
+  {
+    bench_alloc(1, 1000000);
+    bench_alloc(4, 250000);
+  }
+#endif
+
+  if (!section || str_eq(section, "journal"))
+    bench_journal(section ? path: NULL);
+
+  if (!section || str_eq(section, "chunks"))
+  {
+    bench_chunks(10000, 100000);
+    bench_chunks(100000, 1000000);
+  }
+
+  if (!section || str_eq(section, "store"))
+  {
+    bench_store(100000);
+    bench_store(1000000);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -155,6 +155,13 @@ db_query (db_t *db, const char *query)
     errorf("%s", query);
   }
 
+  if (!str_utf8_valid((char*)query, strlen(query)))
+  {
+    if (db->flags & DB_LOG_ERRORS)
+      errorf("PostgresSQL query is not valid UTF-8: %s", query);
+    return NULL;
+  }
+
   dbr_t *dbr = allocate(sizeof(dbr_t));
   dbr->res = PQexec(db->conn, query);
   dbr->row_map   = NULL;
@@ -370,7 +377,7 @@ sql_get_select (sql_t *sql, char *comment)
   vector_each(sql->fields, char *field)
     textf_ins(fields, "%s,", field);
 
-  text_trim(fields, iscomma);
+  text_unsep(fields, ",");
 
   if (!text_count(fields))
     text_set(fields, "*");
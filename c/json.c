@@ -7,15 +7,134 @@
 #define JSON_DOUBLE 6
 #define JSON_BOOLEAN 7
 
+#define JSON_ESCAPED (1<<0)
+#define JSON_ARENA (1<<1)
+#define JSON_INDEXED (1<<2)
+#define JSON_RAW (1<<3)
+#define JSON_TAPE (1<<4)
+#define JSON_TAPE_ROOT (1<<5)
+#define JSON_CACHED (1<<6)
+
+#define JSON_INDEX_KEYS 16
+#define JSON_INDEX_ITEMS 16
+
+struct _json_index_t;
+
 typedef struct _json_t {
   int type;
+  int flags;
   char *start;
   size_t length;
   struct _json_t *sibling;
   struct _json_t *children;
+  size_t count;
+  struct _json_index_t *index;
+  union {
+    int64_t integer;
+    double number;
+  } value;
 } json_t;
 
+// Built when a container is parsed or decoded, so accessors only read it
+// and a parsed tree can be shared read-only between threads. Objects with
+// at least JSON_INDEX_KEYS keys get an open addressing table of keys;
+// arrays with at least JSON_INDEX_ITEMS items get slots[i] = item i.
+// Trees put together by hand are searched linearly until json_index.
+typedef struct _json_index_t {
+  size_t width;
+  json_t **slots;
+  uint32_t *hashes;
+} json_index_t;
+
 json_t* json_parse (char *subject);
+json_index_t* json_index (json_t *json);
+void json_tape_close (json_t *root);
+void json_free (json_t *json);
+
+#define JSON_ARENA_CHUNK (1<<16)
+
+// Nodes are bump allocated from JSON_ARENA_CHUNK sized chunks aligned on
+// their size, so the chunk header and arena can be found from any node.
+typedef struct _json_arena_t {
+  struct _json_arena_t *head;
+  struct _json_arena_t *chunk;
+  struct _json_arena_t *prev;
+  void **large;
+  json_t *root;
+  size_t used;
+} json_arena_t;
+
+static __thread json_arena_t *json_arena_current = NULL;
+
+#define json_arena_of(j) (((json_arena_t*)((uintptr_t)(j) & ~((uintptr_t)JSON_ARENA_CHUNK-1)))->head)
+
+json_arena_t*
+json_arena_chunk (json_arena_t *head)
+{
+  void *ptr = NULL;
+
+  ensure(posix_memalign(&ptr, JSON_ARENA_CHUNK, JSON_ARENA_CHUNK) == 0)
+    errorf("posix_memalign failed %lu bytes", (size_t)JSON_ARENA_CHUNK);
+
+  json_arena_t *chunk = ptr;
+  memset(chunk, 0, sizeof(json_arena_t));
+  chunk->head = head ? head: chunk;
+  chunk->used = (sizeof(json_arena_t) + 15) & ~15;
+  return chunk;
+}
+
+json_arena_t*
+json_arena_new ()
+{
+  json_arena_t *arena = json_arena_chunk(NULL);
+  arena->chunk = arena;
+  return arena;
+}
+
+void*
+json_arena_alloc (json_arena_t *arena, size_t bytes)
+{
+  bytes = (bytes + 15) & ~15;
+
+  if (bytes > JSON_ARENA_CHUNK / 4)
+  {
+    void **ptr = allocate(bytes + 16);
+    ptr[0] = arena->large;
+    arena->large = ptr;
+    return (char*)ptr + 16;
+  }
+
+  json_arena_t *chunk = arena->chunk;
+
+  if (chunk->used + bytes > JSON_ARENA_CHUNK)
+  {
+    chunk = json_arena_chunk(arena);
+    chunk->prev = arena->chunk;
+    arena->chunk = chunk;
+  }
+
+  void *ptr = (char*)chunk + chunk->used;
+  chunk->used += bytes;
+  return ptr;
+}
+
+void
+json_arena_free (json_arena_t *arena)
+{
+  while (arena->large)
+  {
+    void **ptr = arena->large;
+    arena->large = ptr[0];
+    free(ptr);
+  }
+  while (arena->chunk != arena)
+  {
+    json_arena_t *chunk = arena->chunk;
+    arena->chunk = chunk->prev;
+    free(chunk);
+  }
+  free(arena);
+}
 
 #define json_is_integer(j) ((j) && (j)->type == JSON_INTEGER)
 #define json_is_double(j) ((j) && (j)->type == JSON_DOUBLE)
@@ -24,21 +143,307 @@ json_t* json_parse (char *subject);
 #define json_is_object(j) ((j) && (j)->type == JSON_OBJECT)
 #define json_is_boolean(j) ((j) && (j)->type == JSON_BOOLEAN)
 
-#define json_double(j) strtod((j)->start, NULL)
-#define json_integer(j) strtoll((j)->start, NULL, 0)
+static const double json_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Value of eight ASCII digits, all already known to be '0'..'9'
+static inline uint64_t
+json_digits8 (char *p)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t v;
+  memmove(&v, p, 8);
+  v -= 0x3030303030303030ULL;
+  v = v * 10 + (v >> 8);
+  return ((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))
+    + ((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32))) >> 32;
+#else
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++)
+    v = v * 10 + (p[i] - '0');
+  return v;
+#endif
+}
+
+// Append digits [p,end) to mantissa m while it has fewer than 19 digits.
+// Returns the first digit not consumed.
+static inline char*
+json_mantissa (char *p, char *end, uint64_t *m, int *n)
+{
+  while (p < end && *n < 19)
+  {
+    if (end - p >= 8 && *n <= 11)
+    {
+      *m = *m * 100000000 + json_digits8(p);
+      p += 8;
+      *n += 8;
+    }
+    else
+    {
+      *m = *m * 10 + (*p++ - '0');
+      *n += 1;
+    }
+  }
+  return p;
+}
+
+int
+json_number_libc (char *subject, char **end, int64_t *integer, double *number)
+{
+  char *e1 = NULL;
+  char *e2 = NULL;
+
+  int64_t i = strtoll(subject, &e1, 0);
+  double d = strtod(subject, &e2);
+
+  if (e1 >= e2)
+  {
+    *end = e1;
+    *integer = i;
+    return JSON_INTEGER;
+  }
+
+  *end = e2;
+  *number = d;
+  return JSON_DOUBLE;
+}
+
+// Classify and convert a number in one pass. Returns JSON_INTEGER or
+// JSON_DOUBLE and sets *end past the number (to subject if there is none).
+// Doubles with up to 19 significant digits and a small exponent are exact
+// in one multiply or divide. Hex, octal, very long or very large numbers go
+// through strtoll/strtod, so results always match libc.
+int
+json_number (char *subject, char **end, int64_t *integer, double *number)
+{
+  char *p = subject;
+  int negative = *p == '-';
+
+  if (*p == '-' || *p == '+')
+    p++;
+
+  if (!isdigit(*p) && !(*p == '.' && isdigit(p[1])))
+    return json_number_libc(subject, end, integer, number);
+
+  if (p[0] == '0' && (isdigit(p[1]) || p[1] == 'x' || p[1] == 'X'))
+    return json_number_libc(subject, end, integer, number);
+
+  char *whole = p;
+  while (isdigit(*p)) p++;
+  char *whole_end = p;
+
+  char *frac = p, *frac_end = p;
+
+  if (*p == '.')
+  {
+    frac = ++p;
+    while (isdigit(*p)) p++;
+    frac_end = p;
+  }
+
+  int64_t exponent = 0;
+  int is_double = frac != whole_end;
+
+  if ((*p == 'e' || *p == 'E') && (isdigit(p[1]) || ((p[1] == '-' || p[1] == '+') && isdigit(p[2]))))
+  {
+    int eneg = *++p == '-';
+    if (*p == '-' || *p == '+') p++;
+
+    while (isdigit(*p))
+    {
+      if (exponent < 100000)
+        exponent = exponent * 10 + (*p - '0');
+      p++;
+    }
+    exponent = eneg ? -exponent: exponent;
+    is_double = 1;
+  }
+
+  uint64_t m = 0;
+  int n = 0;
+
+  if (whole_end - whole == 1 && whole[0] == '0')
+    whole++;
+
+  if (json_mantissa(whole, whole_end, &m, &n) != whole_end)
+    return json_number_libc(subject, end, integer, number);
+
+  if (!is_double)
+  {
+    if (m > (uint64_t)INT64_MAX + negative)
+      return json_number_libc(subject, end, integer, number);
+
+    *end = p;
+    *integer = negative ? (int64_t)(0 - m): (int64_t)m;
+    return JSON_INTEGER;
+  }
+
+  char *f = frac;
+
+  if (!m)
+    while (f < frac_end && *f == '0') f++;
+
+  if (json_mantissa(f, frac_end, &m, &n) != frac_end)
+    return json_number_libc(subject, end, integer, number);
+
+  exponent -= frac_end - frac;
+
+  if (m > (1ULL << 53) || exponent < -22 || exponent > 22)
+  {
+    if (m)
+      return json_number_libc(subject, end, integer, number);
+    exponent = 0;
+  }
+
+  double d = m;
+  d = exponent < 0 ? d / json_pow10[-exponent]: d * json_pow10[exponent];
+
+  *end = p;
+  *number = negative ? -d: d;
+  return JSON_DOUBLE;
+}
+
+// Numbers from the parsers carry JSON_CACHED and a converted value; any
+// other node is read from its text
+static inline int64_t
+json_integer (json_t *json)
+{
+  return !(json->flags & JSON_CACHED) ? strtoll(json->start, NULL, 0)
+    : json->type == JSON_DOUBLE ? (int64_t)json->value.number
+    : json->value.integer;
+}
+
+static inline double
+json_double (json_t *json)
+{
+  return !(json->flags & JSON_CACHED) ? strtod(json->start, NULL)
+    : json->type == JSON_DOUBLE ? json->value.number
+    : (double)json->value.integer;
+}
+
 #define json_boolean(j) (strchr("tT", (j)->start[0]) != NULL)
 
+int
+json_hex4 (char *s)
+{
+  int n = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    int c = (unsigned char)s[i];
+    int v = isdigit(c) ? c - '0': (c >= 'a' && c <= 'f') ? c - 'a' + 10: (c >= 'A' && c <= 'F') ? c - 'A' + 10: -1;
+    if (v < 0) return -1;
+    n = n * 16 + v;
+  }
+  return n;
+}
+
+// Decode JSON escapes including \uXXXX and surrogate pairs. dst may alias
+// src. Unpaired surrogates pass through. Returns decoded length.
+size_t
+json_unescape (char *dst, char *src, size_t length)
+{
+  size_t o = 0;
+
+  for (size_t i = 0; i < length; i++)
+  {
+    int c = src[i];
+
+    if (c != '\\' || i + 1 == length)
+    {
+      dst[o++] = c;
+      continue;
+    }
+
+    c = src[++i];
+
+    if (c == 'u' && i + 4 < length && json_hex4(src + i + 1) >= 0)
+    {
+      uint32_t cp = json_hex4(src + i + 1);
+      i += 4;
+
+      if (cp >= 0xD800 && cp <= 0xDBFF && i + 6 < length && src[i+1] == '\\' && src[i+2] == 'u' && json_hex4(src + i + 3) >= 0xDC00 && json_hex4(src + i + 3) <= 0xDFFF)
+      {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (json_hex4(src + i + 3) - 0xDC00);
+        i += 6;
+      }
+
+      if (cp < 0x80)
+        dst[o++] = cp;
+      else
+      if (cp < 0x800)
+      {
+        dst[o++] = 0xC0 | (cp >> 6);
+        dst[o++] = 0x80 | (cp & 0x3F);
+      }
+      else
+      if (cp < 0x10000)
+      {
+        dst[o++] = 0xE0 | (cp >> 12);
+        dst[o++] = 0x80 | ((cp >> 6) & 0x3F);
+        dst[o++] = 0x80 | (cp & 0x3F);
+      }
+      else
+      {
+        dst[o++] = 0xF0 | (cp >> 18);
+        dst[o++] = 0x80 | ((cp >> 12) & 0x3F);
+        dst[o++] = 0x80 | ((cp >> 6) & 0x3F);
+        dst[o++] = 0x80 | (cp & 0x3F);
+      }
+      continue;
+    }
+
+         if (c == 'b') c = '\b';
+    else if (c == 'f') c = '\f';
+    else if (c == 'n') c = '\n';
+    else if (c == 'r') c = '\r';
+    else if (c == 't') c = '\t';
+
+    dst[o++] = c;
+  }
+  return o;
+}
+
+// Unescaped string content in place (not NUL terminated), or NULL if the
+// string contains escapes and must be decoded with json_string.
+char*
+json_string_view (json_t *json, size_t *length)
+{
+  if (json->flags & JSON_ESCAPED)
+    return NULL;
+
+  if (json->flags & JSON_RAW || json->start[0] != '"')
+  {
+    *length = json->length;
+    return json->start;
+  }
+
+  *length = json->length - 1 - (json->length > 1 && json->start[json->length-1] == '"');
+  return json->start + 1;
+}
+
 char*
 json_string (json_t *json)
 {
-  return isalpha(json->start[0]) ? str_copy(json->start, str_skip(json->start, isname)): str_decode(json->start, NULL, STR_ENCODE_DQUOTE);
+  size_t length = 0;
+  char *view = json_string_view(json, &length);
+  if (view)
+    return str_copy(view, length);
+
+  length = json->length - 1 - (json->length > 1 && json->start[json->length-1] == '"');
+  char *str = allocate(length + 1);
+  str[json_unescape(str, json->start + 1, length)] = 0;
+  return str;
 }
 
 json_t*
 json_new ()
 {
-  json_t *json = allocate(sizeof(json_t));
+  json_arena_t *arena = json_arena_current;
+  json_t *json = arena ? json_arena_alloc(arena, sizeof(json_t)): allocate(sizeof(json_t));
   memset(json, 0, sizeof(json_t));
+  json->flags = arena ? JSON_ARENA: 0;
   return json;
 }
 
@@ -55,38 +460,32 @@ json_parse_boolean (char *subject)
 json_t*
 json_parse_number (char *subject)
 {
-  char *e1 = NULL;
-  char *e2 = NULL;
-
-  strtoll(subject, &e1, 0);
-  strtod(subject, &e2);
+  char *end = subject;
 
   json_t *json = json_new();
-  json->type   = JSON_NUMBER;
+  json->type   = json_number(subject, &end, &json->value.integer, &json->value.number);
+  json->flags |= JSON_CACHED;
   json->start  = subject;
+  json->length = end - subject;
 
-  if (e1 >= e2)
-  {
-    json->length = e1 - subject;
-    json->type = JSON_INTEGER;
-  }
-  else
-  {
-    json->length = e2 - subject;
-    json->type = JSON_DOUBLE;
-  }
   return json;
 }
 
 json_t*
 json_parse_string (char *subject)
 {
-  char *end = NULL;
+  char *end = subject;
+  int flags = 0;
 
   if (subject[0] == '"')
   {
-    char *str = str_decode(subject, &end, STR_ENCODE_DQUOTE);
-    free(str);
+    for (end++; ; end += end[1] ? 2: 1)
+    {
+      end += strcspn(end, "\"\\");
+      if (*end != '\\') break;
+      flags |= JSON_ESCAPED;
+    }
+    if (*end == '"') end++;
   }
   else
   {
@@ -95,6 +494,7 @@ json_parse_string (char *subject)
 
   json_t *json = json_new();
   json->type   = JSON_STRING;
+  json->flags |= flags;
   json->start  = subject;
   json->length = end - subject;
 
@@ -140,7 +540,10 @@ json_parse_array (char *subject)
     json_t *item = json_parse(subject);
 
     if (!item || !item->length)
+    {
+      json_free(item);
       break;
+    }
 
     subject = item->start + item->length;
 
@@ -154,8 +557,10 @@ json_parse_array (char *subject)
       last = item;
       json->children = item;
     }
+    json->count++;
   }
   json->length = subject - start;
+  json_index(json);
 
 done:
   return json;
@@ -200,7 +605,10 @@ json_parse_object (char *subject)
     json_t *item = json_parse(subject);
 
     if (!item || !item->length)
+    {
+      json_free(item);
       break;
+    }
 
     subject = item->start + item->length;
 
@@ -214,8 +622,10 @@ json_parse_object (char *subject)
       last = item;
       json->children = item;
     }
+    json->count++;
   }
   json->length = subject - start;
+  json_index(json);
 
 done:
   return json;
@@ -242,44 +652,250 @@ json_parse (char *subject)
   return child;
 }
 
+// Parse with all nodes allocated from one arena, freed by json_free(root)
+json_t*
+json_parse_arena (char *subject)
+{
+  json_arena_t *arena = json_arena_new();
+
+  json_arena_current = arena;
+  json_t *json = json_parse(subject);
+  json_arena_current = NULL;
+
+  if (json)
+    arena->root = json;
+  else
+    json_arena_free(arena);
+
+  return json;
+}
+
 void
 json_free (json_t *json)
 {
+  if (json && json->flags & JSON_TAPE)
+  {
+    if (json->flags & JSON_TAPE_ROOT)
+      json_tape_close(json);
+    return;
+  }
+
+  if (json && json->flags & JSON_ARENA)
+  {
+    json_arena_t *arena = json_arena_of(json);
+    if (arena->root == json)
+      json_arena_free(arena);
+    return;
+  }
+
   while (json && json->children)
   {
     json_t *item = json->children;
     json->children = item->sibling;
     json_free(item);
   }
+  if (json)
+    free(json->index);
   free(json);
 }
 
+uint32_t
+json_hash (char *str, size_t length)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+  return hash;
+}
+
+int
+json_key_eq (json_t *key, char *name, size_t length)
+{
+  size_t klen = 0;
+  char *view = json_string_view(key, &klen);
+
+  if (view)
+    return klen == length && !memcmp(view, name, length);
+
+  char *str = json_string(key);
+  int eq = !strcmp(str, name);
+  free(str);
+  return eq;
+}
+
+uint32_t
+json_key_hash (json_t *key)
+{
+  size_t length = 0;
+  char *view = json_string_view(key, &length);
+
+  if (view)
+    return json_hash(view, length);
+
+  char *str = json_string(key);
+  uint32_t hash = json_hash(str, strlen(str));
+  free(str);
+  return hash;
+}
+
+json_index_t*
+json_index_new (json_t *json, size_t bytes)
+{
+  json_index_t *index = json->flags & JSON_ARENA ? json_arena_alloc(json_arena_of(json), bytes): allocate(bytes);
+  memset(index, 0, bytes);
+  return index;
+}
+
+json_index_t*
+json_object_index (json_t *json)
+{
+  if (json->flags & JSON_INDEXED)
+    return json->index;
+
+  json->flags |= JSON_INDEXED;
+
+  size_t keys = 0;
+  for (json_t *key = json->children; key && key->sibling; key = key->sibling->sibling)
+    keys++;
+
+  if (keys < JSON_INDEX_KEYS)
+    return NULL;
+
+  size_t width = 1;
+  while (width < keys * 2)
+    width <<= 1;
+
+  size_t bytes = sizeof(json_index_t) + width * (sizeof(json_t*) + sizeof(uint32_t));
+  json_index_t *index = json_index_new(json, bytes);
+
+  index->width  = width;
+  index->slots  = (json_t**)(index + 1);
+  index->hashes = (uint32_t*)(index->slots + width);
+
+  for (json_t *key = json->children; key && key->sibling; key = key->sibling->sibling)
+  {
+    if (key->type != JSON_STRING)
+      continue;
+
+    uint32_t hash = json_key_hash(key);
+
+    size_t slot = hash & (width-1);
+    while (index->slots[slot])
+      slot = (slot + 1) & (width-1);
+
+    index->slots[slot] = key;
+    index->hashes[slot] = hash;
+  }
+
+  json->index = index;
+  return index;
+}
+
 json_t*
 json_object_get (json_t *json, char *name)
 {
   if (!json || json->type != JSON_OBJECT)
     return NULL;
 
-  for (json_t *key = json->children; key && key->sibling; key = key->sibling)
+  size_t length = strlen(name);
+  json_index_t *index = json->flags & JSON_INDEXED ? json->index: NULL;
+
+  if (index)
   {
-    if (key->type == JSON_STRING && key->sibling)
+    uint32_t hash = json_hash(name, length);
+
+    for (size_t slot = hash & (index->width-1); index->slots[slot]; slot = (slot + 1) & (index->width-1))
     {
-      char *str = json_string(key);
-      int found = !strcmp(str, name);
-      free(str);
-      if (found) return key->sibling;
+      if (index->hashes[slot] == hash && json_key_eq(index->slots[slot], name, length))
+        return index->slots[slot]->sibling;
     }
+    return NULL;
+  }
+
+  for (json_t *key = json->children; key && key->sibling; key = key->sibling)
+  {
+    if (key->type == JSON_STRING && json_key_eq(key, name, length))
+      return key->sibling;
     key = key->sibling;
   }
   return NULL;
 }
 
+json_index_t*
+json_array_index (json_t *json)
+{
+  if (json->flags & JSON_INDEXED)
+    return json->index;
+
+  json->flags |= JSON_INDEXED;
+
+  if (json->count < JSON_INDEX_ITEMS)
+    return NULL;
+
+  json_index_t *index = json_index_new(json, sizeof(json_index_t) + json->count * sizeof(json_t*));
+
+  index->width = json->count;
+  index->slots = (json_t**)(index + 1);
+
+  size_t i = 0;
+  for (json_t *item = json->children; item && i < json->count; item = item->sibling)
+    index->slots[i++] = item;
+
+  json->index = index;
+  return index;
+}
+
+json_index_t*
+json_index (json_t *json)
+{
+  if (json->type == JSON_OBJECT)
+    return json_object_index(json);
+
+  if (json->type == JSON_ARRAY)
+    return json_array_index(json);
+
+  return NULL;
+}
+
+size_t
+json_array_count (json_t *json)
+{
+  if (!json || json->type != JSON_ARRAY)
+    return 0;
+
+  if (json->count)
+    return json->count;
+
+  size_t count = 0;
+  for (json_t *item = json->children; item; item = item->sibling)
+    count++;
+  return count;
+}
+
+json_t*
+json_array_next (json_t *json, json_t *item)
+{
+  return item ? item->sibling: (json && json->type == JSON_ARRAY ? json->children: NULL);
+}
+
+typedef struct { off_t index; json_t *json; json_t *item; int l1; } json_array_each_t;
+
+#define json_array_each(l,_val_) for ( \
+  json_array_each_t loop = { 0, (l), NULL, 0 }; \
+    !loop.l1 && (loop.item = json_array_next(loop.json, loop.item)) && (loop.l1 = 1); \
+    loop.index++ \
+  ) \
+    for (_val_ = loop.item; loop.l1; loop.l1 = !loop.l1)
+
 json_t*
 json_array_get (json_t *json, int index)
 {
-  if (!json || json->type != JSON_ARRAY)
+  if (!json || json->type != JSON_ARRAY || index < 0 || (json->count && index >= json->count))
     return NULL;
 
+  if (json->flags & JSON_INDEXED && json->index)
+    return json->index->slots[index];
+
   int i = 0;
   for (json_t *item = json->children; item; item = item->sibling)
   {
@@ -0,0 +1,311 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Two stage parser. Stage one classifies 64 bytes at a time into bitmasks
+// and records the offsets of structural characters, quotes and the first
+// byte of each bare scalar. Stage two walks those offsets building an arena
+// json_t tree readable by the usual accessors.
+
+typedef struct {
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t op;
+  uint64_t ws;
+} json_block_t;
+
+#ifdef __SSE2__
+
+static inline uint64_t
+json_block_eq (__m128i v, char c)
+{
+  return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+void
+json_block (unsigned char *p, json_block_t *block)
+{
+  memset(block, 0, sizeof(json_block_t));
+
+  for (int i = 0; i < 4; i++)
+  {
+    __m128i v = _mm_loadu_si128((__m128i*)(p + i*16));
+    __m128i l = _mm_or_si128(v, _mm_set1_epi8(0x20));
+
+    block->quote     |= json_block_eq(v, '"') << (i*16);
+    block->backslash |= json_block_eq(v, '\\') << (i*16);
+    block->op        |= (json_block_eq(l, '{') | json_block_eq(l, '}') | json_block_eq(v, ':') | json_block_eq(v, ',')) << (i*16);
+    block->ws        |= (json_block_eq(v, ' ') | json_block_eq(v, '\t') | json_block_eq(v, '\n') | json_block_eq(v, '\r')) << (i*16);
+  }
+}
+
+#else
+
+void
+json_block (unsigned char *p, json_block_t *block)
+{
+  memset(block, 0, sizeof(json_block_t));
+
+  for (int i = 0; i < 64; i++)
+  {
+    uint64_t bit = 1ULL << i;
+    int c = p[i];
+
+    if (c == '"') block->quote |= bit;
+    else if (c == '\\') block->backslash |= bit;
+    else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',') block->op |= bit;
+    else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') block->ws |= bit;
+  }
+}
+
+#endif
+
+static inline uint64_t
+json_prefix_xor (uint64_t x)
+{
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+// bits of characters preceded by an odd number of backslashes
+static inline uint64_t
+json_escaped (uint64_t backslash, uint64_t *carry)
+{
+  const uint64_t even = 0x5555555555555555ULL;
+
+  backslash &= ~*carry;
+  uint64_t follows = backslash << 1 | *carry;
+  uint64_t odd_starts = backslash & ~even & ~follows;
+  uint64_t sequences = 0;
+  *carry = __builtin_add_overflow(odd_starts, backslash, &sequences);
+  return (even ^ (sequences << 1)) & follows;
+}
+
+// Offsets of the structural characters in subject, or NULL if it is too
+// long for 32 bit offsets
+uint32_t*
+json_structure (char *subject, size_t length, size_t *count)
+{
+  if (length >= UINT32_MAX)
+    return NULL;
+
+  size_t n = 0, limit = length / 4 + 64;
+  uint32_t *index = allocate(limit * sizeof(uint32_t));
+
+  uint64_t prev_escaped = 0, prev_string = 0, prev_scalar = 0;
+  unsigned char pad[64];
+
+  for (size_t base = 0; base < length; base += 64)
+  {
+    unsigned char *p = (unsigned char*)subject + base;
+
+    if (length - base < 64)
+    {
+      memset(pad, ' ', 64);
+      memmove(pad, p, length - base);
+      p = pad;
+    }
+
+    json_block_t block;
+    json_block(p, &block);
+
+    uint64_t quotes = block.quote & ~json_escaped(block.backslash, &prev_escaped);
+    uint64_t string = json_prefix_xor(quotes) ^ prev_string;
+    prev_string = (uint64_t)((int64_t)string >> 63);
+
+    uint64_t scalar = ~(block.op | block.ws);
+    uint64_t plain = scalar & ~block.quote;
+    uint64_t follows = plain << 1 | prev_scalar;
+    prev_scalar = plain >> 63;
+
+    uint64_t bits = ((block.op | (scalar & ~follows)) & ~string) | quotes;
+
+    if (n + 64 > limit)
+    {
+      limit = limit * 2 + 64;
+      index = reallocate(index, limit * sizeof(uint32_t));
+    }
+
+    while (bits)
+    {
+      index[n++] = base + __builtin_ctzll(bits);
+      bits &= bits - 1;
+    }
+  }
+
+  *count = n;
+  return index;
+}
+
+typedef struct _json_builder_t {
+  json_t **stack;
+  json_t **last;
+  size_t limit;
+} json_builder_t;
+
+void
+json_builder_init (json_builder_t *builder)
+{
+  builder->limit = 32;
+  builder->stack = allocate(builder->limit * sizeof(json_t*));
+  builder->last = allocate(builder->limit * sizeof(json_t*));
+}
+
+void
+json_builder_clear (json_builder_t *builder)
+{
+  free(builder->stack);
+  free(builder->last);
+}
+
+// Stage two. Builds one value from index entries [*next, count) in the
+// current arena, and leaves *next at the first entry not consumed. end
+// bounds the length of containers that are never closed.
+json_t*
+json_build (json_builder_t *builder, char *subject, char *end, uint32_t *index, size_t count, size_t *next)
+{
+  size_t depth = 0, i = *next;
+  json_t **stack = builder->stack, **last = builder->last;
+  json_t *root = NULL;
+
+  for (; i < count; i++)
+  {
+    char *p = subject + index[i];
+    int c = *p;
+    json_t *node = NULL;
+
+    if (c == ':' || c == ',')
+      continue;
+
+    if (c == '}' || c == ']')
+    {
+      if (!depth)
+        break;
+
+      json_t *json = stack[--depth];
+      json->length = p + 1 - json->start;
+      json_index(json);
+
+      if (!depth)
+      {
+        i++;
+        break;
+      }
+      continue;
+    }
+
+    if (c == '{' || c == '[')
+    {
+      node = json_new();
+      node->type  = c == '{' ? JSON_OBJECT: JSON_ARRAY;
+      node->start = p;
+    }
+    else
+    if (c == '"')
+    {
+      char *close = end;
+
+      if (i + 1 < count)
+        close = subject + index[++i] + 1;
+
+      node = json_new();
+      node->type   = JSON_STRING;
+      node->start  = p;
+      node->length = close - p;
+
+      if (memchr(p, '\\', node->length))
+        node->flags |= JSON_ESCAPED;
+    }
+    else
+    if (strchr("tTfF", c))
+      node = json_parse_boolean(p);
+    else
+    if (isalpha(c))
+      node = json_parse_string(p);
+    else
+      node = json_parse_number(p);
+
+    if (!node->length && node->type != JSON_OBJECT && node->type != JSON_ARRAY)
+      continue;
+
+    if (!root)
+    {
+      root = node;
+    }
+    else
+    {
+      if (last[depth-1])
+        last[depth-1]->sibling = node;
+      else
+        stack[depth-1]->children = node;
+
+      last[depth-1] = node;
+      stack[depth-1]->count++;
+    }
+
+    if (node->type == JSON_OBJECT || node->type == JSON_ARRAY)
+    {
+      if (depth == builder->limit)
+      {
+        builder->limit *= 2;
+        builder->stack = stack = reallocate(stack, builder->limit * sizeof(json_t*));
+        builder->last = last = reallocate(last, builder->limit * sizeof(json_t*));
+      }
+      stack[depth] = node;
+      last[depth] = NULL;
+      depth++;
+    }
+    else
+    if (!depth)
+    {
+      i++;
+      break;
+    }
+  }
+
+  while (depth)
+  {
+    json_t *json = stack[--depth];
+    json->length = end - json->start;
+    json_index(json);
+  }
+
+  *next = i;
+  return root;
+}
+
+json_t*
+json_parse_fast (char *subject)
+{
+  size_t length = strlen(subject), count = 0, next = 0;
+  uint32_t *index = json_structure(subject, length, &count);
+
+  // too large for stage one; json_parse has no such limit
+  if (!index)
+    return NULL;
+
+  json_builder_t builder;
+  json_builder_init(&builder);
+
+  json_arena_t *arena = json_arena_new();
+  json_arena_current = arena;
+
+  json_t *root = json_build(&builder, subject, subject + length, index, count, &next);
+
+  json_arena_current = NULL;
+
+  free(index);
+  json_builder_clear(&builder);
+
+  if (root)
+    arena->root = root;
+  else
+    json_arena_free(arena);
+
+  return root;
+}
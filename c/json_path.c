@@ -0,0 +1,387 @@
+// Compiled path queries. Supports a JSONPath subset ($, .name, .*, [n],
+// [*], ['name'], ["name"]) and JSON pointers (/a/0/b, with ~0 and ~1).
+// Paths run against a parsed tree, or drive a scan of the source text that
+// builds nodes only for matches and skips everything else.
+
+#define JSON_PATH_KEY 1
+#define JSON_PATH_ANY 2
+
+#define JSON_PATH_NONE SIZE_MAX
+
+typedef int (*json_path_cb)(json_t*, void*);
+
+typedef struct _json_path_step_t {
+  int type;
+  char *key;
+  size_t length;
+  size_t index;
+} json_path_step_t;
+
+typedef struct _json_path_t {
+  json_path_step_t *steps;
+  size_t count;
+} json_path_t;
+
+void
+json_path_free (json_path_t *path)
+{
+  if (path)
+  {
+    for (size_t i = 0; i < path->count; i++)
+      free(path->steps[i].key);
+    free(path->steps);
+    free(path);
+  }
+}
+
+json_path_step_t*
+json_path_step (json_path_t *path, int type, char *key, size_t length)
+{
+  path->steps = reallocate(path->steps, (path->count + 1) * sizeof(json_path_step_t));
+
+  json_path_step_t *step = &path->steps[path->count++];
+  step->type = type;
+  step->key = key ? str_copy(key, length): NULL;
+  step->length = length;
+  step->index = JSON_PATH_NONE;
+
+  // json_array_get takes an int, so larger indexes match nothing
+  if (key && length && length < 11 && str_skip(step->key, isdigit) == length && strtoull(step->key, NULL, 10) <= INT32_MAX)
+    step->index = strtoull(step->key, NULL, 10);
+
+  return step;
+}
+
+// NULL if expr is not a valid path
+json_path_t*
+json_path_compile (char *expr)
+{
+  json_path_t *path = allocate(sizeof(json_path_t));
+  memset(path, 0, sizeof(json_path_t));
+
+  char *p = expr;
+
+  if (*p == '/' || !*p)
+  {
+    while (*p == '/')
+    {
+      size_t length = strcspn(++p, "/");
+      char key[length+1];
+      size_t n = 0;
+
+      for (size_t i = 0; i < length; i++)
+      {
+        if (p[i] == '~' && (p[i+1] == '0' || p[i+1] == '1'))
+          key[n++] = p[++i] == '0' ? '~': '/';
+        else
+          key[n++] = p[i];
+      }
+      json_path_step(path, JSON_PATH_KEY, key, n);
+      p += length;
+    }
+    return path;
+  }
+
+  if (*p++ != '$')
+    goto fail;
+
+  while (*p)
+  {
+    if (p[0] == '.' && p[1] == '*')
+    {
+      json_path_step(path, JSON_PATH_ANY, NULL, 0);
+      p += 2;
+    }
+    else
+    if (p[0] == '.')
+    {
+      size_t length = strcspn(++p, ".[");
+      if (!length) goto fail;
+      json_path_step(path, JSON_PATH_KEY, p, length);
+      p += length;
+    }
+    else
+    if (p[0] == '[' && p[1] == '*' && p[2] == ']')
+    {
+      json_path_step(path, JSON_PATH_ANY, NULL, 0);
+      p += 3;
+    }
+    else
+    if (p[0] == '[' && (p[1] == '\'' || p[1] == '"'))
+    {
+      char *end = strchr(p + 2, p[1]);
+      if (!end || end[1] != ']') goto fail;
+      json_path_step(path, JSON_PATH_KEY, p + 2, end - p - 2);
+      p = end + 2;
+    }
+    else
+    if (p[0] == '[' && isdigit(p[1]))
+    {
+      size_t length = str_skip(p + 1, isdigit);
+      if (p[length+1] != ']') goto fail;
+      json_path_step(path, JSON_PATH_KEY, p + 1, length);
+      p += length + 2;
+    }
+    else
+      goto fail;
+  }
+  return path;
+
+fail:
+  json_path_free(path);
+  return NULL;
+}
+
+int
+json_path_walk (json_path_t *path, size_t i, json_t *json, json_path_cb cb, void *payload, size_t *matches)
+{
+  if (!json)
+    return 0;
+
+  if (i == path->count)
+  {
+    *matches += 1;
+    return cb(json, payload);
+  }
+
+  json_path_step_t *step = &path->steps[i];
+
+  if (json->type == JSON_OBJECT)
+  {
+    if (step->type == JSON_PATH_KEY)
+      return json_path_walk(path, i+1, json_object_get(json, step->key), cb, payload, matches);
+
+    for (json_t *key = json->children; key && key->sibling; key = key->sibling->sibling)
+      if (json_path_walk(path, i+1, key->sibling, cb, payload, matches))
+        return 1;
+  }
+  else
+  if (json->type == JSON_ARRAY)
+  {
+    if (step->type == JSON_PATH_KEY)
+      return step->index != JSON_PATH_NONE && json_path_walk(path, i+1, json_array_get(json, step->index), cb, payload, matches);
+
+    for (json_t *item = json->children; item; item = item->sibling)
+      if (json_path_walk(path, i+1, item, cb, payload, matches))
+        return 1;
+  }
+  return 0;
+}
+
+// Call cb for each node in json matching path until it returns non-zero.
+// Returns the number of matches visited.
+size_t
+json_path_each (json_path_t *path, json_t *json, json_path_cb cb, void *payload)
+{
+  size_t matches = 0;
+  json_path_walk(path, 0, json, cb, payload, &matches);
+  return matches;
+}
+
+static inline char*
+json_path_space (char *p)
+{
+  while (isspace(*p) || *p == ',' || *p == ':')
+    p++;
+  return p;
+}
+
+// past the closing quote of the string at p
+static inline char*
+json_skip_string (char *p)
+{
+  for (p++; ; p += p[1] ? 2: 1)
+  {
+    p += strcspn(p, "\"\\");
+    if (*p != '\\') break;
+  }
+  return *p ? p + 1: p;
+}
+
+// past the end of the container depth levels up from p
+char*
+json_skip_nested (char *p, int depth)
+{
+  for (;;)
+  {
+    p += strcspn(p, "\"{}[]");
+
+    if (!*p)
+      return p;
+
+    if (*p == '"')
+    {
+      p = json_skip_string(p);
+      continue;
+    }
+
+    depth += *p == '{' || *p == '[' ? 1: -1;
+    p++;
+
+    if (depth <= 0)
+      return p;
+  }
+}
+
+// past the value at p, without building anything
+char*
+json_skip (char *p)
+{
+  p = json_path_space(p);
+
+  if (*p == '"')
+    return json_skip_string(p);
+
+  if (*p == '{' || *p == '[')
+    return json_skip_nested(p, 0);
+
+  size_t length = strcspn(p, " \t\r\n,:{}[]\"");
+  return p + max(length, 1);
+}
+
+int
+json_path_key_eq (json_path_step_t *step, char *key, size_t length)
+{
+  if (!memchr(key, '\\', length))
+    return length == step->length && !memcmp(key, step->key, length);
+
+  // escapes only ever shorten a key
+  if (step->length > length)
+    return 0;
+
+  // keys come from the input, so long ones go on the heap
+  char buf[256];
+  char *tmp = length <= sizeof(buf) ? buf: allocate(length);
+  size_t n = json_unescape(tmp, key, length);
+  int eq = n == step->length && !memcmp(tmp, step->key, n);
+
+  if (tmp != buf)
+    free(tmp);
+
+  return eq;
+}
+
+char*
+json_path_scan (json_path_t *path, size_t i, char *p, json_t *out, json_t **last)
+{
+  p = json_path_space(p);
+
+  if (i == path->count)
+  {
+    json_t *node = json_parse(p);
+
+    if (!node || !node->length)
+      return json_skip(p);
+
+    if (*last)
+      (*last)->sibling = node;
+    else
+      out->children = node;
+
+    *last = node;
+    out->count++;
+    return p + node->length;
+  }
+
+  json_path_step_t *step = &path->steps[i];
+
+  if (*p == '{')
+  {
+    for (p++; ; )
+    {
+      p = json_path_space(p);
+
+      if (*p == '}')
+        return p + 1;
+
+      if (!*p || *p == ']')
+        return p;
+
+      char *key = p;
+      size_t length = 0;
+
+      if (*p == '"')
+      {
+        p = json_skip_string(p);
+        key++;
+        length = p - key - (p > key && p[-1] == '"');
+      }
+      else
+      {
+        length = str_skip(p, isname);
+        p += length;
+
+        if (!length)
+        {
+          p = json_skip(p);
+          continue;
+        }
+      }
+
+      if (step->type == JSON_PATH_ANY)
+      {
+        p = json_path_scan(path, i+1, p, out, last);
+      }
+      else
+      if (json_path_key_eq(step, key, length))
+      {
+        p = json_path_scan(path, i+1, p, out, last);
+        return json_skip_nested(p, 1);
+      }
+      else
+        p = json_skip(p);
+    }
+  }
+
+  if (*p == '[')
+  {
+    size_t index = 0;
+
+    for (p++; ; index++)
+    {
+      p = json_path_space(p);
+
+      if (*p == ']')
+        return p + 1;
+
+      if (!*p || *p == '}')
+        return p;
+
+      if (step->type == JSON_PATH_ANY)
+      {
+        p = json_path_scan(path, i+1, p, out, last);
+      }
+      else
+      if (step->index == index)
+      {
+        p = json_path_scan(path, i+1, p, out, last);
+        return json_skip_nested(p, 1);
+      }
+      else
+        p = json_skip(p);
+    }
+  }
+
+  return json_skip(p);
+}
+
+// Matches of path in subject, found without parsing the rest of the
+// document. Returns an arena array of the matching values, freed with
+// json_free.
+json_t*
+json_path_select (json_path_t *path, char *subject)
+{
+  json_arena_t *arena = json_arena_new();
+  json_arena_current = arena;
+
+  json_t *out = json_new();
+  out->type = JSON_ARRAY;
+  out->start = subject;
+
+  json_t *last = NULL;
+  out->length = json_path_scan(path, 0, subject, out, &last) - subject;
+
+  json_arena_current = NULL;
+  arena->root = out;
+  return out;
+}
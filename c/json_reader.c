@@ -0,0 +1,285 @@
+#define JSON_READ_ERROR -1
+#define JSON_READ_MORE 0
+#define JSON_READ_END 1
+#define JSON_READ_OBJECT 2
+#define JSON_READ_OBJECT_END 3
+#define JSON_READ_ARRAY 4
+#define JSON_READ_ARRAY_END 5
+#define JSON_READ_KEY 6
+#define JSON_READ_STRING 7
+#define JSON_READ_INTEGER 8
+#define JSON_READ_DOUBLE 9
+#define JSON_READ_BOOLEAN 10
+#define JSON_READ_NULL 11
+
+#define JSON_READER_CHUNK 65536
+
+// Incremental pull parser. Input is fed in chunks of any size; only the
+// unconsumed tail of the input and the current token are kept in memory.
+// json_reader_next returns JSON_READ_MORE when a token is cut off at the
+// end of the input, and resumes it when more input arrives.
+typedef struct _json_reader_t {
+  char *buffer;
+  size_t bytes;
+  size_t limit;
+  size_t pos;
+  size_t scanned;
+  int eof;
+  char *stack;
+  size_t depth;
+  size_t depths;
+  int key;
+  int event;
+  char *token;
+  size_t length;
+  size_t tokens;
+  int64_t integer;
+  double number;
+} json_reader_t;
+
+void
+json_reader_init (json_reader_t *reader)
+{
+  memset(reader, 0, sizeof(json_reader_t));
+}
+
+json_reader_t*
+json_reader_new ()
+{
+  json_reader_t *reader = allocate(sizeof(json_reader_t));
+  json_reader_init(reader);
+  return reader;
+}
+
+void
+json_reader_clear (json_reader_t *reader)
+{
+  free(reader->buffer);
+  free(reader->stack);
+  free(reader->token);
+  json_reader_init(reader);
+}
+
+void
+json_reader_free (json_reader_t *reader)
+{
+  if (reader)
+  {
+    json_reader_clear(reader);
+    free(reader);
+  }
+}
+
+char*
+json_reader_space (json_reader_t *reader, size_t bytes)
+{
+  if (reader->pos)
+  {
+    memmove(reader->buffer, reader->buffer + reader->pos, reader->bytes - reader->pos);
+    reader->bytes -= reader->pos;
+    reader->pos = 0;
+  }
+  if (reader->bytes + bytes + 1 > reader->limit)
+  {
+    reader->limit = max(reader->limit * 2, reader->bytes + bytes + 1);
+    reader->buffer = reallocate(reader->buffer, reader->limit);
+  }
+  return reader->buffer + reader->bytes;
+}
+
+void
+json_reader_feed (json_reader_t *reader, char *data, size_t bytes)
+{
+  memmove(json_reader_space(reader, bytes), data, bytes);
+  reader->bytes += bytes;
+  reader->buffer[reader->bytes] = 0;
+}
+
+void
+json_reader_end (json_reader_t *reader)
+{
+  reader->eof = 1;
+}
+
+// read one chunk; returns bytes read, and marks end of input at EOF
+ssize_t
+json_reader_read_fd (json_reader_t *reader, int fd)
+{
+  char *space = json_reader_space(reader, JSON_READER_CHUNK);
+  ssize_t bytes = read(fd, space, JSON_READER_CHUNK);
+
+  if (bytes > 0)
+    reader->bytes += bytes;
+  else
+    reader->eof = 1;
+
+  reader->buffer[reader->bytes] = 0;
+  return bytes;
+}
+
+ssize_t
+json_reader_read (json_reader_t *reader, file_t *file)
+{
+  char *space = json_reader_space(reader, JSON_READER_CHUNK);
+  size_t bytes = fread(space, 1, JSON_READER_CHUNK, file->handle);
+
+  if (bytes)
+    reader->bytes += bytes;
+  else
+    reader->eof = 1;
+
+  reader->buffer[reader->bytes] = 0;
+  return bytes;
+}
+
+void
+json_reader_token (json_reader_t *reader, size_t bytes)
+{
+  if (bytes + 1 > reader->tokens)
+  {
+    reader->tokens = max(reader->tokens * 2, bytes + 1);
+    reader->token = reallocate(reader->token, reader->tokens);
+  }
+}
+
+int
+json_reader_emit (json_reader_t *reader, int event)
+{
+  reader->event = event;
+
+  int in_object = reader->depth && reader->stack[reader->depth-1] == '{';
+
+  if (event == JSON_READ_KEY)
+    reader->key = 0;
+  else
+  if (in_object)
+    reader->key = event != JSON_READ_OBJECT && event != JSON_READ_ARRAY;
+
+  return event;
+}
+
+int
+json_reader_next (json_reader_t *reader)
+{
+  if (!reader->buffer)
+    return reader->eof ? JSON_READ_END: JSON_READ_MORE;
+
+  char *s = reader->buffer + reader->pos;
+  char *end = reader->buffer + reader->bytes;
+
+  while (s < end && (isspace((unsigned char)*s) || *s == ',' || *s == ':'))
+    s++;
+
+  reader->pos = s - reader->buffer;
+
+  if (s == end)
+    return reader->eof ? (reader->depth ? JSON_READ_ERROR: JSON_READ_END): JSON_READ_MORE;
+
+  int c = *s;
+
+  if (c == '{' || c == '[')
+  {
+    if (reader->depth == reader->depths)
+    {
+      reader->depths = max(reader->depths * 2, 32);
+      reader->stack = reallocate(reader->stack, reader->depths);
+    }
+    reader->pos++;
+    int event = json_reader_emit(reader, c == '{' ? JSON_READ_OBJECT: JSON_READ_ARRAY);
+    reader->stack[reader->depth++] = c;
+    reader->key = c == '{';
+    return event;
+  }
+
+  if (c == '}' || c == ']')
+  {
+    if (!reader->depth || reader->stack[reader->depth-1] != (c == '}' ? '{': '['))
+      return JSON_READ_ERROR;
+
+    reader->pos++;
+    reader->depth--;
+    return json_reader_emit(reader, c == '}' ? JSON_READ_OBJECT_END: JSON_READ_ARRAY_END);
+  }
+
+  int key = reader->key && reader->depth && reader->stack[reader->depth-1] == '{';
+
+  if (c == '"')
+  {
+    char *p = s + 1 + reader->scanned;
+
+    while (p < end && *p != '"')
+    {
+      p += strcspn(p, "\"\\");
+
+      if (p < end && *p != '"')
+        p += *p == '\\' ? 2: 1;
+    }
+
+    if (p >= end)
+    {
+      if (reader->eof)
+        return JSON_READ_ERROR;
+
+      // resume after the last complete character, or at a trailing backslash
+      reader->scanned = min(p, end) - s - 1 - (p > end);
+      return JSON_READ_MORE;
+    }
+
+    size_t length = p - s - 1;
+    json_reader_token(reader, length);
+
+    if (memchr(s + 1, '\\', length))
+      reader->length = json_unescape(reader->token, s + 1, length);
+    else
+    {
+      memmove(reader->token, s + 1, length);
+      reader->length = length;
+    }
+
+    reader->token[reader->length] = 0;
+    reader->scanned = 0;
+    reader->pos = p + 1 - reader->buffer;
+
+    return json_reader_emit(reader, key ? JSON_READ_KEY: JSON_READ_STRING);
+  }
+
+  char *p = s;
+  while (p < end && !isspace((unsigned char)*p) && !strchr(",:{}[]\"", *p))
+    p++;
+
+  if (p == end && !reader->eof)
+    return JSON_READ_MORE;
+
+  size_t length = p - s;
+  json_reader_token(reader, length);
+  memmove(reader->token, s, length);
+  reader->token[length] = 0;
+  reader->length = length;
+  reader->pos = p - reader->buffer;
+
+  if (key)
+    return json_reader_emit(reader, JSON_READ_KEY);
+
+  if (!strcmp(reader->token, "true") || !strcmp(reader->token, "false"))
+  {
+    reader->integer = reader->token[0] == 't';
+    return json_reader_emit(reader, JSON_READ_BOOLEAN);
+  }
+
+  if (!strcmp(reader->token, "null"))
+    return json_reader_emit(reader, JSON_READ_NULL);
+
+  char *e = reader->token;
+  int type = json_number(reader->token, &e, &reader->integer, &reader->number);
+
+  if (e == reader->token + length && type == JSON_INTEGER)
+  {
+    reader->number = reader->integer;
+    return json_reader_emit(reader, JSON_READ_INTEGER);
+  }
+
+  if (e == reader->token + length)
+    return json_reader_emit(reader, JSON_READ_DOUBLE);
+
+  return json_reader_emit(reader, JSON_READ_STRING);
+}
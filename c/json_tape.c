@@ -0,0 +1,363 @@
+// Persisted json_t trees. A tape file holds a header, the nodes in
+// pre-order, the object and array indexes, and the scalar text, with every
+// pointer stored for a preferred base address. json_tape_open maps the file
+// at that address when it is free, so the tree is used in place with no
+// parse and read-only pages shared between processes. Otherwise the file
+// is mapped privately and relocated once. Tape nodes are read-only and
+// carry JSON_INDEXED, so accessors never try to build anything.
+
+#define JSON_TAPE_MAGIC "TBJTAPE1"
+#define JSON_TAPE_BASE 0x600000000000ULL
+#define JSON_TAPE_NODES 64
+
+typedef struct _json_tape_header_t {
+  char magic[8];
+  uint64_t size;
+  uint64_t base;
+  uint64_t count;
+} json_tape_header_t;
+
+typedef struct _json_tape_t {
+  char *data;
+  size_t bytes;
+  size_t limit;
+  size_t next;
+} json_tape_t;
+
+#define json_tape_at(tape,offset,type) ((type*)((tape)->data + (offset)))
+
+size_t
+json_tape_space (json_tape_t *tape, size_t bytes)
+{
+  size_t offset = (tape->bytes + 7) & ~7;
+
+  if (offset + bytes > tape->limit)
+  {
+    tape->limit = max(tape->limit * 2, offset + bytes + 4096);
+    tape->data = reallocate(tape->data, tape->limit);
+  }
+
+  memset(tape->data + tape->bytes, 0, offset + bytes - tape->bytes);
+  tape->bytes = offset + bytes;
+  return offset;
+}
+
+size_t
+json_tape_count (json_t *json)
+{
+  size_t count = 1;
+  for (json_t *item = json->children; item; item = item->sibling)
+    count += json_tape_count(item);
+  return count;
+}
+
+size_t
+json_tape_text (json_tape_t *tape, char *text, size_t length)
+{
+  size_t offset = json_tape_space(tape, length + 1);
+  memmove(tape->data + offset, text, length);
+  return offset;
+}
+
+size_t
+json_tape_index (json_tape_t *tape, json_t *json, size_t *children)
+{
+  json_index_t *index = json->type == JSON_OBJECT ? json_object_index(json): json_array_index(json);
+
+  if (!index)
+    return 0;
+
+  size_t width = index->width;
+  size_t bytes = sizeof(json_index_t) + width * (sizeof(json_t*) + (index->hashes ? sizeof(uint32_t): 0));
+  size_t offset = json_tape_space(tape, bytes);
+
+  json_index_t *copy = json_tape_at(tape, offset, json_index_t);
+  copy->width = width;
+  copy->slots = (json_t**)(offset + sizeof(json_index_t));
+  copy->hashes = index->hashes ? (uint32_t*)(offset + sizeof(json_index_t) + width * sizeof(json_t*)): NULL;
+
+  json_t **slots = json_tape_at(tape, (size_t)copy->slots, json_t*);
+
+  if (!index->hashes)
+  {
+    for (size_t i = 0; i < width; i++)
+      slots[i] = (json_t*)children[i];
+    return offset;
+  }
+
+  uint32_t *hashes = json_tape_at(tape, (size_t)copy->hashes, uint32_t);
+
+  size_t i = 0;
+  for (json_t *key = json->children; key; key = key->sibling, i++)
+  {
+    if (i % 2 || key->type != JSON_STRING)
+      continue;
+
+    uint32_t hash = json_key_hash(key);
+    size_t slot = hash & (width-1);
+
+    while (index->slots[slot] && index->slots[slot] != key)
+      slot = (slot + 1) & (width-1);
+
+    if (index->slots[slot])
+    {
+      slots[slot] = (json_t*)children[i];
+      hashes[slot] = hash;
+    }
+  }
+  return offset;
+}
+
+// Append json and its descendants in pre-order. Links are stored as file
+// offsets until json_tape_relocate adds the base.
+size_t
+json_tape_put (json_tape_t *tape, json_t *json)
+{
+  size_t offset = JSON_TAPE_NODES + tape->next++ * sizeof(json_t);
+  size_t count = 0, prev = 0;
+  size_t *children = NULL;
+
+  if (json->type == JSON_OBJECT || json->type == JSON_ARRAY)
+  {
+    for (json_t *item = json->children; item; item = item->sibling)
+      count++;
+    children = allocate((count + 1) * sizeof(size_t));
+  }
+
+  size_t i = 0;
+  for (json_t *item = json->children; item; item = item->sibling)
+  {
+    size_t child = json_tape_put(tape, item);
+
+    if (prev)
+      json_tape_at(tape, prev, json_t)->sibling = (json_t*)child;
+
+    children[i++] = child;
+    prev = child;
+  }
+
+  size_t start = json->type == JSON_OBJECT || json->type == JSON_ARRAY
+    ? json_tape_text(tape, json->type == JSON_OBJECT ? "{": "[", 1)
+    : json_tape_text(tape, json->start, json->length);
+
+  size_t index = children ? json_tape_index(tape, json, children): 0;
+
+  json_t *node = json_tape_at(tape, offset, json_t);
+  node->type = json->type;
+  node->flags = (json->flags & (JSON_ESCAPED|JSON_RAW|JSON_CACHED)) | JSON_TAPE | JSON_INDEXED;
+  node->start = (char*)start;
+  node->length = children ? 1: json->length;
+  node->children = count ? (json_t*)children[0]: NULL;
+  node->count = json->count;
+  node->index = (json_index_t*)index;
+  node->value = json->value;
+
+  free(children);
+  return offset;
+}
+
+#define json_tape_move(p,from,to) if (p) (p) = (void*)((uintptr_t)(p) - (from) + (to))
+
+// Rebase every link in the tape at data from address from to address to
+void
+json_tape_relocate (char *data, uintptr_t from, uintptr_t to)
+{
+  json_tape_header_t *header = (json_tape_header_t*)data;
+  json_t *nodes = (json_t*)(data + JSON_TAPE_NODES);
+
+  for (size_t n = 0; n < header->count; n++)
+  {
+    json_t *node = &nodes[n];
+
+    json_tape_move(node->start, from, to);
+    json_tape_move(node->sibling, from, to);
+    json_tape_move(node->children, from, to);
+
+    if (node->index)
+    {
+      json_index_t *index = (json_index_t*)(data + ((uintptr_t)node->index - from));
+      json_t **slots = (json_t**)(data + ((uintptr_t)index->slots - from));
+
+      for (size_t i = 0; i < index->width; i++)
+        json_tape_move(slots[i], from, to);
+
+      json_tape_move(index->slots, from, to);
+      json_tape_move(index->hashes, from, to);
+      json_tape_move(node->index, from, to);
+    }
+  }
+}
+
+// Whether p, stored for base from, lies with bytes after it inside the tape
+static inline int
+json_tape_within (void *p, uintptr_t from, size_t size, size_t bytes)
+{
+  return (uintptr_t)p >= from && bytes <= size && (uintptr_t)p - from <= size - bytes;
+}
+
+// Whether p is a node after node n, so links only ever lead forward
+static inline int
+json_tape_node (void *p, uintptr_t from, size_t count, size_t n)
+{
+  uintptr_t offset = (uintptr_t)p - from - JSON_TAPE_NODES;
+  return (uintptr_t)p >= from + JSON_TAPE_NODES && offset % sizeof(json_t) == 0
+    && offset / sizeof(json_t) > n && offset / sizeof(json_t) < count;
+}
+
+// Check every link of the tape at data, stored for base from, before any
+// is followed
+int
+json_tape_check (char *data, uintptr_t from, size_t size)
+{
+  json_tape_header_t *header = (json_tape_header_t*)data;
+  json_t *nodes = (json_t*)(data + JSON_TAPE_NODES);
+  size_t count = header->count;
+  int known = JSON_ESCAPED|JSON_RAW|JSON_TAPE|JSON_INDEXED|JSON_TAPE_ROOT|JSON_CACHED;
+
+  if (size < JSON_TAPE_NODES || !count || count > (size - JSON_TAPE_NODES) / sizeof(json_t) || !(nodes[0].flags & JSON_TAPE_ROOT))
+    return 0;
+
+  for (size_t n = 0; n < count; n++)
+  {
+    json_t *node = &nodes[n];
+
+    if (node->type < JSON_OBJECT || node->type > JSON_BOOLEAN || node->flags & ~known
+      || (node->flags & (JSON_TAPE|JSON_INDEXED)) != (JSON_TAPE|JSON_INDEXED) || (n && node->flags & JSON_TAPE_ROOT)
+      || !json_tape_within(node->start, from, size, node->length + 1)
+      || (node->sibling && !json_tape_node(node->sibling, from, count, n))
+      || (node->children && !json_tape_node(node->children, from, count, n)))
+      return 0;
+
+    // text is read up to its terminator, and quoted strings drop both quotes
+    size_t least = node->flags & (JSON_RAW|JSON_CACHED) ? 0
+      : node->type == JSON_STRING && data[(uintptr_t)node->start - from] == '"' ? 2: 1;
+
+    if (node->length < least || data[(uintptr_t)node->start - from + node->length])
+      return 0;
+
+    if (!node->index)
+      continue;
+
+    if ((node->type != JSON_OBJECT && node->type != JSON_ARRAY) || !json_tape_within(node->index, from, size, sizeof(json_index_t)))
+      return 0;
+
+    json_index_t *index = (json_index_t*)(data + ((uintptr_t)node->index - from));
+    size_t width = index->width;
+
+    if (!width || width > size / sizeof(json_t*) || !json_tape_within(index->slots, from, size, width * sizeof(json_t*)))
+      return 0;
+
+    // objects are probed until an empty slot, arrays are read up to count
+    if (node->type == JSON_OBJECT ? (width & (width-1)) || !json_tape_within(index->hashes, from, size, width * sizeof(uint32_t)): width < node->count)
+      return 0;
+
+    json_t **slots = (json_t**)(data + ((uintptr_t)index->slots - from));
+    size_t empty = 0;
+
+    for (size_t i = 0; i < width; i++)
+    {
+      if (!slots[i])
+        empty++;
+      else
+      if (!json_tape_node(slots[i], from, count, n))
+        return 0;
+    }
+
+    if (node->type == JSON_OBJECT ? !empty: empty)
+      return 0;
+  }
+  return 1;
+}
+
+int
+json_tape_save (json_t *json, char *path)
+{
+  json_tape_t tape = { NULL, 0, 0, 0 };
+  size_t count = json_tape_count(json);
+
+  json_tape_space(&tape, JSON_TAPE_NODES + count * sizeof(json_t));
+  json_tape_put(&tape, json);
+
+  json_tape_header_t *header = json_tape_at(&tape, 0, json_tape_header_t);
+  memmove(header->magic, JSON_TAPE_MAGIC, 8);
+  header->size = tape.bytes;
+  header->count = count;
+  header->base = JSON_TAPE_BASE + ((uint64_t)(json_hash(tape.data + JSON_TAPE_NODES, tape.bytes - JSON_TAPE_NODES) & 0x3ff) << 32);
+
+  json_tape_at(&tape, JSON_TAPE_NODES, json_t)->flags |= JSON_TAPE_ROOT;
+  json_tape_relocate(tape.data, 0, header->base);
+
+  int rc = EXIT_FAILURE;
+  FILE *file = fopen(path, "w");
+
+  if (file)
+  {
+    if (fwrite(tape.data, 1, tape.bytes, file) == tape.bytes)
+      rc = EXIT_SUCCESS;
+    if (fclose(file) != 0)
+      rc = EXIT_FAILURE;
+  }
+
+  free(tape.data);
+  return rc;
+}
+
+// Root of the tape at path, freed with json_free. NULL if the file is not
+// a tape or any of its links lead outside it.
+json_t*
+json_tape_open (char *path)
+{
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+
+  json_tape_header_t header;
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+    || memcmp(header.magic, JSON_TAPE_MAGIC, 8) || header.size != st.st_size)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  char *data = mmap((void*)(uintptr_t)header.base, header.size, PROT_READ, MAP_PRIVATE|MAP_FIXED_NOREPLACE, fd, 0);
+
+  if (data != (char*)(uintptr_t)header.base)
+  {
+    if (data != MAP_FAILED)
+      munmap(data, header.size);
+
+    data = mmap(NULL, header.size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    if (data != MAP_FAILED && json_tape_check(data, header.base, header.size))
+    {
+      json_tape_relocate(data, header.base, (uintptr_t)data);
+      mprotect(data, header.size, PROT_READ);
+    }
+    else
+    if (data != MAP_FAILED)
+    {
+      munmap(data, header.size);
+      data = MAP_FAILED;
+    }
+  }
+  else
+  if (!json_tape_check(data, header.base, header.size))
+  {
+    munmap(data, header.size);
+    data = MAP_FAILED;
+  }
+
+  close(fd);
+
+  return data == MAP_FAILED ? NULL: (json_t*)(data + JSON_TAPE_NODES);
+}
+
+void
+json_tape_close (json_t *root)
+{
+  json_tape_header_t *header = (json_tape_header_t*)((char*)root - JSON_TAPE_NODES);
+  munmap(header, header->size);
+}
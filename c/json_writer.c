@@ -0,0 +1,444 @@
+#define JSON_WRITER_BUFFER 4096
+#define JSON_WRITER_ITEMS 0x80
+
+// Streaming serializer. Output goes through a fixed-size buffer to a FILE*,
+// file descriptor or text_t, so memory use is flat regardless of document
+// size. Commas and colons are inserted automatically.
+typedef struct _json_writer_t {
+  FILE *file;
+  int fd;
+  text_t *text;
+  char buffer[JSON_WRITER_BUFFER];
+  size_t bytes;
+  unsigned char *stack;
+  size_t depth;
+  size_t depths;
+  int key;
+  int error;
+} json_writer_t;
+
+void
+json_writer_init (json_writer_t *writer)
+{
+  memset(writer, 0, sizeof(json_writer_t));
+  writer->fd = -1;
+}
+
+void
+json_writer_file (json_writer_t *writer, FILE *file)
+{
+  json_writer_init(writer);
+  writer->file = file;
+}
+
+void
+json_writer_fd (json_writer_t *writer, int fd)
+{
+  json_writer_init(writer);
+  writer->fd = fd;
+}
+
+void
+json_writer_text (json_writer_t *writer, text_t *text)
+{
+  json_writer_init(writer);
+  writer->text = text;
+}
+
+void
+json_writer_out (json_writer_t *writer, char *data, size_t bytes)
+{
+  if (writer->file)
+  {
+    if (fwrite(data, 1, bytes, writer->file) != bytes)
+      writer->error = 1;
+  }
+  else
+  if (writer->text)
+  {
+    text_ins_length(writer->text, data, bytes);
+  }
+  else
+  if (writer->fd >= 0)
+  {
+    while (bytes)
+    {
+      ssize_t written = write(writer->fd, data, bytes);
+
+      if (written < 0)
+      {
+        writer->error = 1;
+        break;
+      }
+      data += written;
+      bytes -= written;
+    }
+  }
+}
+
+// Returns 0 on success, non-zero if any write to the sink failed or
+// json_writer_json met an unterminated string
+int
+json_writer_flush (json_writer_t *writer)
+{
+  json_writer_out(writer, writer->buffer, writer->bytes);
+  writer->bytes = 0;
+  return writer->error;
+}
+
+int
+json_writer_clear (json_writer_t *writer)
+{
+  int error = json_writer_flush(writer);
+  free(writer->stack);
+  writer->stack = NULL;
+  writer->depth = 0;
+  writer->depths = 0;
+  return error;
+}
+
+void
+json_writer_put (json_writer_t *writer, char *data, size_t bytes)
+{
+  if (writer->bytes + bytes > JSON_WRITER_BUFFER)
+  {
+    json_writer_flush(writer);
+
+    if (bytes > JSON_WRITER_BUFFER / 2)
+    {
+      json_writer_out(writer, data, bytes);
+      return;
+    }
+  }
+  memmove(writer->buffer + writer->bytes, data, bytes);
+  writer->bytes += bytes;
+}
+
+static inline void
+json_writer_char (json_writer_t *writer, char c)
+{
+  if (writer->bytes == JSON_WRITER_BUFFER)
+    json_writer_flush(writer);
+
+  writer->buffer[writer->bytes++] = c;
+}
+
+// comma before the next item at this level, unless it follows a key
+void
+json_writer_item (json_writer_t *writer)
+{
+  if (writer->key)
+  {
+    writer->key = 0;
+    return;
+  }
+
+  if (writer->depth)
+  {
+    if (writer->stack[writer->depth-1] & JSON_WRITER_ITEMS)
+      json_writer_char(writer, ',');
+
+    writer->stack[writer->depth-1] |= JSON_WRITER_ITEMS;
+  }
+}
+
+void
+json_writer_open (json_writer_t *writer, char c)
+{
+  json_writer_item(writer);
+
+  if (writer->depth == writer->depths)
+  {
+    writer->depths = max(writer->depths * 2, 32);
+    writer->stack = reallocate(writer->stack, writer->depths);
+  }
+  writer->stack[writer->depth++] = c;
+  json_writer_char(writer, c);
+}
+
+void
+json_writer_close (json_writer_t *writer, char c)
+{
+  ensure(writer->depth && !writer->key && (writer->stack[writer->depth-1] & ~JSON_WRITER_ITEMS) == (c == '}' ? '{': '['))
+    errorf("json_writer unbalanced %c", c);
+
+  writer->depth--;
+  json_writer_char(writer, c);
+}
+
+void json_writer_object (json_writer_t *writer) { json_writer_open(writer, '{'); }
+void json_writer_object_end (json_writer_t *writer) { json_writer_close(writer, '}'); }
+void json_writer_array (json_writer_t *writer) { json_writer_open(writer, '['); }
+void json_writer_array_end (json_writer_t *writer) { json_writer_close(writer, ']'); }
+
+// Quote and escape in one pass, copying unescaped runs in bulk
+void
+json_writer_quote (json_writer_t *writer, char *str, size_t length)
+{
+  json_writer_char(writer, '"');
+
+  char *run = str, *end = str + length;
+
+  for (char *p = str; p < end; p++)
+  {
+    unsigned char c = *p;
+
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+
+    json_writer_put(writer, run, p - run);
+    run = p + 1;
+
+    char escape[8] = { '\\', c, 0 };
+
+         if (c == '\n') escape[1] = 'n';
+    else if (c == '\r') escape[1] = 'r';
+    else if (c == '\t') escape[1] = 't';
+    else if (c == '\b') escape[1] = 'b';
+    else if (c == '\f') escape[1] = 'f';
+    else if (c < 0x20) snprintf(escape, sizeof(escape), "\\u%04x", c);
+
+    json_writer_put(writer, escape, strlen(escape));
+  }
+
+  json_writer_put(writer, run, end - run);
+  json_writer_char(writer, '"');
+}
+
+void
+json_writer_key_length (json_writer_t *writer, char *key, size_t length)
+{
+  ensure(writer->depth && !writer->key && (writer->stack[writer->depth-1] & ~JSON_WRITER_ITEMS) == '{')
+    errorf("json_writer_key outside object");
+
+  json_writer_item(writer);
+  json_writer_quote(writer, key, length);
+  json_writer_char(writer, ':');
+  writer->key = 1;
+}
+
+void
+json_writer_key (json_writer_t *writer, char *key)
+{
+  json_writer_key_length(writer, key, strlen(key));
+}
+
+void
+json_writer_string_length (json_writer_t *writer, char *str, size_t length)
+{
+  json_writer_item(writer);
+  json_writer_quote(writer, str, length);
+}
+
+void
+json_writer_string (json_writer_t *writer, char *str)
+{
+  if (!str)
+  {
+    json_writer_item(writer);
+    json_writer_put(writer, "null", 4);
+    return;
+  }
+  json_writer_string_length(writer, str, strlen(str));
+}
+
+void
+json_writer_integer (json_writer_t *writer, int64_t n)
+{
+  char tmp[24];
+  json_writer_item(writer);
+  json_writer_put(writer, tmp, snprintf(tmp, sizeof(tmp), "%ld", n));
+}
+
+void
+json_writer_unsigned (json_writer_t *writer, uint64_t n)
+{
+  char tmp[24];
+  json_writer_item(writer);
+  json_writer_put(writer, tmp, snprintf(tmp, sizeof(tmp), "%lu", n));
+}
+
+// Shortest of %.15g, %.16g or %.17g that reads back as the same double.
+// Always has a '.' or exponent so it reads back as a double. NaN and
+// infinities have no JSON form and are written as null.
+size_t
+json_double_str (char *tmp, size_t size, double d)
+{
+  if (isnan(d) || isinf(d))
+    return snprintf(tmp, size, "null");
+
+  int length = 0;
+
+  for (int precision = 15; precision <= 17; precision++)
+  {
+    length = snprintf(tmp, size, "%.*g", precision, d);
+
+    if (strtod(tmp, NULL) == d)
+      break;
+  }
+
+  if (!strpbrk(tmp, ".e"))
+    length += snprintf(tmp + length, size - length, ".0");
+
+  return length;
+}
+
+void
+json_writer_double (json_writer_t *writer, double d)
+{
+  char tmp[40];
+  json_writer_item(writer);
+  json_writer_put(writer, tmp, json_double_str(tmp, sizeof(tmp), d));
+}
+
+// Like json_double_str, but the shortest %g that reads back as the same
+// float, so 0.1f is not written as the double it widens to
+size_t
+json_float_str (char *tmp, size_t size, float f)
+{
+  if (isnan(f) || isinf(f))
+    return snprintf(tmp, size, "null");
+
+  int length = 0;
+
+  for (int precision = 1; precision <= 9; precision++)
+  {
+    length = snprintf(tmp, size, "%.*g", precision, (double)f);
+
+    if (strtof(tmp, NULL) == f)
+      break;
+  }
+
+  if (!strpbrk(tmp, ".e"))
+    length += snprintf(tmp + length, size - length, ".0");
+
+  return length;
+}
+
+void
+json_writer_float (json_writer_t *writer, float f)
+{
+  char tmp[40];
+  json_writer_item(writer);
+  json_writer_put(writer, tmp, json_float_str(tmp, sizeof(tmp), f));
+}
+
+void
+json_writer_boolean (json_writer_t *writer, int b)
+{
+  json_writer_item(writer);
+  json_writer_put(writer, b ? "true": "false", b ? 4: 5);
+}
+
+void
+json_writer_null (json_writer_t *writer)
+{
+  json_writer_item(writer);
+  json_writer_put(writer, "null", 4);
+}
+
+// Whether quoted source text ends in an unescaped closing quote
+static inline int
+json_writer_quoted (char *start, size_t length)
+{
+  if (length < 2 || start[length-1] != '"')
+    return 0;
+
+  size_t slashes = 0;
+  while (slashes < length - 2 && start[length - 2 - slashes] == '\\')
+    slashes++;
+
+  return slashes % 2 == 0;
+}
+
+// Serialize a parsed tree. Quoted strings are copied from the source text
+// without re-escaping. An unterminated one is written escaped and sets the
+// error returned by json_writer_flush.
+void
+json_writer_json (json_writer_t *writer, json_t *json)
+{
+  if (!json)
+  {
+    json_writer_null(writer);
+    return;
+  }
+
+  switch (json->type)
+  {
+    case JSON_OBJECT:
+      json_writer_object(writer);
+      for (json_t *key = json->children; key; key = key->sibling ? key->sibling->sibling: NULL)
+      {
+        if (key->start[0] == '"' && !(key->flags & JSON_RAW) && !json_writer_quoted(key->start, key->length))
+        {
+          writer->error = 1;
+          json_writer_key_length(writer, key->start + 1, key->length - 1);
+        }
+        else
+        if (key->start[0] == '"' && !(key->flags & JSON_RAW))
+        {
+          json_writer_item(writer);
+          json_writer_put(writer, key->start, key->length);
+          json_writer_char(writer, ':');
+          writer->key = 1;
+        }
+        else
+        {
+          json_writer_key_length(writer, key->start, key->length);
+        }
+        json_writer_json(writer, key->sibling);
+      }
+      json_writer_object_end(writer);
+      break;
+
+    case JSON_ARRAY:
+      json_writer_array(writer);
+      for (json_t *item = json->children; item; item = item->sibling)
+        json_writer_json(writer, item);
+      json_writer_array_end(writer);
+      break;
+
+    case JSON_STRING:
+      if (json->flags & JSON_RAW)
+      {
+        json_writer_string_length(writer, json->start, json->length);
+      }
+      else
+      if (json->start[0] == '"' && !json_writer_quoted(json->start, json->length))
+      {
+        writer->error = 1;
+        json_writer_string_length(writer, json->start + 1, json->length - 1);
+      }
+      else
+      if (json->start[0] == '"')
+      {
+        json_writer_item(writer);
+        json_writer_put(writer, json->start, json->length);
+      }
+      else
+      if (json->length == 4 && !strncmp(json->start, "null", 4))
+      {
+        json_writer_null(writer);
+      }
+      else
+      {
+        json_writer_string_length(writer, json->start, json->length);
+      }
+      break;
+
+    case JSON_BOOLEAN:
+      json_writer_boolean(writer, json_boolean(json));
+      break;
+
+    case JSON_INTEGER:
+      json_writer_integer(writer, json_integer(json));
+      break;
+
+    case JSON_DOUBLE:
+      json_writer_double(writer, json_double(json));
+      break;
+
+    default:
+      json_writer_null(writer);
+  }
+}
@@ -233,8 +233,11 @@ map_del (map_t *map, void *key)
   {
     if (map->compare(node->key, key) == 0)
     {
+      // the chain owns the node, as vector_clear_free shows; the key and
+      // value stay with the caller
       void *ptr = node->val;
       vector_del(vector, loop.index);
+      free(node);
       map->count--;
       return ptr;
     }
@@ -0,0 +1,365 @@
+// MessagePack encoding of json_t trees. Decoded trees live in an arena and
+// strings are JSON_RAW views into the input buffer, so the buffer must
+// outlive the tree. Booleans and nil point at static text so json_boolean
+// and json_writer_json work unchanged; numbers use the cached value.
+
+typedef struct _msgpack_buffer_t {
+  unsigned char *data;
+  size_t bytes;
+  size_t limit;
+} msgpack_buffer_t;
+
+static inline unsigned char*
+msgpack_space (msgpack_buffer_t *buffer, size_t bytes)
+{
+  if (buffer->bytes + bytes > buffer->limit)
+  {
+    buffer->limit = max(buffer->limit * 2, buffer->bytes + bytes + 256);
+    buffer->data = reallocate(buffer->data, buffer->limit);
+  }
+  unsigned char *p = buffer->data + buffer->bytes;
+  buffer->bytes += bytes;
+  return p;
+}
+
+// type byte followed by a big-endian value of size bytes
+static inline void
+msgpack_put (msgpack_buffer_t *buffer, int type, uint64_t value, int size)
+{
+  unsigned char *p = msgpack_space(buffer, size + 1);
+  *p++ = type;
+
+  for (int i = size-1; i >= 0; i--)
+    *p++ = value >> (i*8);
+}
+
+void
+msgpack_put_length (msgpack_buffer_t *buffer, size_t length, int fix, size_t fixmax, int type)
+{
+  if (length <= fixmax)
+    msgpack_put(buffer, fix | length, 0, 0);
+  else
+  if (length <= UINT8_MAX && type == 0xd9)
+    msgpack_put(buffer, type, length, 1);
+  else
+  if (length <= UINT16_MAX)
+    msgpack_put(buffer, type == 0xd9 ? 0xda: type, length, 2);
+  else
+    msgpack_put(buffer, type == 0xd9 ? 0xdb: type + 1, length, 4);
+}
+
+void
+msgpack_put_integer (msgpack_buffer_t *buffer, int64_t n)
+{
+  if (n >= 0)
+  {
+    if (n <= 0x7f)             msgpack_put(buffer, n, 0, 0);
+    else if (n <= UINT8_MAX)   msgpack_put(buffer, 0xcc, n, 1);
+    else if (n <= UINT16_MAX)  msgpack_put(buffer, 0xcd, n, 2);
+    else if (n <= UINT32_MAX)  msgpack_put(buffer, 0xce, n, 4);
+    else                       msgpack_put(buffer, 0xcf, n, 8);
+  }
+  else
+  {
+    if (n >= -32)              msgpack_put(buffer, (uint8_t)n, 0, 0);
+    else if (n >= INT8_MIN)    msgpack_put(buffer, 0xd0, (uint8_t)n, 1);
+    else if (n >= INT16_MIN)   msgpack_put(buffer, 0xd1, (uint16_t)n, 2);
+    else if (n >= INT32_MIN)   msgpack_put(buffer, 0xd2, (uint32_t)n, 4);
+    else                       msgpack_put(buffer, 0xd3, n, 8);
+  }
+}
+
+void
+msgpack_put_double (msgpack_buffer_t *buffer, double d)
+{
+  float f = d;
+
+  if ((double)f == d || d != d)
+  {
+    uint32_t bits;
+    memmove(&bits, &f, 4);
+    msgpack_put(buffer, 0xca, bits, 4);
+  }
+  else
+  {
+    uint64_t bits;
+    memmove(&bits, &d, 8);
+    msgpack_put(buffer, 0xcb, bits, 8);
+  }
+}
+
+void
+msgpack_put_string (msgpack_buffer_t *buffer, char *str, size_t length)
+{
+  msgpack_put_length(buffer, length, 0xa0, 31, 0xd9);
+  memmove(msgpack_space(buffer, length), str, length);
+}
+
+void
+msgpack_put_json (msgpack_buffer_t *buffer, json_t *json)
+{
+  switch (json ? json->type: 0)
+  {
+    case JSON_OBJECT:
+    {
+      // count is only set by the parsers, so pairs are counted here
+      size_t pairs = 0;
+      for (json_t *key = json->children; key && key->sibling; key = key->sibling->sibling)
+        pairs++;
+
+      msgpack_put_length(buffer, pairs, 0x80, 15, 0xde);
+      for (json_t *key = json->children; key && key->sibling; key = key->sibling->sibling)
+      {
+        msgpack_put_json(buffer, key);
+        msgpack_put_json(buffer, key->sibling);
+      }
+      break;
+    }
+
+    case JSON_ARRAY:
+      msgpack_put_length(buffer, json_array_count(json), 0x90, 15, 0xdc);
+      for (json_t *item = json->children; item; item = item->sibling)
+        msgpack_put_json(buffer, item);
+      break;
+
+    case JSON_STRING:
+    {
+      size_t length = 0;
+      char *view = json_string_view(json, &length);
+
+      if (view == json->start && !(json->flags & JSON_RAW) && length == 4 && !strncmp(view, "null", 4))
+      {
+        msgpack_put(buffer, 0xc0, 0, 0);
+      }
+      else
+      if (view)
+      {
+        msgpack_put_string(buffer, view, length);
+      }
+      else
+      {
+        char *str = json_string(json);
+        msgpack_put_string(buffer, str, strlen(str));
+        free(str);
+      }
+      break;
+    }
+
+    case JSON_INTEGER:
+      msgpack_put_integer(buffer, json_integer(json));
+      break;
+
+    case JSON_DOUBLE:
+      msgpack_put_double(buffer, json_double(json));
+      break;
+
+    case JSON_BOOLEAN:
+      msgpack_put(buffer, json_boolean(json) ? 0xc3: 0xc2, 0, 0);
+      break;
+
+    default:
+      msgpack_put(buffer, 0xc0, 0, 0);
+  }
+}
+
+// Encoded bytes in a malloc'd buffer; *length is set to their count
+char*
+msgpack_encode (json_t *json, size_t *length)
+{
+  msgpack_buffer_t buffer = { NULL, 0, 0 };
+  msgpack_put_json(&buffer, json);
+  *length = buffer.bytes;
+  return (char*)buffer.data;
+}
+
+typedef struct _msgpack_reader_t {
+  unsigned char *p;
+  unsigned char *end;
+  int depth;
+} msgpack_reader_t;
+
+#define MSGPACK_DEPTH 1024
+
+static inline int
+msgpack_get (msgpack_reader_t *reader, int size, uint64_t *value)
+{
+  if (reader->end - reader->p < size)
+    return 0;
+
+  uint64_t v = 0;
+  for (int i = 0; i < size; i++)
+    v = v << 8 | *reader->p++;
+
+  *value = v;
+  return 1;
+}
+
+json_t* msgpack_get_json (msgpack_reader_t *reader);
+
+json_t*
+msgpack_get_children (msgpack_reader_t *reader, json_t *json, uint64_t count)
+{
+  json_t *last = NULL;
+
+  if (count > (uint64_t)(reader->end - reader->p) || ++reader->depth > MSGPACK_DEPTH)
+    return NULL;
+
+  for (uint64_t i = 0; i < count; i++)
+  {
+    json_t *item = msgpack_get_json(reader);
+
+    if (!item)
+      return NULL;
+
+    if (last)
+      last->sibling = item;
+    else
+      json->children = item;
+
+    last = item;
+    json->count++;
+  }
+
+  reader->depth--;
+  json->length = (char*)reader->p - json->start;
+  json_index(json);
+  return json;
+}
+
+json_t*
+msgpack_get_json (msgpack_reader_t *reader)
+{
+  if (reader->p >= reader->end)
+    return NULL;
+
+  json_t *json = json_new();
+  json->start = (char*)reader->p;
+
+  int c = *reader->p++;
+  uint64_t n = 0;
+
+  if (c <= 0x7f || c >= 0xe0)
+  {
+    json->type = JSON_INTEGER;
+    json->value.integer = c <= 0x7f ? c: (int8_t)c;
+  }
+  else
+  if ((c & 0xf0) == 0x80 || c == 0xde || c == 0xdf)
+  {
+    json->type = JSON_OBJECT;
+    n = c & 0x0f;
+    if (c != (0x80 | n) && !msgpack_get(reader, c == 0xde ? 2: 4, &n))
+      return NULL;
+    return n > UINT64_MAX/2 ? NULL: msgpack_get_children(reader, json, n * 2);
+  }
+  else
+  if ((c & 0xf0) == 0x90 || c == 0xdc || c == 0xdd)
+  {
+    json->type = JSON_ARRAY;
+    n = c & 0x0f;
+    if (c != (0x90 | n) && !msgpack_get(reader, c == 0xdc ? 2: 4, &n))
+      return NULL;
+    return msgpack_get_children(reader, json, n);
+  }
+  else
+  if ((c & 0xe0) == 0xa0 || (c >= 0xd9 && c <= 0xdb) || (c >= 0xc4 && c <= 0xc6))
+  {
+    n = c & 0x1f;
+    if ((c & 0xe0) != 0xa0 && !msgpack_get(reader, c == 0xd9 || c == 0xc4 ? 1: c == 0xda || c == 0xc5 ? 2: 4, &n))
+      return NULL;
+    if (n > (uint64_t)(reader->end - reader->p))
+      return NULL;
+
+    json->type = JSON_STRING;
+    json->flags |= JSON_RAW;
+    json->start = (char*)reader->p;
+    json->length = n;
+    reader->p += n;
+    return json;
+  }
+  else
+  if (c == 0xc0)
+  {
+    json->type = JSON_STRING;
+    json->start = "null";
+    json->length = 4;
+    return json;
+  }
+  else
+  if (c == 0xc2 || c == 0xc3)
+  {
+    json->type = JSON_BOOLEAN;
+    json->start = c == 0xc3 ? "true": "false";
+    json->length = c == 0xc3 ? 4: 5;
+    return json;
+  }
+  else
+  if (c >= 0xcc && c <= 0xcf)
+  {
+    // json_t has no exact form for uint64 above INT64_MAX
+    if (!msgpack_get(reader, 1 << (c - 0xcc), &n) || n > INT64_MAX)
+      return NULL;
+
+    json->type = JSON_INTEGER;
+    json->value.integer = n;
+  }
+  else
+  if (c >= 0xd0 && c <= 0xd3)
+  {
+    int size = 1 << (c - 0xd0);
+    if (!msgpack_get(reader, size, &n))
+      return NULL;
+    json->type = JSON_INTEGER;
+    json->value.integer = size == 8 ? (int64_t)n: (int64_t)(n << (64 - size*8)) >> (64 - size*8);
+  }
+  else
+  if (c == 0xca || c == 0xcb)
+  {
+    if (!msgpack_get(reader, c == 0xca ? 4: 8, &n))
+      return NULL;
+    json->type = JSON_DOUBLE;
+
+    if (c == 0xca)
+    {
+      uint32_t bits = n;
+      float f;
+      memmove(&f, &bits, 4);
+      json->value.number = f;
+    }
+    else
+      memmove(&json->value.number, &n, 8);
+  }
+  else
+  {
+    // ext types
+    return NULL;
+  }
+
+  // only numbers get here; their text is binary
+  json->flags |= JSON_CACHED;
+  json->length = (char*)reader->p - json->start;
+  return json;
+}
+
+// Decode one value into an arena tree freed with json_free. NULL if the
+// input is truncated, too deep, uses ext types or holds a uint64 above
+// INT64_MAX.
+json_t*
+msgpack_decode (char *data, size_t length)
+{
+  msgpack_reader_t reader = { (unsigned char*)data, (unsigned char*)data + length, 0 };
+
+  json_arena_t *arena = json_arena_new();
+  json_arena_current = arena;
+
+  json_t *root = msgpack_get_json(&reader);
+
+  json_arena_current = NULL;
+
+  if (root)
+    arena->root = root;
+  else
+    json_arena_free(arena);
+
+  return root;
+}
@@ -0,0 +1,395 @@
+// Newline-delimited JSON. The file is mapped once and split into chunks
+// that end on a newline. Each chunk goes through json_structure in one
+// pass, then one json_build per line into a per-chunk arena. Records point
+// into the mapping, which stays alive until every batch has been freed.
+
+#define NDJSON_CHUNK (4<<20)
+#define NDJSON_UNORDERED (1<<0)
+
+typedef int (*ndjson_cb)(json_t*, void*);
+
+typedef struct _ndjson_t {
+  char *map;
+  size_t size;
+  int refs;
+  char **chunks;
+  size_t count;
+  size_t errors;
+#ifdef TOOLBELT_THREAD
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct _ndjson_batch_t **ready;
+  size_t next;
+  size_t delivered;
+  size_t window;
+  int stop;
+#endif
+} ndjson_t;
+
+typedef struct _ndjson_batch_t {
+  ndjson_t *ndjson;
+  size_t chunk;
+  size_t count;
+  json_t **records;
+  json_arena_t *arena;
+  char *tail;
+} ndjson_batch_t;
+
+ndjson_t*
+ndjson_open (char *path)
+{
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  ndjson_t *ndjson = allocate(sizeof(ndjson_t));
+  memset(ndjson, 0, sizeof(ndjson_t));
+
+  ndjson->size = st.st_size;
+  ndjson->refs = 1;
+
+  if (ndjson->size)
+  {
+    ndjson->map = mmap(NULL, ndjson->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (ndjson->map == MAP_FAILED)
+    {
+      close(fd);
+      free(ndjson);
+      return NULL;
+    }
+    madvise(ndjson->map, ndjson->size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  size_t limit = ndjson->size / NDJSON_CHUNK + 2;
+  ndjson->chunks = allocate(limit * sizeof(char*));
+
+  char *p = ndjson->map, *end = ndjson->map + ndjson->size;
+
+  while (p < end)
+  {
+    ndjson->chunks[ndjson->count++] = p;
+
+    char *nl = p + NDJSON_CHUNK < end ? memchr(p + NDJSON_CHUNK, '\n', end - p - NDJSON_CHUNK): NULL;
+    p = nl ? nl + 1: end;
+  }
+  ndjson->chunks[ndjson->count] = end;
+
+#ifdef TOOLBELT_THREAD
+  assert0(pthread_mutex_init(&ndjson->mutex, NULL));
+  assert0(pthread_cond_init(&ndjson->cond, NULL));
+#endif
+
+  return ndjson;
+}
+
+void
+ndjson_release (ndjson_t *ndjson)
+{
+  if (__sync_sub_and_fetch(&ndjson->refs, 1))
+    return;
+
+#ifdef TOOLBELT_THREAD
+  assert0(pthread_mutex_destroy(&ndjson->mutex));
+  assert0(pthread_cond_destroy(&ndjson->cond));
+#endif
+
+  if (ndjson->map)
+    munmap(ndjson->map, ndjson->size);
+
+  free(ndjson->chunks);
+  free(ndjson);
+}
+
+// The mapping is released once all outstanding batches are freed too
+void
+ndjson_close (ndjson_t *ndjson)
+{
+  if (ndjson)
+    ndjson_release(ndjson);
+}
+
+void
+ndjson_batch_free (ndjson_batch_t *batch)
+{
+  if (batch)
+  {
+    json_arena_free(batch->arena);
+    free(batch->records);
+    free(batch->tail);
+    ndjson_release(batch->ndjson);
+    free(batch);
+  }
+}
+
+// Parse chunk n. Blank lines are skipped; lines that do not parse,
+// including ones with an unterminated string, are counted in
+// ndjson->errors.
+ndjson_batch_t*
+ndjson_parse (ndjson_t *ndjson, size_t n)
+{
+  ndjson_batch_t *batch = allocate(sizeof(ndjson_batch_t));
+  memset(batch, 0, sizeof(ndjson_batch_t));
+
+  __sync_add_and_fetch(&ndjson->refs, 1);
+  batch->ndjson = ndjson;
+  batch->chunk = n;
+
+  char *subject = ndjson->chunks[n];
+  size_t length = ndjson->chunks[n+1] - subject;
+
+  // scalars are parsed up to a delimiter, so an unterminated last line
+  // must not end exactly at the end of the mapping
+  if (subject + length == ndjson->map + ndjson->size && subject[length-1] != '\n')
+  {
+    batch->tail = str_copy(subject, length);
+    subject = batch->tail;
+  }
+
+  size_t count = 0, i = 0, limit = 64;
+  uint32_t *index = json_structure(subject, length, &count);
+  batch->records = allocate(limit * sizeof(json_t*));
+
+  // a line of 4GB or more is too long for stage one
+  if (!index)
+  {
+    __sync_add_and_fetch(&ndjson->errors, 1);
+    batch->arena = json_arena_new();
+    return batch;
+  }
+
+  json_builder_t builder;
+  json_builder_init(&builder);
+
+  batch->arena = json_arena_new();
+  json_arena_current = batch->arena;
+
+  char *line = subject, *end = subject + length, *base = subject;
+  int single = 0;
+
+  while (line < end)
+  {
+    char *nl = memchr(line, '\n', end - line);
+    char *eol = nl ? nl: end;
+
+    if (single)
+    {
+      free(index);
+      base = line;
+      index = json_structure(line, eol - line, &count);
+      i = 0;
+    }
+
+    size_t upper = i, quotes = 0;
+    for (; upper < count && base + index[upper] < eol; upper++)
+      quotes += base[index[upper]] == '"';
+
+    // stage one carries string state across lines, so a string left open
+    // inverts it for the rest of the chunk; each later line is indexed on
+    // its own, so no byte is indexed more than twice
+    if (quotes % 2)
+    {
+      __sync_add_and_fetch(&ndjson->errors, 1);
+      single = 1;
+      line = eol + 1;
+      continue;
+    }
+
+    if (i < upper)
+    {
+      json_t *record = json_build(&builder, base, eol, index, upper, &i);
+
+      if (record)
+      {
+        if (batch->count == limit)
+        {
+          limit *= 2;
+          batch->records = reallocate(batch->records, limit * sizeof(json_t*));
+        }
+        batch->records[batch->count++] = record;
+      }
+      else
+        __sync_add_and_fetch(&ndjson->errors, 1);
+    }
+
+    i = upper;
+    line = eol + 1;
+  }
+
+  json_arena_current = NULL;
+
+  json_builder_clear(&builder);
+  free(index);
+
+  return batch;
+}
+
+int
+ndjson_deliver (ndjson_batch_t *batch, ndjson_cb cb, void *payload, size_t *records)
+{
+  int stop = 0;
+
+  for (size_t i = 0; !stop && i < batch->count; i++)
+  {
+    stop = cb(batch->records[i], payload);
+    *records += 1;
+  }
+
+  ndjson_batch_free(batch);
+  return stop;
+}
+
+#ifdef TOOLBELT_THREAD
+
+int
+ndjson_worker (void *ptr)
+{
+  ndjson_t *ndjson = ptr;
+
+  for (;;)
+  {
+    mutex_lock(&ndjson->mutex);
+
+    while (!ndjson->stop && ndjson->next < ndjson->count && ndjson->next >= ndjson->delivered + ndjson->window)
+      pthread_cond_wait(&ndjson->cond, &ndjson->mutex);
+
+    if (ndjson->stop || ndjson->next == ndjson->count)
+    {
+      mutex_unlock(&ndjson->mutex);
+      break;
+    }
+
+    size_t n = ndjson->next++;
+    mutex_unlock(&ndjson->mutex);
+
+    ndjson_batch_t *batch = ndjson_parse(ndjson, n);
+
+    mutex_lock(&ndjson->mutex);
+    ndjson->ready[n] = batch;
+    pthread_cond_broadcast(&ndjson->cond);
+    mutex_unlock(&ndjson->mutex);
+  }
+  return EXIT_SUCCESS;
+}
+
+// Parse on up to workers threads, keeping at most two chunks per worker in
+// flight. Batches go to cb per record, or whole to channel followed by a
+// NULL. Requires multithreaded().
+size_t
+ndjson_run (ndjson_t *ndjson, int workers, int flags, ndjson_cb cb, void *payload, channel_t *channel)
+{
+  size_t records = 0;
+
+  workers = max(1, min(workers, (int)ndjson->count));
+
+  ndjson->ready = allocate((ndjson->count + 1) * sizeof(ndjson_batch_t*));
+  memset(ndjson->ready, 0, (ndjson->count + 1) * sizeof(ndjson_batch_t*));
+  ndjson->next = 0;
+  ndjson->delivered = 0;
+  ndjson->window = workers * 2;
+  ndjson->stop = 0;
+
+  thread_t *threads[workers];
+
+  for (int i = 0; i < workers; i++)
+  {
+    threads[i] = thread_new();
+    thread_start(threads[i], ndjson_worker, ndjson);
+  }
+
+  while (!ndjson->stop && ndjson->delivered < ndjson->count)
+  {
+    ndjson_batch_t *batch = NULL;
+
+    mutex_lock(&ndjson->mutex);
+
+    while (!batch)
+    {
+      size_t n = flags & NDJSON_UNORDERED ? 0: ndjson->delivered;
+      size_t upper = flags & NDJSON_UNORDERED ? ndjson->next: n + 1;
+
+      for (; !batch && n < upper; n++)
+      {
+        batch = ndjson->ready[n];
+        ndjson->ready[n] = NULL;
+      }
+
+      if (!batch)
+        pthread_cond_wait(&ndjson->cond, &ndjson->mutex);
+    }
+
+    ndjson->delivered++;
+    pthread_cond_broadcast(&ndjson->cond);
+    mutex_unlock(&ndjson->mutex);
+
+    if (channel)
+    {
+      records += batch->count;
+      channel_write(channel, batch);
+    }
+    else
+    if (ndjson_deliver(batch, cb, payload, &records))
+    {
+      mutex_lock(&ndjson->mutex);
+      ndjson->stop = 1;
+      pthread_cond_broadcast(&ndjson->cond);
+      mutex_unlock(&ndjson->mutex);
+    }
+  }
+
+  for (int i = 0; i < workers; i++)
+    thread_wait(threads[i]);
+
+  for (size_t n = 0; n < ndjson->count; n++)
+    ndjson_batch_free(ndjson->ready[n]);
+
+  free(ndjson->ready);
+  ndjson->ready = NULL;
+
+  if (channel)
+    channel_write(channel, NULL);
+
+  return records;
+}
+
+// Deliver batches of records to channel, in input order unless
+// NDJSON_UNORDERED. Readers iterate batch->records, call
+// ndjson_batch_free, and stop at NULL.
+size_t
+ndjson_channel (ndjson_t *ndjson, int workers, int flags, channel_t *channel)
+{
+  return ndjson_run(ndjson, workers, flags, NULL, NULL, channel);
+}
+
+#endif
+
+// Call cb for every record until it returns non-zero. Records are valid
+// only for the duration of the callback. Returns the number of records
+// delivered.
+size_t
+ndjson_each (ndjson_t *ndjson, int workers, int flags, ndjson_cb cb, void *payload)
+{
+#ifdef TOOLBELT_THREAD
+  if (workers > 1)
+    return ndjson_run(ndjson, workers, flags, cb, payload, NULL);
+#endif
+
+  size_t records = 0;
+
+  for (size_t n = 0; n < ndjson->count; n++)
+  {
+    if (ndjson_deliver(ndjson_parse(ndjson, n), cb, payload, &records))
+      break;
+  }
+  return records;
+}
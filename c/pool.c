@@ -1,3 +1,10 @@
+#include <sys/file.h>
+#include <errno.h>
+
+#ifdef TOOLBELT_THREAD
+#include <pthread.h>
+#endif
+
 typedef struct _pool_header_t {
   size_t osize;
   size_t psize;
@@ -6,27 +13,936 @@ typedef struct _pool_header_t {
   off_t pfree;
 } pool_header_t;
 
-typedef struct _pool_t {
-  char *name;
-  pool_header_t *head;
-  int fd;
-  void *map;
-  unsigned char *bitmap;
-} pool_t;
+// The file is mapped at the start of a reserved address range so growth
+// maps the new tail in place and record pointers stay valid. Only a pool
+// that outgrows its reservation is moved.
+#define POOL_RESERVE ((size_t)1<<36)
+
+// Free space is a binary buddy system over slots. An order k block is 2^k
+// slots aligned to 2^k. Each order has a bitmap of free blocks and an
+// in-memory stack of candidates that is checked against the bitmap when
+// popped, so merging buddies never has to unlink anything. The bitmaps
+// live in a side file, see pool_free_open.
+#define POOL_ORDERS 32
+
+// The side file <name>.free holds a header page, then the slot bitmap and
+// one bitmap per order, each sized for capacity slots. pool_open trusts it
+// without reading the bitmaps when the header checksum matches, it was
+// marked clean by pool_sync or pool_close, and it agrees with the pool
+// header. A side file left dirty in the current boot only lost a process,
+// and the shared slot bitmap is still exact, so the orders are rebuilt
+// from it. Otherwise free space is rebuilt from the legacy free list, or
+// leaked if there is none, so a crash never hands out a slot twice.
+#define POOL_FREE_MAGIC "TBPFREE1"
+#define POOL_FREE_HEADER 4096
+#define POOL_FREE_RESERVE ((size_t)1<<34)
+
+typedef struct _pool_free_header_t {
+  char magic[8];
+  uint64_t capacity;
+  uint64_t osize;
+  uint64_t psize;
+  uint64_t pnext;
+  uint64_t clean;
+  uint64_t free[POOL_ORDERS];
+  char boot[40];
+  uint64_t checksum;
+} pool_free_header_t;
+
+// Processes with the pool open hold a shared flock on the side file. The
+// one that opens it alone checks it and sets up the lock, and the last to
+// close it marks it clean. Free space changes hold a robust process-shared
+// mutex kept in the header page outside the checksum; slot bitmap words
+// are also changed with atomic operations so pool_cache_t can reserve and
+// hand out slots without it.
+#define POOL_SHARED 2048
+
+typedef struct _pool_shared_t {
+  uint64_t resizing;
+#ifdef TOOLBELT_THREAD
+  pthread_mutex_t mutex;
+#endif
+} pool_shared_t;
+
+typedef struct _pool_order_t {
+  uint64_t *bits;
+  size_t *stack;
+  size_t count;
+  size_t limit;
+} pool_order_t;
+
+typedef struct _pool_t {
+  char *name;
+  pool_header_t *head;
+  int fd;
+  void *map;
+  size_t reserve;
+  uint64_t *bitmap;
+  pool_order_t orders[POOL_ORDERS];
+  size_t mapped;
+  int ffd;
+  void *fmap;
+  size_t fsize;
+  size_t freserve;
+  size_t capacity;
+  pool_free_header_t *fhead;
+  pool_shared_t *shared;
+  int mflags;
+  uint64_t *fdirty;
+  struct _pool_journal_t *journal;
+} pool_t;
+
+// Journaled pools keep both files mapped privately and log every change,
+// see pool_journal.c
+void pool_log_write (pool_t *pool, off_t position, size_t bytes);
+void pool_log_bytes (pool_t *pool, off_t position, size_t bytes);
+void pool_log_alloc (pool_t *pool, off_t position, size_t n);
+void pool_log_free (pool_t *pool, off_t position, size_t n);
+void pool_commit (pool_t *pool);
+void pool_journal_move (pool_t *pool, size_t bytes);
+void pool_checkpoint (pool_t *pool);
+void pool_journal_checkpoint (pool_t *pool);
+void pool_checkpoint_wait (pool_t *pool);
+void pool_journal_close (pool_t *pool);
+
+// side file pages changed since the last checkpoint
+#define pool_touch(pool,ptr) if ((pool)->fdirty) { \
+  size_t _page = ((char*)(ptr) - (char*)(pool)->fmap) / POOL_FREE_HEADER; \
+  __atomic_fetch_or(&(pool)->fdirty[_page / 64], 1ULL << (_page % 64), __ATOMIC_RELAXED); \
+}
+
+// free counts per order are shared with other processes
+#define pool_free_count(pool,k) ((pool)->fhead->free[k])
+
+// Read outside the lock while other threads change them atomically
+#define pool_word(pool,i) __atomic_load_n(&(pool)->bitmap[i], __ATOMIC_RELAXED)
+#define pool_pnext(pool) __atomic_load_n(&(pool)->head->pnext, __ATOMIC_ACQUIRE)
+#define pool_psize(pool) __atomic_load_n(&(pool)->head->psize, __ATOMIC_ACQUIRE)
+
+// Free slots, one bit per record slot rather than per byte offset
+#define pool_slot(pool,position) (((position) - sizeof(pool_header_t)) / (pool)->head->osize)
+#define pool_slots(pool) ((pool_psize(pool) - sizeof(pool_header_t)) / (pool)->head->osize)
+#define pool_limit(pool) pool_slot((pool), pool_pnext(pool))
+
+static inline void
+pool_mark (pool_t *pool, off_t position, int free)
+{
+  size_t slot = pool_slot(pool, position);
+  pool_touch(pool, &pool->bitmap[slot / 64]);
+
+  if (free)
+    __atomic_fetch_or(&pool->bitmap[slot / 64], 1ULL << (slot % 64), __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_and(&pool->bitmap[slot / 64], ~(1ULL << (slot % 64)), __ATOMIC_RELAXED);
+}
+
+void
+pool_mark_range (pool_t *pool, size_t slot, size_t n, int free)
+{
+  while (n)
+  {
+    size_t bit = slot % 64;
+    size_t run = min(64 - bit, n);
+    uint64_t mask = (run == 64 ? ~0ULL: (1ULL << run) - 1) << bit;
+    pool_touch(pool, &pool->bitmap[slot / 64]);
+
+    if (free)
+      __atomic_fetch_or(&pool->bitmap[slot / 64], mask, __ATOMIC_RELAXED);
+    else
+      __atomic_fetch_and(&pool->bitmap[slot / 64], ~mask, __ATOMIC_RELAXED);
+
+    slot += run;
+    n -= run;
+  }
+}
+
+static inline int
+pool_order_has (pool_t *pool, int k, size_t block)
+{
+  return pool->orders[k].bits[(block >> k) / 64] >> ((block >> k) % 64) & 1;
+}
+
+static inline void
+pool_order_set (pool_t *pool, int k, size_t block, int free)
+{
+  pool_order_t *order = &pool->orders[k];
+  size_t i = block >> k;
+  pool_touch(pool, &order->bits[i / 64]);
+
+  if (free)
+    order->bits[i / 64] |= 1ULL << (i % 64);
+  else
+    order->bits[i / 64] &= ~(1ULL << (i % 64));
+
+  pool_free_count(pool, k) += free ? 1: -1;
+}
+
+// drop stale and duplicate candidates
+void
+pool_order_prune (pool_t *pool, int k)
+{
+  pool_order_t *order = &pool->orders[k];
+  size_t n = 0;
+
+  for (size_t i = 0; i < order->count; i++)
+  {
+    if (pool_order_has(pool, k, order->stack[i]))
+    {
+      pool_order_set(pool, k, order->stack[i], 0);
+      order->stack[n++] = order->stack[i];
+    }
+  }
+
+  for (size_t i = 0; i < n; i++)
+    pool_order_set(pool, k, order->stack[i], 1);
+
+  order->count = n;
+}
+
+void
+pool_order_add (pool_t *pool, int k, size_t block)
+{
+  pool_order_t *order = &pool->orders[k];
+
+  if (order->count == order->limit && order->count > pool_free_count(pool, k) * 2 + 64)
+    pool_order_prune(pool, k);
+
+  if (order->count == order->limit)
+  {
+    order->limit = max(64, order->limit * 2);
+    order->stack = reallocate(order->stack, order->limit * sizeof(size_t));
+  }
+
+  order->stack[order->count++] = block;
+}
+
+void
+pool_order_push (pool_t *pool, int k, size_t block)
+{
+  pool_order_set(pool, k, block, 1);
+  pool_order_add(pool, k, block);
+}
+
+static inline size_t
+pool_free_words (size_t capacity, int section)
+{
+  return max((size_t)1, (capacity >> (section ? section - 1: 0)) / 64);
+}
+
+// stacks start empty after pool_open and are filled from the bitmap on
+// first use
+void
+pool_order_fill (pool_t *pool, int k)
+{
+  pool_order_t *order = &pool->orders[k];
+  size_t words = pool_free_words(pool->fhead->capacity, k + 1);
+
+  for (size_t word = 0; word < words; word++)
+  {
+    for (uint64_t bits = order->bits[word]; bits; bits &= bits - 1)
+      pool_order_add(pool, k, (word * 64 + __builtin_ctzll(bits)) << k);
+  }
+}
+
+size_t
+pool_order_pop (pool_t *pool, int k)
+{
+  pool_order_t *order = &pool->orders[k];
+
+  if (!order->count && pool_free_count(pool, k))
+    pool_order_fill(pool, k);
+
+  while (order->count)
+  {
+    size_t block = order->stack[--order->count];
+
+    if (pool_order_has(pool, k, block))
+    {
+      pool_order_set(pool, k, block, 0);
+      return block;
+    }
+  }
+  return SIZE_MAX;
+}
+
+// free a block, merging it with its buddy while that is free too
+void
+pool_release (pool_t *pool, size_t block, int k)
+{
+  size_t limit = pool_limit(pool);
+
+  while (k < POOL_ORDERS-1)
+  {
+    size_t buddy = block ^ (1ULL << k);
+
+    if (buddy + (1ULL << k) > limit || !pool_order_has(pool, k, buddy))
+      break;
+
+    pool_order_set(pool, k, buddy, 0);
+    block &= ~(1ULL << k);
+    k++;
+  }
+
+  pool_order_push(pool, k, block);
+}
+
+// free any run of slots as the largest aligned blocks that fit
+void
+pool_release_range (pool_t *pool, size_t slot, size_t n)
+{
+  while (n)
+  {
+    int k = slot ? min(__builtin_ctzll(slot), POOL_ORDERS-1): POOL_ORDERS-1;
+
+    while ((1ULL << k) > n)
+      k--;
+
+    pool_release(pool, slot, k);
+    slot += 1ULL << k;
+    n -= 1ULL << k;
+  }
+}
+
+// number of free slots from slot onward, up to n
+size_t
+pool_run_after (pool_t *pool, size_t slot, size_t n)
+{
+  size_t x = slot, limit = min(pool_limit(pool), slot + n);
+
+  while (x < limit)
+  {
+    uint64_t live = ~pool_word(pool, x / 64) >> (x % 64);
+
+    if (live)
+      return min(x + __builtin_ctzll(live), limit) - slot;
+
+    x = (x / 64 + 1) * 64;
+  }
+  return min(x, limit) - slot;
+}
+
+// number of free slots just below slot, up to n
+size_t
+pool_run_before (pool_t *pool, size_t slot, size_t n)
+{
+  size_t x = slot;
+
+  while (x > 0 && slot - x < n)
+  {
+    size_t bit = (x - 1) % 64;
+    uint64_t live = ~pool_word(pool, (x - 1) / 64) << (63 - bit);
+
+    if (live)
+      return min(slot - x + __builtin_clzll(live), n);
+
+    x -= bit + 1;
+  }
+  return min(slot - x, n);
+}
+
+// Allocate free slots [slot, slot+n) that may span several blocks,
+// returning the parts of the first and last blocks outside the range
+void
+pool_claim (pool_t *pool, size_t slot, size_t n)
+{
+  size_t end = slot + n;
+
+  for (size_t x = slot; x < end; )
+  {
+    int k = 0;
+    size_t block = x;
+
+    while (k < POOL_ORDERS && !pool_order_has(pool, k, block))
+    {
+      k++;
+      block = x & ~((1ULL << k) - 1);
+    }
+
+    ensure(k < POOL_ORDERS)
+      errorf("pool free space corrupt: %s", pool->name);
+
+    pool_order_set(pool, k, block, 0);
+
+    size_t block_end = block + (1ULL << k);
+
+    if (block < x)
+      pool_release_range(pool, block, x - block);
+
+    if (block_end > end)
+      pool_release_range(pool, end, block_end - end);
+
+    x = block_end;
+  }
+
+  pool_mark_range(pool, slot, n, 0);
+}
+
+// Whether free slots [slot, slot+n) are all in free blocks. Slots held by
+// a pool_cache_t are free in the slot bitmap but in no block.
+int
+pool_claimable (pool_t *pool, size_t slot, size_t n)
+{
+  for (size_t x = slot; x < slot + n; )
+  {
+    int k = 0;
+    size_t block = x;
+
+    while (k < POOL_ORDERS && !pool_order_has(pool, k, block))
+    {
+      k++;
+      block = x & ~((1ULL << k) - 1);
+    }
+
+    if (k == POOL_ORDERS)
+      return 0;
+
+    x = block + (1ULL << k);
+  }
+  return 1;
+}
+
+#define POOL_PROBES 4
+
+// First slot of n free contiguous slots, or SIZE_MAX. Tries blocks one
+// order too small that continue into free neighbours first, so holes are
+// reused before larger blocks are split.
+size_t
+pool_take (pool_t *pool, size_t n)
+{
+  int k = 0;
+
+  while ((1ULL << k) < n)
+    k++;
+
+  if (k > 0 && (1ULL << k) != n)
+  {
+    pool_order_t *order = &pool->orders[k-1];
+
+    for (size_t i = order->count, probes = 0; i-- > 0 && probes < POOL_PROBES; )
+    {
+      size_t block = order->stack[i];
+
+      if (!pool_order_has(pool, k-1, block))
+      {
+        order->stack[i] = order->stack[--order->count];
+        continue;
+      }
+
+      probes++;
+
+      if (pool_run_after(pool, block, n) == n && pool_claimable(pool, block, n))
+      {
+        pool_claim(pool, block, n);
+        return block;
+      }
+    }
+  }
+
+  for (int j = k; j < POOL_ORDERS; j++)
+  {
+    if (!pool_free_count(pool, j))
+      continue;
+
+    size_t block = pool_order_pop(pool, j);
+
+    if (block != SIZE_MAX)
+    {
+      pool_release_range(pool, block + n, (1ULL << j) - n);
+      pool_mark_range(pool, block, n, 0);
+      return block;
+    }
+  }
+  return SIZE_MAX;
+}
+
+void
+pool_map (pool_t *pool, size_t bytes)
+{
+  if (pool->map)
+    ensure(munmap(pool->map, pool->reserve) == 0)
+      errorf("cannot unmap pool: %s", pool->name);
+
+  pool->reserve = max(POOL_RESERVE, bytes * 2);
+  pool->map = mmap(NULL, pool->reserve, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+
+  ensure(pool->map != MAP_FAILED)
+    errorf("cannot reserve pool: %s", pool->name);
+
+  ensure(mmap(pool->map, bytes, PROT_READ|PROT_WRITE, pool->mflags|MAP_FIXED, pool->fd, 0) == pool->map)
+    errorf("cannot mmap pool: %s", pool->name);
+
+  pool->head = pool->map;
+  pool->mapped = bytes;
+}
+
+// map the file up to bytes, in place unless it outgrows the reservation
+void
+pool_extend (pool_t *pool, size_t bytes)
+{
+  if (bytes <= pool->mapped)
+    return;
+
+  if (bytes > pool->reserve)
+  {
+    if (pool->journal)
+      pool_journal_move(pool, bytes);
+    else
+      pool_map(pool, bytes);
+    return;
+  }
+
+  // map whole pages after the old end; the page holding the end is
+  // already mapped and may have private changes
+  size_t size = sysconf(_SC_PAGESIZE);
+  off_t page = (pool->mapped + size - 1) & ~(size - 1);
+
+  if (page < bytes)
+    ensure(mmap(pool->map + page, bytes - page, PROT_READ|PROT_WRITE, pool->mflags|MAP_FIXED, pool->fd, page) == pool->map + page)
+      errorf("cannot mmap pool: %s", pool->name);
+
+  pool->mapped = bytes;
+}
+
+uint64_t
+pool_free_checksum (pool_free_header_t *fhead)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  unsigned char *p = (unsigned char*)fhead;
+
+  for (size_t i = 0; i < (unsigned char*)&fhead->checksum - p; i++)
+    hash = (hash ^ p[i]) * 1099511628211ULL;
+
+  return hash;
+}
+
+static inline size_t
+pool_free_offset (size_t capacity, int section)
+{
+  size_t offset = POOL_FREE_HEADER;
+
+  for (int i = 0; i < section; i++)
+    offset += pool_free_words(capacity, i) * sizeof(uint64_t);
+
+  return offset;
+}
+
+// The side file is mapped at the start of a reserved range like the pool
+// and grows in place, so the header, the shared lock and the slot bitmap
+// never move or get remapped while other threads use them. A journaled
+// pool leaves the file alone until the next checkpoint, so its new tail is
+// anonymous memory.
+void
+pool_free_map (pool_t *pool, size_t capacity)
+{
+  size_t fsize = pool->fsize;
+
+  pool->fsize = max(fsize, pool_free_offset(capacity, POOL_ORDERS + 1));
+
+  if (!pool->fmap)
+  {
+    pool->freserve = max(POOL_FREE_RESERVE, pool->fsize * 2);
+    pool->fmap = mmap(NULL, pool->freserve, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+
+    ensure(pool->fmap != MAP_FAILED)
+      errorf("cannot reserve pool free space: %s", pool->name);
+
+    pool->fhead = pool->fmap;
+    pool->shared = pool->fmap + POOL_SHARED;
+    pool->bitmap = pool->fmap + pool_free_offset(capacity, 0);
+  }
+
+  ensure(pool->fsize <= pool->freserve)
+    errorf("pool free space outgrew its reservation: %s", pool->name);
+
+  // map whole pages after the old end, like pool_extend
+  size_t size = sysconf(_SC_PAGESIZE);
+  off_t page = (fsize + size - 1) & ~(size - 1);
+
+  if (pool->journal)
+  {
+    if (page < pool->fsize)
+      ensure(mmap(pool->fmap + page, pool->fsize - page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) == pool->fmap + page)
+        errorf("cannot mmap pool free space: %s", pool->name);
+
+    size_t words = pool->fsize / POOL_FREE_HEADER / 64 + 1;
+    pool->fdirty = reallocate(pool->fdirty, words * sizeof(uint64_t));
+    memset(pool->fdirty, 0xff, words * sizeof(uint64_t));
+  }
+  else
+  {
+    ensure(ftruncate(pool->ffd, pool->fsize) == 0)
+      errorf("cannot extend pool free space: %s", pool->name);
+
+    if (page < pool->fsize)
+      ensure(mmap(pool->fmap + page, pool->fsize - page, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, pool->ffd, page) == pool->fmap + page)
+        errorf("cannot mmap pool free space: %s", pool->name);
+  }
+
+  pool->capacity = capacity;
+
+  for (int k = 0; k < POOL_ORDERS; k++)
+    pool->orders[k].bits = pool->fmap + pool_free_offset(capacity, k + 1);
+}
+
+// Move each bitmap to its place for a larger capacity, last first so
+// nothing is overwritten before it has moved
+void
+pool_free_resize (pool_t *pool, size_t capacity)
+{
+  size_t old = pool->fhead->capacity;
+
+  pool_free_map(pool, capacity);
+  pool->shared->resizing = 1;
+
+  // the slot bitmap stays put, and may be changed by caches meanwhile
+  for (int i = POOL_ORDERS; i >= 0; i--)
+  {
+    size_t words = pool_free_words(old, i) * sizeof(uint64_t);
+    size_t limit = pool_free_words(capacity, i) * sizeof(uint64_t);
+
+    if (i)
+      memmove(pool->fmap + pool_free_offset(capacity, i), pool->fmap + pool_free_offset(old, i), words);
+    memset(pool->fmap + pool_free_offset(capacity, i) + words, 0, limit - words);
+  }
+
+  pool->fhead->capacity = capacity;
+  pool->shared->resizing = 0;
+}
+
+void
+pool_free_store (pool_t *pool)
+{
+  if (pool->fhead->clean)
+    return;
+
+  pool->fhead->psize = pool->head->psize;
+  pool->fhead->pnext = pool->head->pnext;
+
+  ensure(msync(pool->fmap, pool->fsize, MS_SYNC) == 0)
+    errorf("pool sync failed: %s", pool->name);
+
+  pool->fhead->clean = 1;
+  pool->fhead->checksum = pool_free_checksum(pool->fhead);
+
+  ensure(msync(pool->fmap, POOL_FREE_HEADER, MS_SYNC) == 0)
+    errorf("pool sync failed: %s", pool->name);
+}
+
+// Id of the running kernel, or empty when unknown
+void
+pool_boot (char *boot)
+{
+  memset(boot, 0, 40);
+
+  int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+
+  if (fd >= 0)
+  {
+    if (read(fd, boot, 39) <= 0)
+      memset(boot, 0, 40);
+    close(fd);
+  }
+}
+
+// The first change after a clean point reaches disk before any bitmap
+// does, so a crash is always noticed
+static inline void
+pool_dirty (pool_t *pool)
+{
+  if (pool->fhead->clean)
+  {
+    pool->fhead->clean = 0;
+    pool_boot(pool->fhead->boot);
+    pool->fhead->checksum = pool_free_checksum(pool->fhead);
+
+    ensure(msync(pool->fmap, POOL_FREE_HEADER, MS_SYNC) == 0)
+      errorf("pool sync failed: %s", pool->name);
+  }
+}
+
+// Put every run of free slots below pnext into the orders
+static void
+pool_free_runs (pool_t *pool)
+{
+  size_t limit = pool_limit(pool);
+
+  for (size_t slot = 0; slot < limit; )
+  {
+    uint64_t bits = pool_word(pool, slot / 64) >> (slot % 64);
+
+    if (!bits)
+    {
+      slot = (slot / 64 + 1) * 64;
+      continue;
+    }
+
+    size_t start = slot + __builtin_ctzll(bits);
+
+    for (slot = start; slot < limit; )
+    {
+      uint64_t live = ~pool_word(pool, slot / 64) >> (slot % 64);
+
+      if (live)
+      {
+        slot += __builtin_ctzll(live);
+        break;
+      }
+      slot = (slot / 64 + 1) * 64;
+    }
+
+    slot = min(slot, limit);
+    pool_release_range(pool, start, slot - start);
+  }
+}
+
+void
+pool_free_repair (pool_t *pool)
+{
+  size_t capacity = 64;
+
+  while (capacity < pool_slots(pool))
+    capacity *= 2;
+
+  ensure(ftruncate(pool->ffd, 0) == 0)
+    errorf("cannot reset pool free space: %s", pool->name);
+
+  pool_free_map(pool, capacity);
+
+  memmove(pool->fhead->magic, POOL_FREE_MAGIC, 8);
+  pool->fhead->capacity = capacity;
+  pool->fhead->osize = pool->head->osize;
+
+  memset(pool->fhead->free, 0, sizeof(pool->fhead->free));
+
+  // pools written before the side file existed keep a free list
+  for (off_t pos = pool->head->pfree; pos; pos = *((off_t*)(pool->map + pos)))
+  {
+    if (pos < sizeof(pool_header_t) || pos >= pool->head->pnext || (pos - sizeof(pool_header_t)) % pool->head->osize
+      || pool_word(pool, pool_slot(pool, pos) / 64) >> (pool_slot(pool, pos) % 64) & 1)
+      break;
+
+    pool_mark(pool, pos, 1);
+  }
+
+  pool->head->pfree = 0;
+
+  pool_free_runs(pool);
+  pool_free_store(pool);
+}
+
+// Rebuild the orders from a slot bitmap that outlived its process. Bits
+// past pnext, or past the old capacity if a resize was cut short, are
+// cleared.
+void
+pool_free_rebuild (pool_t *pool, size_t capacity)
+{
+  size_t old = capacity;
+
+  while (capacity < pool_slots(pool))
+    capacity *= 2;
+
+  pool_free_map(pool, capacity);
+
+  size_t limit = min(pool_limit(pool), old);
+  size_t words = pool_free_words(capacity, 0);
+
+  if (limit % 64)
+    pool->bitmap[limit / 64] &= (1ULL << (limit % 64)) - 1;
+
+  for (size_t w = (limit + 63) / 64; w < words; w++)
+    pool->bitmap[w] = 0;
+
+  memset(pool->fmap + pool_free_offset(capacity, 1), 0, pool->fsize - pool_free_offset(capacity, 1));
+  memset(pool->fhead->free, 0, sizeof(pool->fhead->free));
+
+  pool->fhead->capacity = capacity;
+
+  pool_free_runs(pool);
+  pool_free_store(pool);
+}
+
+// Open the side file and lock it before the pool file is touched. The
+// first opener holds it exclusively while it creates or checks both files;
+// later openers wait for that to finish. Returns 1 for the first opener, 0
+// for a later one, and -1 if the pool is already open and cannot be shared
+// without TOOLBELT_THREAD.
+int
+pool_free_lock (pool_t *pool)
+{
+  char path[strlen(pool->name) + 6];
+  sprintf(path, "%s.free", pool->name);
+
+  pool->ffd = open(path, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
+
+  ensure(pool->ffd >= 0)
+    errorf("cannot open pool free space: %s", path);
+
+  if (flock(pool->ffd, LOCK_EX|LOCK_NB) == 0)
+    return 1;
+
+  ensure(errno == EWOULDBLOCK)
+    errorf("cannot lock pool free space: %s", path);
+
+#ifndef TOOLBELT_THREAD
+  return -1;
+#endif
+
+  ensure(flock(pool->ffd, LOCK_SH) == 0)
+    errorf("cannot share pool free space: %s", path);
+
+  return 0;
+}
 
 void
-pool_bitmap (pool_t *pool)
+pool_free_open (pool_t *pool, int owner, int fresh)
 {
-  free(pool->bitmap);
+  pool_free_header_t fhead;
+  struct stat st;
 
-  pool->bitmap = allocate(pool->head->psize / 8 + 1);
-  memset(pool->bitmap, 0, pool->head->psize / 8 + 1);
+  if (!owner)
+  {
+    ensure(pread(pool->ffd, &fhead, sizeof(fhead), 0) == sizeof(fhead))
+      errorf("cannot share pool free space: %s", pool->name);
 
-  for (off_t pos = pool->head->pfree; pos; pos = *((off_t*)(pool->map + pos)))
-    pool->bitmap[pos / 8] |= 1 << (pos % 8);
+    pool_free_map(pool, fhead.capacity);
+    return;
+  }
+
+  char boot[40];
+  pool_boot(boot);
+
+  int intact = !fresh
+    && fstat(pool->ffd, &st) == 0
+    && pread(pool->ffd, &fhead, sizeof(fhead), 0) == sizeof(fhead)
+    && !memcmp(fhead.magic, POOL_FREE_MAGIC, 8)
+    && fhead.osize == pool->head->osize
+    && fhead.capacity >= 64 && !(fhead.capacity & (fhead.capacity - 1));
+
+  int valid = intact
+    && fhead.checksum == pool_free_checksum(&fhead)
+    && fhead.clean
+    && fhead.psize == pool->head->psize
+    && fhead.pnext == pool->head->pnext
+    && fhead.capacity >= pool_slots(pool)
+    && st.st_size == pool_free_offset(fhead.capacity, POOL_ORDERS + 1);
+
+  // counts change after pool_dirty without the checksum, so a dirty
+  // header is only trusted for the fields pool_dirty wrote
+  int survived = intact && !fhead.clean
+    && boot[0] && !memcmp(fhead.boot, boot, 40)
+    && st.st_size >= pool_free_offset(fhead.capacity, 1);
+
+  if (valid)
+    pool_free_map(pool, fhead.capacity);
+  else
+  if (survived)
+    pool_free_rebuild(pool, fhead.capacity);
+  else
+    pool_free_repair(pool);
+
+  pool->shared->resizing = 0;
+
+#ifdef TOOLBELT_THREAD
+  pthread_mutexattr_t attr;
+  assert0(pthread_mutexattr_init(&attr));
+  assert0(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED));
+  assert0(pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST));
+  assert0(pthread_mutex_init(&pool->shared->mutex, &attr));
+  assert0(pthread_mutexattr_destroy(&attr));
+#endif
+
+  ensure(flock(pool->ffd, LOCK_SH) == 0)
+    errorf("cannot share pool free space: %s", pool->name);
+}
+
+void
+pool_grow (pool_t *pool, size_t bytes)
+{
+  size_t psize = pool->head->psize;
+
+  ensure(ftruncate(pool->fd, psize + bytes) == 0)
+    errorf("cannot extend pool: %s", pool->name);
+
+  pool_extend(pool, psize + bytes);
+  __atomic_store_n(&pool->head->psize, psize + bytes, __ATOMIC_RELEASE);
+
+  size_t capacity = pool->fhead->capacity;
+
+  while (capacity < pool_slots(pool))
+    capacity *= 2;
+
+  if (capacity > pool->fhead->capacity)
+    pool_free_resize(pool, capacity);
 }
 
+// A process that died holding the lock may have left an order bitmap half
+// way through a move. Free space in blocks is leaked rather than trusted.
 void
+pool_free_recover (pool_t *pool)
+{
+  if (!pool->shared->resizing)
+    return;
+
+  size_t old = pool->fhead->capacity;
+  size_t capacity = 64;
+
+  while (capacity < pool_slots(pool))
+    capacity *= 2;
+
+  pool_free_map(pool, max(capacity, old));
+  pool_dirty(pool);
+
+  size_t words = pool_free_words(old, 0) * sizeof(uint64_t);
+  memset(pool->fmap + pool_free_offset(pool->capacity, 0) + words, 0, pool_free_offset(pool->capacity, 1) - pool_free_offset(pool->capacity, 0) - words);
+  memset(pool->fmap + pool_free_offset(pool->capacity, 1), 0, pool->fsize - pool_free_offset(pool->capacity, 1));
+  memset(pool->fhead->free, 0, sizeof(pool->fhead->free));
+
+  for (int k = 0; k < POOL_ORDERS; k++)
+    pool->orders[k].count = 0;
+
+  pool->fhead->capacity = pool->capacity;
+  pool->shared->resizing = 0;
+}
+
+// catch up with growth by other processes
+static inline void
+pool_refresh (pool_t *pool)
+{
+  pool_extend(pool, pool->head->psize);
+
+  if (pool->fhead->capacity != pool->capacity)
+    pool_free_map(pool, pool->fhead->capacity);
+}
+
+static inline void
+pool_lock (pool_t *pool)
+{
+#ifdef TOOLBELT_THREAD
+  int rc = pthread_mutex_lock(&pool->shared->mutex);
+
+  if (rc == EOWNERDEAD)
+  {
+    pool_free_recover(pool);
+    rc = pthread_mutex_consistent(&pool->shared->mutex);
+  }
+
+  ensure(rc == 0)
+    errorf("cannot lock pool: %s", pool->name);
+#endif
+  pool_refresh(pool);
+}
+
+static inline void
+pool_unlock (pool_t *pool)
+{
+#ifdef TOOLBELT_THREAD
+  assert0(pthread_mutex_unlock(&pool->shared->mutex));
+#endif
+}
+
+// EXIT_FAILURE if the pool is already open and TOOLBELT_THREAD is not
+// defined
+int
 pool_open (pool_t *pool, char *name, size_t osize, size_t pstep)
 {
   osize = max(osize, sizeof(off_t*));
@@ -35,11 +951,39 @@ pool_open (pool_t *pool, char *name, size_t osize, size_t pstep)
   pool->head = NULL;
   pool->fd   = 0;
   pool->name = strdup(name);
+  pool->reserve = 0;
   pool->bitmap = NULL;
+  pool->mapped = 0;
+  pool->ffd = 0;
+  pool->fmap = NULL;
+  pool->fsize = 0;
+  pool->freserve = 0;
+  pool->capacity = 0;
+  pool->fhead = NULL;
+  pool->shared = NULL;
+  pool->mflags = MAP_SHARED;
+  pool->fdirty = NULL;
+  pool->journal = NULL;
+  memset(pool->orders, 0, sizeof(pool->orders));
+
+  int owner = pool_free_lock(pool);
+
+  if (owner < 0)
+  {
+    close(pool->ffd);
+    free(pool->name);
+    pool->ffd = 0;
+    pool->name = NULL;
+    return EXIT_FAILURE;
+  }
+
+  int fresh = 0;
 
   struct stat st;
 
-  if (stat(pool->name, &st) == 0)
+  // a pool file shorter than its header was never set up, as that is done
+  // under the exclusive lock
+  if (stat(pool->name, &st) == 0 && (!owner || st.st_size >= sizeof(pool_header_t)))
   {
     ensure((st.st_size - sizeof(pool_header_t)) % osize == 0)
       errorf("pool file exists with invalid size: %s", pool->name);
@@ -49,12 +993,7 @@ pool_open (pool_t *pool, char *name, size_t osize, size_t pstep)
     ensure(pool->fd >= 0)
       errorf("cannot reopen pool: %s", pool->name);
 
-    pool->map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, pool->fd, 0);
-
-    ensure(pool->map && pool->map != MAP_FAILED)
-      errorf("cannot mmap pool: %s", pool->name);
-
-    pool->head = pool->map;
+    pool_map(pool, st.st_size);
 
     ensure(pool->head->osize == osize
       && pool->head->pstep == pstep
@@ -64,57 +1003,74 @@ pool_open (pool_t *pool, char *name, size_t osize, size_t pstep)
   }
   else
   {
-    pool->fd = open(pool->name, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
+    pool->fd = open(pool->name, O_CREAT|O_TRUNC|O_RDWR, S_IRUSR|S_IWUSR);
 
     ensure(pool->fd >= 0)
       errorf("cannot create pool: %s", pool->name);
 
     size_t bytes = 1000 * osize + sizeof(pool_header_t);
 
-    void *ptr = allocate(bytes);
-    memset(ptr, 0, bytes);
-
-    ensure(write(pool->fd, ptr, bytes) == bytes)
+    ensure(ftruncate(pool->fd, bytes) == 0)
       errorf("cannot write pool: %s", pool->name);
 
-    free(ptr);
-
-    pool->map = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, pool->fd, 0);
-
-    ensure(pool->map && pool->map != MAP_FAILED)
-      errorf("cannot mmap pool: %s", pool->name);
-
-    pool->head = pool->map;
+    pool_map(pool, bytes);
     pool->head->pnext = sizeof(pool_header_t);
     pool->head->osize = osize;
     pool->head->pstep = pstep;
     pool->head->psize = bytes;
+    fresh = 1;
   }
 
-  pool_bitmap(pool);
+  pool_free_open(pool, owner, fresh);
+  return EXIT_SUCCESS;
 }
 
 void
 pool_close (pool_t *pool)
 {
-  ensure(munmap(pool->map, pool->head->psize) == 0)
+  if (pool->journal)
+  {
+    pool_checkpoint(pool);
+    pool_checkpoint_wait(pool);
+    pool_journal_close(pool);
+  }
+
+  // the last process to close marks free space clean
+  pool_lock(pool);
+
+  if (flock(pool->ffd, LOCK_EX|LOCK_NB) == 0)
+    pool_free_store(pool);
+
+  pool_unlock(pool);
+
+  ensure(munmap(pool->map, pool->reserve) == 0 && munmap(pool->fmap, pool->freserve) == 0)
     errorf("cannot unmap pool: %s", pool->name);
 
-  ensure(close(pool->fd) == 0)
+  ensure(close(pool->fd) == 0 && close(pool->ffd) == 0)
     errorf("cannot close pool: %s", pool->name);
 
   pool->fd = 0;
+  pool->ffd = 0;
   free(pool->name);
-  free(pool->bitmap);
+
+  for (int k = 0; k < POOL_ORDERS; k++)
+    free(pool->orders[k].stack);
+
+  pool->bitmap = NULL;
+  pool->fmap = NULL;
+  pool->fhead = NULL;
+  pool->shared = NULL;
+
   pool->name = NULL;
   pool->head = NULL;
   pool->map = NULL;
+  pool->reserve = 0;
 }
 
 void*
 pool_read (pool_t *pool, off_t position, void *ptr)
 {
-  ensure(position >= sizeof(pool_header_t) && position < pool->head->psize)
+  ensure(position >= sizeof(pool_header_t) && position < pool_psize(pool))
     errorf("attempt to access outside pool: %lu %s", position, pool->name);
 
   if (ptr)
@@ -126,111 +1082,195 @@ pool_read (pool_t *pool, off_t position, void *ptr)
   return pool->map + position;
 }
 
+// A journaled pool logs the record even when ptr is NULL or the record
+// itself, so changes made in place are passed here to be kept
 void
 pool_write (pool_t *pool, off_t position, void *ptr)
 {
-  ensure(position >= sizeof(pool_header_t) && position < pool->head->psize)
+  ensure(position >= sizeof(pool_header_t) && position < pool_psize(pool))
     errorf("attempt to access outside pool: %lu %s", position, pool->name);
 
   if (ptr && ptr != pool->map + position)
     memmove(pool->map + position, ptr, pool->head->osize);
+
+  if (pool->journal)
+    pool_log_write(pool, position, pool->head->osize);
 }
 
-off_t
-pool_alloc (pool_t *pool)
+static off_t
+pool_alloc_run (pool_t *pool, size_t n)
 {
-  if (pool->head->pfree)
+  pool_dirty(pool);
+
+  size_t slot = pool_take(pool, n);
+
+  if (slot != SIZE_MAX)
   {
-    off_t position = pool->head->pfree;
-    pool->head->pfree = *((off_t*)(pool->map + pool->head->pfree));
-    pool->bitmap[position / 8] &= ~(1 << (position % 8));
+    off_t position = sizeof(pool_header_t) + slot * pool->head->osize;
+
+    if (pool->journal)
+      pool_log_alloc(pool, position, n);
+
     return position;
   }
 
-  if (pool->head->pnext == pool->head->psize)
-  {
-    size_t bytes = pool->head->pstep * pool->head->osize;
-    size_t psize = pool->head->psize;
-
-    ensure(munmap(pool->map, psize) == 0)
-      errorf("cannot unmap pool: %s", pool->name);
+  // extend any free run at the end of the used space
+  size_t limit = pool_limit(pool);
+  size_t run = pool_run_before(pool, limit, n);
 
-    void *ptr = allocate(bytes);
-    memset(ptr, 0, bytes);
+  if (run && !pool_claimable(pool, limit - run, run))
+    run = 0;
 
-    ensure(lseek(pool->fd, psize, SEEK_SET))
-      errorf("cannot seek pool: %s", pool->name);
+  if (run)
+    pool_claim(pool, limit - run, run);
 
-    ensure(write(pool->fd, ptr, bytes) == bytes)
-      errorf("cannot write pool: %s", pool->name);
+  size_t bytes = (n - run) * pool->head->osize;
 
-    free(ptr);
+  if (pool->head->pnext + bytes > pool->head->psize)
+    pool_grow(pool, max(pool->head->pstep, n) * pool->head->osize);
 
-    pool->map = mmap(NULL, psize + bytes, PROT_READ|PROT_WRITE, MAP_SHARED, pool->fd, 0);
+  off_t position = pool->head->pnext;
+  memset(pool->map + position, 0, bytes);
+  __atomic_store_n(&pool->head->pnext, position + bytes, __ATOMIC_RELEASE);
+  position -= run * pool->head->osize;
 
-    ensure(pool->map && pool->map != MAP_FAILED)
-      errorf("cannot mmap pool: %s", pool->name);
+  if (pool->journal)
+    pool_log_alloc(pool, position, n);
 
-    pool->head = pool->map;
-    pool->head->psize = psize + bytes;
-    pool_bitmap(pool);
-  }
+  return position;
+}
 
-  off_t position = pool->head->pnext;
-  memset(pool->map + position, 0, pool->head->osize);
-  pool->head->pnext += pool->head->osize;
+off_t
+pool_alloc_slots (pool_t *pool, size_t n)
+{
+  pool_lock(pool);
+  off_t position = pool_alloc_run(pool, n);
+  pool_unlock(pool);
   return position;
 }
 
 void
-pool_free (pool_t *pool, off_t position)
+pool_free_slots (pool_t *pool, off_t position, size_t n)
 {
-  ensure(position >= sizeof(pool_header_t) && position < pool->head->psize)
+  ensure(position >= sizeof(pool_header_t) && position + n * pool->head->osize <= pool_pnext(pool))
     errorf("attempt to access outside pool: %lu %s", position, pool->name);
 
-  *((off_t*)(pool->map + position)) = pool->head->pfree;
-  pool->head->pfree = position;
+  pool_lock(pool);
+  pool_dirty(pool);
+
+  pool_mark_range(pool, pool_slot(pool, position), n, 1);
+  pool_release_range(pool, pool_slot(pool, position), n);
+
+  if (pool->journal)
+    pool_log_free(pool, position, n);
+
+  pool_unlock(pool);
+}
+
+off_t
+pool_alloc (pool_t *pool)
+{
+  return pool_alloc_slots(pool, 1);
+}
 
-  pool->bitmap[position / 8] |= 1 << (position % 8);
+void
+pool_free (pool_t *pool, off_t position)
+{
+  pool_free_slots(pool, position, 1);
 }
 
 void
 pool_sync (pool_t *pool)
 {
+  if (pool->journal)
+  {
+    pool_commit(pool);
+    return;
+  }
+
   ensure(msync(pool->map, pool->head->pnext, MS_SYNC) == 0)
     errorf("pool sync failed: %s", pool->name);
+
+  pool_lock(pool);
+  pool_free_store(pool);
+  pool_unlock(pool);
 }
 
 int
 pool_is_free (pool_t *pool, off_t position)
 {
-  return position >= pool->head->pnext || pool->bitmap[position / 8] & 1 << (position % 8) ? 1:0;
+  if (position >= pool_pnext(pool))
+    return 1;
+
+  size_t slot = pool_slot(pool, position);
+  return pool_word(pool, slot / 64) & 1ULL << (slot % 64) ? 1:0;
+}
+
+// First live slot at or after slot, or SIZE_MAX. Scans the bitmap a word
+// at a time, skipping 64 free slots per step.
+static inline size_t
+pool_scan (pool_t *pool, size_t slot)
+{
+  size_t limit = pool_pnext(pool);
+
+  if (sizeof(pool_header_t) + slot * pool->head->osize >= limit)
+    return SIZE_MAX;
+
+  size_t word = slot / 64;
+  uint64_t live = ~pool_word(pool, word) & (~0ULL << (slot % 64));
+
+  while (!live)
+  {
+    if (sizeof(pool_header_t) + ++word * 64 * pool->head->osize >= limit)
+      return SIZE_MAX;
+    live = ~pool_word(pool, word);
+  }
+
+  slot = word * 64 + __builtin_ctzll(live);
+  return sizeof(pool_header_t) + slot * pool->head->osize < limit ? slot: SIZE_MAX;
 }
 
 off_t
 pool_next (pool_t *pool, off_t position)
 {
-  position += position ? pool->head->osize: sizeof(pool_header_t);
+  size_t slot = pool_scan(pool, position ? pool_slot(pool, position) + 1: 0);
+  return slot == SIZE_MAX ? 0: sizeof(pool_header_t) + slot * pool->head->osize;
+}
+
+typedef struct { off_t index; pool_t *pool; size_t word; uint64_t live; size_t slot; int l1; } pool_each_t;
+
+// Walks one bitmap word at a time like pool_scan, but keeps the word
+// between records. Records freed during the loop are still skipped.
+static inline int
+pool_each_next (pool_each_t *loop)
+{
+  pool_t *pool = loop->pool;
+  loop->live &= ~pool_word(pool, loop->word);
+
+  while (!loop->live)
+  {
+    if (sizeof(pool_header_t) + ++loop->word * 64 * pool->head->osize >= pool_pnext(pool))
+      return 0;
+    loop->live = ~pool_word(pool, loop->word);
+  }
 
-  while (position < pool->head->psize && pool_is_free(pool, position))
-    position += pool->head->osize;
+  loop->slot = loop->word * 64 + __builtin_ctzll(loop->live);
+  loop->live &= loop->live - 1;
 
-  return (position < pool->head->psize) ? position: 0;
+  return sizeof(pool_header_t) + loop->slot * pool->head->osize < pool_pnext(pool);
 }
 
-typedef struct { off_t index; pool_t *pool; off_t pos; int l1; } pool_each_t;
-
 #define pool_each(l,_val_) for ( \
-  pool_each_t loop = { 0, (l), 0, 0 }; \
-    !loop.l1 && (loop.pos = pool_next(loop.pool, loop.pos)) && (loop.l1 = 1); \
+  pool_each_t loop = { 0, (l), 0, ~0ULL, 0, 0 }; \
+    !loop.l1 && pool_each_next(&loop) && (loop.l1 = 1); \
     loop.index++ \
   ) \
-    for (_val_ = pool_read(loop.pool, loop.pos, NULL); loop.l1; loop.l1 = !loop.l1)
+    for (_val_ = loop.pool->map + sizeof(pool_header_t) + loop.slot * loop.pool->head->osize; loop.l1; loop.l1 = !loop.l1)
 
 void*
 pool_read_chunk (pool_t *pool, off_t position, size_t bytes, void *ptr)
 {
-  ensure(position >= sizeof(pool_header_t) && position < pool->head->psize - bytes)
+  ensure(position >= sizeof(pool_header_t) && position < pool_psize(pool) - bytes)
     errorf("attempt to access outside pool: %lu %s", position, pool->name);
 
   if (ptr)
@@ -245,52 +1285,330 @@ pool_read_chunk (pool_t *pool, off_t position, size_t bytes, void *ptr)
 void
 pool_write_chunk (pool_t *pool, off_t position, size_t bytes, void *ptr)
 {
-  ensure(position >= sizeof(pool_header_t) && position < pool->head->psize - bytes)
+  ensure(position >= sizeof(pool_header_t) && position < pool_psize(pool) - bytes)
     errorf("attempt to access outside pool: %lu %s", position, pool->name);
 
   if (ptr && ptr != pool->map + position)
     memmove(pool->map + position, ptr, bytes);
+
+  if (pool->journal)
+    pool_log_write(pool, position, bytes);
 }
 
 off_t
 pool_alloc_chunk (pool_t *pool, size_t bytes)
 {
-  if (bytes <= pool->head->osize)
-    return pool_alloc(pool);
-
   size_t slots = (bytes / pool->head->osize) + (bytes % pool->head->osize ? 1:0);
+  return pool_alloc_slots(pool, max(slots, 1));
+}
 
-  for (off_t pos = pool->head->pfree; pos; pos = *((off_t*)(pool->map + pos)))
+void
+pool_free_chunk (pool_t *pool, off_t pos, size_t bytes)
+{
+  size_t slots = bytes / pool->head->osize + (bytes % pool->head->osize ? 1:0);
+  pool_free_slots(pool, pos, max(slots, 1));
+}
+
+// A per-thread cache of single slots. Refills reserve a run of slots under
+// the lock, free in the slot bitmap but in no block so nothing else hands
+// them out, and alloc and free then only flip bitmap bits. Flush before the
+// thread exits or the pool closes, or the reserved slots stay out of use.
+#define POOL_CACHE 64
+
+typedef struct _pool_cache_t {
+  pool_t *pool;
+  size_t count;
+  size_t slots[POOL_CACHE];
+} pool_cache_t;
+
+void
+pool_cache_init (pool_cache_t *cache, pool_t *pool)
+{
+  cache->pool = pool;
+  cache->count = 0;
+}
+
+off_t
+pool_cache_alloc (pool_cache_t *cache)
+{
+  pool_t *pool = cache->pool;
+
+  if (!cache->count)
+  {
+    size_t n = POOL_CACHE / 2;
+
+    pool_lock(pool);
+    off_t position = pool_alloc_run(pool, n);
+    pool_mark_range(pool, pool_slot(pool, position), n, 1);
+
+    if (pool->journal)
+      pool_log_free(pool, position, n);
+
+    pool_unlock(pool);
+
+    for (size_t i = 0; i < n; i++)
+      cache->slots[cache->count++] = pool_slot(pool, position) + n - 1 - i;
+  }
+
+  off_t position = sizeof(pool_header_t) + cache->slots[--cache->count] * pool->head->osize;
+
+  // the journal and its dirty pages are only changed under the lock
+  if (pool->journal)
+  {
+    pool_lock(pool);
+    pool_mark(pool, position, 0);
+    pool_log_alloc(pool, position, 1);
+    pool_unlock(pool);
+  }
+  else
+  {
+    pool_mark(pool, position, 0);
+  }
+  return position;
+}
+
+static void
+pool_cache_release (pool_cache_t *cache, size_t n)
+{
+  pool_t *pool = cache->pool;
+
+  pool_lock(pool);
+  pool_dirty(pool);
+
+  for (size_t i = 0; i < n; i++)
+    pool_release(pool, cache->slots[i], 0);
+
+  pool_unlock(pool);
+
+  memmove(cache->slots, cache->slots + n, (cache->count - n) * sizeof(size_t));
+  cache->count -= n;
+}
+
+void
+pool_cache_free (pool_cache_t *cache, off_t position)
+{
+  pool_t *pool = cache->pool;
+
+  ensure(position >= sizeof(pool_header_t) && position < pool_pnext(pool))
+    errorf("attempt to access outside pool: %lu %s", position, pool->name);
+
+  if (cache->count == POOL_CACHE)
+    pool_cache_release(cache, POOL_CACHE / 2);
+
+  if (pool->journal)
+  {
+    pool_lock(pool);
+    pool_mark(pool, position, 1);
+    pool_log_free(pool, position, 1);
+    pool_unlock(pool);
+  }
+  else
+  {
+    pool_mark(pool, position, 1);
+  }
+
+  cache->slots[cache->count++] = pool_slot(pool, position);
+}
+
+void
+pool_cache_flush (pool_cache_t *cache)
+{
+  pool_cache_release(cache, cache->count);
+}
+
+// number of live slots just below slot, up to n
+size_t
+pool_live_before (pool_t *pool, size_t slot, size_t n)
+{
+  size_t x = slot;
+
+  while (x > 0 && slot - x < n)
+  {
+    size_t bit = (x - 1) % 64;
+    uint64_t free = pool_word(pool, (x - 1) / 64) << (63 - bit);
+
+    if (free)
+      return min(slot - x + __builtin_clzll(free), n);
+
+    x -= bit + 1;
+  }
+  return min(slot - x, n);
+}
+
+// Give free space at the end of the file back. Slots held by caches keep
+// it in place.
+void
+pool_trim (pool_t *pool)
+{
+  size_t limit = pool_limit(pool);
+  size_t run = pool_run_before(pool, limit, limit);
+
+  if (!run || !pool_claimable(pool, limit - run, run))
+    return;
+
+  pool_dirty(pool);
+  pool_claim(pool, limit - run, run);
+  __atomic_store_n(&pool->head->pnext, pool->head->pnext - run * pool->head->osize, __ATOMIC_RELEASE);
+
+  // a journaled pool keeps its file size until it is reopened
+  if (pool->journal)
+    return;
+
+  size_t psize = max(pool->head->pnext, sizeof(pool_header_t) + pool->head->osize);
+
+  __atomic_store_n(&pool->head->psize, psize, __ATOMIC_RELEASE);
+
+  ensure(ftruncate(pool->fd, psize) == 0)
+    errorf("cannot truncate pool: %s", pool->name);
+}
+
+// Online compaction. Each step moves live records from the end of the
+// pool into the first holes that fit, under the lock and up to a budget
+// of slots, and reports every move so callers can update what refers to
+// the records. With unit set, records are unit slots each and runs of them
+// are split to fill holes exactly. Otherwise records may be chunks of any
+// size and each run of live slots moves whole. When nothing more fits the
+// free space at the end is trimmed.
+typedef void (*pool_compact_cb)(off_t from, off_t to, size_t bytes, void *payload);
+
+typedef struct _pool_compact_t {
+  pool_t *pool;
+  size_t unit;
+  size_t low;
+  size_t high;
+  size_t moved;
+  int done;
+  pool_compact_cb cb;
+  void *payload;
+} pool_compact_t;
+
+void
+pool_compact_init (pool_compact_t *compact, pool_t *pool, size_t unit, pool_compact_cb cb, void *payload)
+{
+  compact->pool = pool;
+  compact->unit = unit;
+  compact->low = 0;
+  compact->high = pool_limit(pool);
+  compact->moved = 0;
+  compact->done = 0;
+  compact->cb = cb;
+  compact->payload = payload;
+}
+
+// first free slot at or after slot, or limit
+static inline size_t
+pool_free_after (pool_t *pool, size_t slot, size_t limit)
+{
+  while (slot < limit)
+  {
+    uint64_t free = pool_word(pool, slot / 64) >> (slot % 64);
+
+    if (free)
+      return min(slot + __builtin_ctzll(free), limit);
+
+    slot = (slot / 64 + 1) * 64;
+  }
+  return limit;
+}
+
+// Move up to budget slots, returning 0 once compaction has finished
+int
+pool_compact_step (pool_compact_t *compact, size_t budget)
+{
+  pool_t *pool = compact->pool;
+  size_t unit = compact->unit, osize, work = 0;
+
+  if (compact->done)
+    return 0;
+
+  pool_lock(pool);
+  pool_dirty(pool);
+
+  osize = pool->head->osize;
+  compact->high = min(compact->high, pool_limit(pool));
+
+  while (work < budget && compact->high > compact->low)
   {
-    int found = 1;
-    for (int i = 0; found && i < slots; i++)
-      found = pool_is_free(pool, pos + (i * pool->head->osize));
+    size_t end = compact->high - pool_run_before(pool, compact->high, compact->high);
+    size_t start = end - pool_live_before(pool, end, end);
+    size_t n = end - start;
 
-    if (found)
+    if (!n)
     {
-      for (int i = 0; i < slots; i++)
-        pool->bitmap[(pos + (i * pool->head->osize)) / 8] &= ~(1 << ((pos + (i * pool->head->osize)) % 8));
-      return pos;
+      compact->high = 0;
+      break;
     }
-  }
 
-  off_t pfree = pool->head->pfree;
-  pool->head->pfree = 0;
+    if (unit)
+      n = min(n, max(unit, (budget - work) / unit * unit));
+
+    size_t slot = compact->low, target = SIZE_MAX;
+
+    while ((slot = pool_free_after(pool, slot, end - n)) < end - n)
+    {
+      size_t hole = pool_run_after(pool, slot, end - n - slot);
+      size_t fit = unit ? min(n, hole - hole % unit): hole >= n ? n: 0;
+
+      if (fit && pool_claimable(pool, slot, fit))
+      {
+        target = slot;
+        n = fit;
+        break;
+      }
+
+      // holes too small for one record are never used
+      if (unit && hole < unit && slot == compact->low)
+        compact->low = slot + hole;
+
+      slot += hole;
+    }
 
-  off_t pos = pool->head->pnext;
+    if (target == SIZE_MAX)
+    {
+      // nothing before this run has room for it
+      compact->high = unit ? 0: start;
+      continue;
+    }
+
+    off_t from = sizeof(pool_header_t) + (end - n) * osize;
+    off_t to = sizeof(pool_header_t) + target * osize;
+
+    pool_claim(pool, target, n);
+    memmove(pool->map + to, pool->map + from, n * osize);
+
+    pool_mark_range(pool, end - n, n, 1);
+    pool_release_range(pool, end - n, n);
+
+    if (pool->journal)
+    {
+      pool_log_alloc(pool, to, n);
+      pool_log_bytes(pool, to, n * osize);
+      pool_log_free(pool, from, n);
+    }
 
-  for (int i = 0; i < slots; i++)
-    pool_alloc(pool);
+    if (compact->cb)
+      compact->cb(from, to, n * osize, compact->payload);
 
-  pool->head->pfree = pfree;
-  return pos;
+    compact->high = end - n;
+    compact->moved += n;
+    work += n;
+  }
+
+  if (compact->high <= compact->low)
+  {
+    pool_trim(pool);
+    compact->done = 1;
+  }
+
+  pool_unlock(pool);
+  return !compact->done;
 }
 
 void
-pool_free_chunk (pool_t *pool, off_t pos, size_t bytes)
+pool_compact (pool_t *pool, size_t unit, pool_compact_cb cb, void *payload)
 {
-  size_t slots = bytes / pool->head->osize + (bytes % pool->head->osize ? 1:0);
+  pool_compact_t compact;
+  pool_compact_init(&compact, pool, unit, cb, payload);
 
-  for (int i = 0; i < slots; i++)
-    pool_free(pool, pos + (i * pool->head->osize));
-}
\ No newline at end of file
+  while (pool_compact_step(&compact, 1<<16));
+}
@@ -0,0 +1,740 @@
+// Journaled pools. pool_journal maps the pool and its side file privately,
+// so nothing reaches either file except through a checkpoint, and logs
+// each write, allocation and free to <name>.wal. pool_commit appends the
+// pending records and a checksummed commit record, then one fdatasync
+// covers every thread waiting on it. pool_checkpoint commits, renames the
+// log to <name>.wal.old, copies the pages changed since the last
+// checkpoint, and writes them back in the background when threads are
+// available. Recovery replays <name>.wal.old and <name>.wal up to the last
+// intact commit, so it is bounded by POOL_JOURNAL_LIMIT per log.
+//
+// Replay claims and frees only slots that are not already in the wanted
+// state, so a log replayed over a newer checkpoint, or over free space
+// rebuilt after a crash during one, ends in the same place.
+//
+// Changes made through pointers into the pool must be passed to
+// pool_write or pool_write_chunk before they are committed.
+
+#ifdef TOOLBELT_THREAD
+#include <pthread.h>
+#endif
+
+#define POOL_JOURNAL_LIMIT ((size_t)64<<20)
+
+#define POOL_LOG_WRITE 1
+#define POOL_LOG_ALLOC 2
+#define POOL_LOG_FREE 3
+#define POOL_LOG_COMMIT 4
+
+typedef struct _pool_record_t {
+  uint32_t type;
+  uint32_t length;
+  uint64_t position;
+  uint64_t n;
+} pool_record_t;
+
+typedef struct _pool_journal_t {
+  int fd;
+  int pfd;
+  int ffd;
+  char *path;
+  char *old;
+  unsigned char *buffer;
+  size_t bytes;
+  size_t limit;
+  uint64_t hash;
+  uint64_t written;
+  uint64_t synced;
+  uint64_t start;
+  uint64_t syncs;
+  int syncing;
+  size_t page;
+  size_t words;
+  uint64_t *dirty;
+  uint64_t *cold;
+  // checkpoint in progress
+  size_t psize;
+  size_t pcount;
+  size_t *ppages;
+  unsigned char *pdata;
+  size_t fsize;
+  size_t fcount;
+  size_t *fpages;
+  unsigned char *fdata;
+  int running;
+  int done;
+#ifdef TOOLBELT_THREAD
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+#endif
+} pool_journal_t;
+
+#ifdef TOOLBELT_THREAD
+#define pool_journal_lock(j) assert0(pthread_mutex_lock(&(j)->mutex))
+#define pool_journal_unlock(j) assert0(pthread_mutex_unlock(&(j)->mutex))
+#define pool_journal_wait(j) assert0(pthread_cond_wait(&(j)->cond, &(j)->mutex))
+#define pool_journal_wake(j) assert0(pthread_cond_broadcast(&(j)->cond))
+#else
+#define pool_journal_lock(j)
+#define pool_journal_unlock(j)
+#define pool_journal_wait(j)
+#define pool_journal_wake(j)
+#endif
+
+#define POOL_JOURNAL_SEED 14695981039346656037ULL
+
+static void
+pool_journal_append (pool_journal_t *journal, void *data, size_t bytes, int hash)
+{
+  if (journal->bytes + bytes > journal->limit)
+  {
+    journal->limit = max(journal->limit * 2, journal->bytes + bytes + 4096);
+    journal->buffer = reallocate(journal->buffer, journal->limit);
+  }
+
+  unsigned char *p = journal->buffer + journal->bytes;
+
+  if (data)
+    memmove(p, data, bytes);
+  else
+    memset(p, 0, bytes);
+
+  if (hash)
+    for (size_t i = 0; i < bytes; i++)
+      journal->hash = (journal->hash ^ p[i]) * 1099511628211ULL;
+
+  journal->bytes += bytes;
+}
+
+static void
+pool_journal_bit (uint64_t *bits, size_t i)
+{
+  bits[i / 64] |= 1ULL << (i % 64);
+}
+
+// pool pages changed since the last checkpoint
+void
+pool_journal_mark (pool_t *pool, off_t position, size_t bytes)
+{
+  pool_journal_t *journal = pool->journal;
+  size_t last = (position + max(bytes, 1) - 1) / journal->page;
+
+  if (last / 64 >= journal->words)
+  {
+    size_t words = max(journal->words * 2, last / 64 + 1);
+    journal->dirty = reallocate(journal->dirty, words * sizeof(uint64_t));
+    journal->cold = reallocate(journal->cold, words * sizeof(uint64_t));
+    memset(journal->dirty + journal->words, 0, (words - journal->words) * sizeof(uint64_t));
+    memset(journal->cold + journal->words, 0, (words - journal->words) * sizeof(uint64_t));
+    journal->words = words;
+  }
+
+  for (size_t page = position / journal->page; page <= last; page++)
+    pool_journal_bit(journal->dirty, page);
+}
+
+static void
+pool_log (pool_t *pool, int type, off_t position, size_t n, void *data, size_t length)
+{
+  pool_journal_t *journal = pool->journal;
+  pool_record_t record = { type, length, position, n };
+
+  pool_journal_lock(journal);
+  pool_journal_append(journal, &record, sizeof(record), 1);
+  pool_journal_append(journal, data, length, 1);
+  pool_journal_append(journal, NULL, (8 - length % 8) % 8, 1);
+  size_t size = journal->written + journal->bytes - journal->start;
+  pool_journal_unlock(journal);
+
+  if (size > POOL_JOURNAL_LIMIT && (!journal->running || __atomic_load_n(&journal->done, __ATOMIC_ACQUIRE)))
+    pool_journal_checkpoint(pool);
+}
+
+// log bytes written at position, lock held
+void
+pool_log_bytes (pool_t *pool, off_t position, size_t bytes)
+{
+  pool_journal_mark(pool, position, bytes);
+  pool_log(pool, POOL_LOG_WRITE, position, 0, pool->map + position, bytes);
+}
+
+void
+pool_log_write (pool_t *pool, off_t position, size_t bytes)
+{
+  pool_lock(pool);
+  pool_log_bytes(pool, position, bytes);
+  pool_unlock(pool);
+}
+
+void
+pool_log_alloc (pool_t *pool, off_t position, size_t n)
+{
+  pool_journal_mark(pool, position, n * pool->head->osize);
+  pool_log(pool, POOL_LOG_ALLOC, position, n, NULL, 0);
+}
+
+void
+pool_log_free (pool_t *pool, off_t position, size_t n)
+{
+  pool_log(pool, POOL_LOG_FREE, position, n, NULL, 0);
+}
+
+// Make everything logged so far durable. Callers that arrive while another
+// thread is syncing wait for it and share the next sync.
+void
+pool_commit (pool_t *pool)
+{
+  pool_journal_t *journal = pool->journal;
+
+  pool_journal_lock(journal);
+
+  if (journal->bytes)
+  {
+    pool_record_t record = { POOL_LOG_COMMIT, 0, 0, journal->hash };
+    pool_journal_append(journal, &record, sizeof(record), 0);
+
+    for (size_t done = 0; done < journal->bytes; )
+    {
+      ssize_t rc = write(journal->fd, journal->buffer + done, journal->bytes - done);
+
+      ensure(rc > 0)
+        errorf("cannot write pool journal: %s", journal->path);
+
+      done += rc;
+    }
+
+    journal->written += journal->bytes;
+    journal->bytes = 0;
+    journal->hash = POOL_JOURNAL_SEED;
+  }
+
+  uint64_t target = journal->written;
+
+  while (journal->synced < target)
+  {
+    if (journal->syncing)
+    {
+      pool_journal_wait(journal);
+      continue;
+    }
+
+    journal->syncing = 1;
+    uint64_t written = journal->written;
+    pool_journal_unlock(journal);
+
+    ensure(fdatasync(journal->fd) == 0)
+      errorf("cannot sync pool journal: %s", journal->path);
+
+    pool_journal_lock(journal);
+    journal->synced = max(journal->synced, written);
+    journal->syncing = 0;
+    journal->syncs++;
+    pool_journal_wake(journal);
+  }
+
+  pool_journal_unlock(journal);
+}
+
+static void
+pool_journal_dirsync (char *path)
+{
+  char dir[strlen(path) + 2];
+  strcpy(dir, path);
+
+  char *slash = strrchr(dir, '/');
+  strcpy(slash ? slash + 1: dir, ".");
+
+  int fd = open(dir, O_RDONLY);
+
+  ensure(fd >= 0 && fsync(fd) == 0 && close(fd) == 0)
+    errorf("cannot sync directory: %s", dir);
+}
+
+static void
+pool_journal_write (int fd, size_t *pages, size_t count, unsigned char *data, size_t page, size_t size, char *name)
+{
+  for (size_t i = 0, n; i < count; i += n)
+  {
+    for (n = 1; i + n < count && pages[i + n] == pages[i] + n; n++);
+
+    off_t offset = pages[i] * page;
+    size_t bytes = min(n * page, size - offset);
+
+    ensure(pwrite(fd, data + i * page, bytes, offset) == bytes)
+      errorf("cannot write pool checkpoint: %s", name);
+  }
+}
+
+// Write a checkpoint taken by pool_checkpoint. The side file is marked
+// dirty first, so a crash part way through is repaired on open and the
+// logs replayed over it.
+static void*
+pool_checkpoint_run (void *ptr)
+{
+  pool_journal_t *journal = ptr;
+  pool_free_header_t fhead;
+
+  memmove(&fhead, journal->fdata, sizeof(fhead));
+  fhead.clean = 0;
+  pool_boot(fhead.boot);
+  fhead.checksum = pool_free_checksum(&fhead);
+
+  ensure(pwrite(journal->ffd, &fhead, sizeof(fhead), 0) == sizeof(fhead) && fdatasync(journal->ffd) == 0)
+    errorf("cannot write pool checkpoint: %s", journal->path);
+
+  pool_journal_write(journal->pfd, journal->ppages, journal->pcount, journal->pdata, journal->page, journal->psize, journal->path);
+
+  ensure(fdatasync(journal->pfd) == 0 && ftruncate(journal->ffd, journal->fsize) == 0)
+    errorf("cannot write pool checkpoint: %s", journal->path);
+
+  pool_journal_write(journal->ffd, journal->fpages + 1, journal->fcount - 1, journal->fdata + POOL_FREE_HEADER, POOL_FREE_HEADER, journal->fsize, journal->path);
+  pool_journal_write(journal->ffd, journal->fpages, 1, journal->fdata, POOL_FREE_HEADER, journal->fsize, journal->path);
+
+  ensure(fdatasync(journal->ffd) == 0)
+    errorf("cannot write pool checkpoint: %s", journal->path);
+
+  unlink(journal->old);
+
+  free(journal->ppages);
+  free(journal->pdata);
+  free(journal->fpages);
+  free(journal->fdata);
+
+  __atomic_store_n(&journal->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+void
+pool_checkpoint_wait (pool_t *pool)
+{
+  pool_journal_t *journal = pool->journal;
+
+#ifdef TOOLBELT_THREAD
+  if (journal->running)
+    assert0(pthread_join(journal->thread, NULL));
+#endif
+
+  journal->running = 0;
+}
+
+// Pages written by the last checkpoint and unchanged since are mapped from
+// the file again, so the private copies do not accumulate
+static void
+pool_journal_cool (pool_t *pool)
+{
+  pool_journal_t *journal = pool->journal;
+
+  // the header page changes without being marked
+  journal->cold[0] &= ~1ULL;
+
+  for (size_t page = 0; page < journal->words * 64; )
+  {
+    uint64_t bits = journal->cold[page / 64] & ~journal->dirty[page / 64];
+
+    if (!(bits >> (page % 64)))
+    {
+      page = (page / 64 + 1) * 64;
+      continue;
+    }
+
+    size_t start = page + __builtin_ctzll(bits >> (page % 64));
+
+    for (page = start + 1; page < journal->words * 64
+      && journal->cold[page / 64] >> (page % 64) & 1 && !(journal->dirty[page / 64] >> (page % 64) & 1); page++);
+
+    off_t offset = start * journal->page;
+
+    ensure(mmap(pool->map + offset, (page - start) * journal->page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, pool->fd, offset) == pool->map + offset)
+      errorf("cannot mmap pool: %s", pool->name);
+  }
+
+  memset(journal->cold, 0, journal->words * sizeof(uint64_t));
+}
+
+// Switch to a fresh log once everything in the current one is durable
+static void
+pool_journal_rotate (pool_t *pool)
+{
+  pool_journal_t *journal = pool->journal;
+
+  pool_commit(pool);
+  pool_journal_lock(journal);
+
+  while (journal->syncing)
+    pool_journal_wait(journal);
+
+  ensure(rename(journal->path, journal->old) == 0)
+    errorf("cannot rotate pool journal: %s", journal->path);
+
+  int fd = open(journal->path, O_CREAT|O_TRUNC|O_WRONLY|O_APPEND, S_IRUSR|S_IWUSR);
+
+  ensure(fd >= 0)
+    errorf("cannot create pool journal: %s", journal->path);
+
+  pool_journal_dirsync(journal->path);
+
+  close(journal->fd);
+  journal->fd = fd;
+  journal->start = journal->written;
+
+  pool_journal_unlock(journal);
+}
+
+static size_t*
+pool_journal_pages (uint64_t *bits, size_t limit, size_t *count)
+{
+  size_t *pages = allocate(sizeof(size_t) * (limit + 1));
+  size_t n = 0;
+
+  pages[n++] = 0;
+
+  for (size_t page = 1; page < limit; page++)
+    if (bits[page / 64] >> (page % 64) & 1)
+      pages[n++] = page;
+
+  *count = n;
+  return pages;
+}
+
+static unsigned char*
+pool_journal_copy (void *map, size_t *pages, size_t count, size_t page, size_t size)
+{
+  unsigned char *data = allocate(count * page);
+
+  for (size_t i = 0; i < count; i++)
+    memmove(data + i * page, map + pages[i] * page, min(page, size - pages[i] * page));
+
+  return data;
+}
+
+// Start a checkpoint of everything committed so far. The changed pages are
+// copied here and written by a background thread when TOOLBELT_THREAD is
+// defined, otherwise before returning.
+void
+pool_journal_checkpoint (pool_t *pool)
+{
+  pool_journal_t *journal = pool->journal;
+
+  pool_checkpoint_wait(pool);
+  pool_journal_cool(pool);
+  pool_journal_rotate(pool);
+
+  pool->fhead->psize = pool->head->psize;
+  pool->fhead->pnext = pool->head->pnext;
+  pool->fhead->clean = 1;
+  pool->fhead->checksum = pool_free_checksum(pool->fhead);
+
+  size_t psize = pool->head->psize;
+  size_t plimit = min(journal->words * 64, (psize + journal->page - 1) / journal->page);
+  size_t flimit = (pool->fsize + POOL_FREE_HEADER - 1) / POOL_FREE_HEADER;
+
+  journal->psize = psize;
+  journal->ppages = pool_journal_pages(journal->dirty, plimit, &journal->pcount);
+  journal->pdata = pool_journal_copy(pool->map, journal->ppages, journal->pcount, journal->page, psize);
+
+  journal->fsize = pool->fsize;
+  journal->fpages = pool_journal_pages(pool->fdirty, flimit, &journal->fcount);
+  journal->fdata = pool_journal_copy(pool->fmap, journal->fpages, journal->fcount, POOL_FREE_HEADER, pool->fsize);
+
+  for (size_t i = 0; i < journal->pcount; i++)
+    pool_journal_bit(journal->cold, journal->ppages[i]);
+
+  memset(journal->dirty, 0, journal->words * sizeof(uint64_t));
+  memset(pool->fdirty, 0, (flimit / 64 + 1) * sizeof(uint64_t));
+
+  journal->done = 0;
+  journal->running = 1;
+
+#ifdef TOOLBELT_THREAD
+  assert0(pthread_create(&journal->thread, NULL, pool_checkpoint_run, journal));
+#else
+  pool_checkpoint_run(journal);
+#endif
+}
+
+// Move a pool that outgrew its reservation. Only the header and pages
+// changed since the file was last written need copying.
+void
+pool_journal_move (pool_t *pool, size_t bytes)
+{
+  pool_journal_t *journal = pool->journal;
+  void *map = pool->map;
+  size_t reserve = pool->reserve;
+  size_t limit = min(journal->words * 64, (pool->head->psize + journal->page - 1) / journal->page);
+  size_t psize = pool->head->psize;
+
+  pool->map = NULL;
+  pool_map(pool, bytes);
+
+  for (size_t page = 0; page < limit; page++)
+  {
+    if (!page || (journal->dirty[page / 64] | journal->cold[page / 64]) >> (page % 64) & 1)
+      memmove(pool->map + page * journal->page, map + page * journal->page, min(journal->page, psize - page * journal->page));
+  }
+
+  ensure(munmap(map, reserve) == 0)
+    errorf("cannot unmap pool: %s", pool->name);
+}
+
+void
+pool_checkpoint (pool_t *pool)
+{
+  pool_lock(pool);
+  pool_journal_checkpoint(pool);
+  pool_unlock(pool);
+}
+
+// allocate slots that are still free, extending the used space if needed
+static void
+pool_journal_claim (pool_t *pool, off_t position, size_t n)
+{
+  size_t slot = pool_slot(pool, position);
+  size_t limit = pool_limit(pool);
+  size_t end = slot + n;
+
+  if (end > limit)
+  {
+    off_t pnext = sizeof(pool_header_t) + end * pool->head->osize;
+
+    if (pnext > pool->head->psize)
+      pool_grow(pool, max(pool->head->pstep * pool->head->osize, pnext - pool->head->psize));
+
+    pool_journal_mark(pool, pool->head->pnext, pnext - pool->head->pnext);
+    memset(pool->map + pool->head->pnext, 0, pnext - pool->head->pnext);
+    __atomic_store_n(&pool->head->pnext, pnext, __ATOMIC_RELEASE);
+    end = limit;
+  }
+
+  for (size_t x = slot; x < end; )
+  {
+    size_t run = pool_run_after(pool, x, end - x);
+
+    if (run)
+      pool_claim(pool, x, run);
+
+    x += run ? run: 1;
+  }
+}
+
+// free slots that are still allocated
+static void
+pool_journal_release (pool_t *pool, off_t position, size_t n)
+{
+  size_t slot = pool_slot(pool, position);
+  size_t end = min(slot + n, pool_limit(pool));
+
+  for (size_t x = slot; x < end; )
+  {
+    size_t run = 0;
+
+    while (x + run < end && !(pool_word(pool, (x + run) / 64) >> ((x + run) % 64) & 1))
+      run++;
+
+    if (run)
+    {
+      pool_mark_range(pool, x, run, 1);
+      pool_release_range(pool, x, run);
+    }
+
+    x += run + pool_run_after(pool, x + run, end - x - run);
+  }
+}
+
+// Apply the records in each intact commit group, returning the length of
+// the log up to the last of them
+static size_t
+pool_journal_replay (pool_t *pool, unsigned char *data, size_t size)
+{
+  size_t offset = 0, group = 0, valid = 0;
+  uint64_t hash = POOL_JOURNAL_SEED;
+
+  while (offset + sizeof(pool_record_t) <= size)
+  {
+    pool_record_t *record = (pool_record_t*)(data + offset);
+    size_t bytes = sizeof(pool_record_t) + record->length + (8 - record->length % 8) % 8;
+
+    if (offset + bytes > size)
+      break;
+
+    if (record->type == POOL_LOG_COMMIT)
+    {
+      if (record->n != hash)
+        break;
+
+      for (size_t at = group; at < offset; )
+      {
+        pool_record_t *r = (pool_record_t*)(data + at);
+
+        ensure(r->position >= sizeof(pool_header_t) && (r->type != POOL_LOG_WRITE || r->position + r->length <= pool->head->pnext))
+          errorf("pool journal corrupt: %s", pool->journal->path);
+
+        if (r->type == POOL_LOG_WRITE)
+        {
+          memmove(pool->map + r->position, data + at + sizeof(pool_record_t), r->length);
+          pool_journal_mark(pool, r->position, r->length);
+        }
+        if (r->type == POOL_LOG_ALLOC)
+          pool_journal_claim(pool, r->position, r->n);
+
+        if (r->type == POOL_LOG_FREE)
+          pool_journal_release(pool, r->position, r->n);
+
+        at += sizeof(pool_record_t) + r->length + (8 - r->length % 8) % 8;
+      }
+
+      offset += bytes;
+      group = valid = offset;
+      hash = POOL_JOURNAL_SEED;
+      continue;
+    }
+
+    for (size_t i = 0; i < bytes; i++)
+      hash = (hash ^ data[offset + i]) * 1099511628211ULL;
+
+    offset += bytes;
+  }
+  return valid;
+}
+
+static size_t
+pool_journal_read (char *path, unsigned char **data)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+
+  *data = NULL;
+
+  if (fd < 0)
+    return 0;
+
+  ensure(fstat(fd, &st) == 0)
+    errorf("cannot read pool journal: %s", path);
+
+  *data = allocate(st.st_size + 1);
+
+  ensure(pread(fd, *data, st.st_size, 0) == st.st_size)
+    errorf("cannot read pool journal: %s", path);
+
+  close(fd);
+  return st.st_size;
+}
+
+// Switch an open pool to journaled mode, recovering from its logs. Record
+// pointers taken before the call stay valid.
+void
+pool_journal (pool_t *pool)
+{
+  ensure(flock(pool->ffd, LOCK_EX|LOCK_NB) == 0)
+    errorf("journaled pool in use by another process: %s", pool->name);
+
+  pool_sync(pool);
+
+  pool_journal_t *journal = allocate(sizeof(pool_journal_t));
+  memset(journal, 0, sizeof(pool_journal_t));
+
+  journal->path = allocate(strlen(pool->name) + 5);
+  sprintf(journal->path, "%s.wal", pool->name);
+  journal->old = allocate(strlen(pool->name) + 9);
+  sprintf(journal->old, "%s.wal.old", pool->name);
+
+  journal->pfd = pool->fd;
+  journal->ffd = pool->ffd;
+  journal->hash = POOL_JOURNAL_SEED;
+  journal->page = sysconf(_SC_PAGESIZE);
+
+#ifdef TOOLBELT_THREAD
+  assert0(pthread_mutex_init(&journal->mutex, NULL));
+  assert0(pthread_cond_init(&journal->cond, NULL));
+#endif
+
+  ensure(mmap(pool->map, pool->head->psize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, pool->fd, 0) == pool->map
+    && mmap(pool->fmap, pool->fsize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, pool->ffd, 0) == pool->fmap)
+      errorf("cannot mmap pool: %s", pool->name);
+
+  pool->mflags = MAP_PRIVATE;
+  pool->journal = journal;
+
+  size_t words = pool->fsize / POOL_FREE_HEADER / 64 + 1;
+  pool->fdirty = allocate(words * sizeof(uint64_t));
+  memset(pool->fdirty, 0, words * sizeof(uint64_t));
+
+  pool_journal_mark(pool, 0, pool->head->psize);
+  memset(journal->dirty, 0, journal->words * sizeof(uint64_t));
+
+  unsigned char *old = NULL, *data = NULL;
+  size_t osize = pool_journal_read(journal->old, &old);
+  size_t size = pool_journal_read(journal->path, &data);
+
+  // a checkpoint was interrupted; its log comes first
+  if (old)
+  {
+    old = reallocate(old, osize + size + 1);
+    memmove(old + osize, data, size);
+    free(data);
+    data = old;
+    size += osize;
+
+    int fd = open(journal->old, O_WRONLY|O_APPEND);
+
+    ensure(fd >= 0 && write(fd, data + osize, size - osize) == size - osize && fsync(fd) == 0 && close(fd) == 0
+      && rename(journal->old, journal->path) == 0)
+        errorf("cannot recover pool journal: %s", journal->path);
+
+    pool_journal_dirsync(journal->path);
+  }
+
+  journal->fd = open(journal->path, O_CREAT|O_WRONLY|O_APPEND, S_IRUSR|S_IWUSR);
+
+  ensure(journal->fd >= 0)
+    errorf("cannot open pool journal: %s", journal->path);
+
+  if (size)
+  {
+    size_t valid = pool_journal_replay(pool, data, size);
+
+    ensure(ftruncate(journal->fd, valid) == 0)
+      errorf("cannot recover pool journal: %s", journal->path);
+
+    journal->written = journal->synced = valid;
+
+    pool_journal_checkpoint(pool);
+    pool_checkpoint_wait(pool);
+  }
+
+  free(data);
+}
+
+uint64_t
+pool_journal_syncs (pool_t *pool)
+{
+  return pool->journal->syncs;
+}
+
+void
+pool_journal_close (pool_t *pool)
+{
+  pool_journal_t *journal = pool->journal;
+
+  pool_checkpoint_wait(pool);
+
+  ensure(close(journal->fd) == 0)
+    errorf("cannot close pool journal: %s", journal->path);
+
+#ifdef TOOLBELT_THREAD
+  pthread_mutex_destroy(&journal->mutex);
+  pthread_cond_destroy(&journal->cond);
+#endif
+
+  free(journal->path);
+  free(journal->old);
+  free(journal->buffer);
+  free(journal->dirty);
+  free(journal->cold);
+  free(journal);
+  free(pool->fdirty);
+
+  pool->fdirty = NULL;
+  pool->journal = NULL;
+  pool->mflags = MAP_SHARED;
+}
@@ -0,0 +1,363 @@
+#ifdef TOOLBELT_THREAD
+
+#include <pthread.h>
+
+pthread_mutex_t regex_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define regex_cache_lock() assert0(pthread_mutex_lock(&regex_cache_mutex))
+#define regex_cache_unlock() assert0(pthread_mutex_unlock(&regex_cache_mutex))
+
+#else
+
+#define regex_cache_lock()
+#define regex_cache_unlock()
+
+#endif
+
+typedef struct _regex_entry_t {
+  char *key;
+  regex_t regex;
+  char *literal;
+  size_t length;
+  struct _regex_entry_t *newer;
+  struct _regex_entry_t *older;
+  int refs;
+  int evicted;
+} regex_entry_t;
+
+typedef struct _regex_match_t {
+  char *subject;
+  regmatch_t *groups;
+  size_t count;
+  size_t limit;
+} regex_match_t;
+
+map_t *regex_cache = NULL;
+size_t regex_cache_size = 64;
+
+// cached entries from most to least recently used
+regex_entry_t *regex_cache_newest = NULL;
+regex_entry_t *regex_cache_oldest = NULL;
+
+// Longest run of literal characters that any match must contain, or NULL.
+// Conservative: gives up on alternation and ignores anything inside groups,
+// bracket expressions, or followed by a quantifier.
+char*
+regex_literal (char *pattern, int flags)
+{
+  int extended = flags & REG_EXTENDED;
+
+  if (flags & REG_ICASE)
+    return NULL;
+
+  if (strstr(pattern, extended ? "|": "\\|"))
+    return NULL;
+
+  size_t bytes = strlen(pattern);
+  char *run = allocate(bytes + 1);
+  char *best = allocate(bytes + 1);
+  size_t rlen = 0, blen = 0;
+  int depth = 0;
+
+  for (char *p = pattern; *p; p++)
+  {
+    int c = *p, literal = 0, brace = 0;
+
+    if (c == '\\' && p[1])
+    {
+      c = *++p;
+      if (!extended && (c == '(' || c == ')'))
+        depth += c == '(' ? 1: -1;
+      else
+      if (!extended && c == '{')
+        brace = 1;
+      else
+        literal = !isalnum(c) && !strchr("<>`'+?}|", c);
+    }
+    else
+    if (c == '[')
+    {
+      p++;
+      if (*p == '^') p++;
+      if (*p == ']') p++;
+
+      for (; *p && *p != ']'; p++)
+      {
+        if (*p == '[' && p[1] && strchr(":.=", p[1]))
+        {
+          char close[3] = { p[1], ']', 0 };
+          char *e = strstr(p+2, close);
+          if (e) p = e+1;
+        }
+      }
+      if (!*p) p--;
+    }
+    else
+    if (extended && (c == '(' || c == ')'))
+      depth += c == '(' ? 1: -1;
+    else
+    if (extended && c == '{')
+      brace = 1;
+    else
+      literal = !strchr(".^$*", c) && !(extended && strchr("+?", c));
+
+    if (brace)
+    {
+      char *e = strstr(p, extended ? "}": "\\}");
+      p = e ? e + strlen(extended ? "}": "\\}") - 1: p + strlen(p) - 1;
+    }
+
+    if (literal && depth <= 0)
+    {
+      int quantified = p[1] == '*'
+        || (extended && p[1] && strchr("+?{", p[1]))
+        || (!extended && p[1] == '\\' && p[2] && strchr("{+?", p[2]));
+
+      if (!quantified)
+      {
+        run[rlen++] = c;
+        continue;
+      }
+    }
+
+    if (rlen > blen)
+    {
+      memmove(best, run, rlen);
+      blen = rlen;
+    }
+    rlen = 0;
+  }
+
+  if (rlen > blen)
+  {
+    memmove(best, run, rlen);
+    blen = rlen;
+  }
+
+  free(run);
+  best[blen] = 0;
+
+  if (!blen)
+  {
+    free(best);
+    best = NULL;
+  }
+  return best;
+}
+
+void
+regex_entry_free (regex_entry_t *entry)
+{
+  regfree(&entry->regex);
+  free(entry->literal);
+  free(entry->key);
+  free(entry);
+}
+
+static inline void
+regex_unlink (regex_entry_t *entry)
+{
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    regex_cache_newest = entry->older;
+
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    regex_cache_oldest = entry->newer;
+
+  entry->newer = NULL;
+  entry->older = NULL;
+}
+
+static inline void
+regex_link (regex_entry_t *entry)
+{
+  entry->older = regex_cache_newest;
+
+  if (regex_cache_newest)
+    regex_cache_newest->newer = entry;
+  else
+    regex_cache_oldest = entry;
+
+  regex_cache_newest = entry;
+}
+
+void
+regex_evict (size_t limit)
+{
+  while (regex_cache && map_count(regex_cache) > limit)
+  {
+    regex_entry_t *oldest = regex_cache_oldest;
+
+    regex_unlink(oldest);
+    map_del(regex_cache, oldest->key);
+    oldest->evicted = 1;
+
+    if (!oldest->refs)
+      regex_entry_free(oldest);
+  }
+}
+
+// Compiled pattern from the cache, compiling it on a miss. NULL if the
+// pattern is invalid. Pair each call with regex_put.
+regex_entry_t*
+regex_get (char *pattern, int flags)
+{
+  char *key = strf("%d:%s", flags, pattern);
+
+  regex_cache_lock();
+
+  if (!regex_cache)
+    regex_cache = map_new();
+
+  regex_entry_t *entry = map_get(regex_cache, key);
+
+  if (entry)
+  {
+    free(key);
+    regex_unlink(entry);
+  }
+  else
+  {
+    entry = allocate(sizeof(regex_entry_t));
+    memset(entry, 0, sizeof(regex_entry_t));
+
+    if (regcomp(&entry->regex, pattern, flags) != 0)
+    {
+      regex_cache_unlock();
+      free(entry);
+      free(key);
+      return NULL;
+    }
+
+    entry->key = key;
+    entry->literal = regex_literal(pattern, flags);
+    entry->length = entry->literal ? strlen(entry->literal): 0;
+
+    map_set(regex_cache, entry->key, entry);
+  }
+
+  regex_link(entry);
+  entry->refs++;
+
+  regex_evict(regex_cache_size);
+
+  regex_cache_unlock();
+  return entry;
+}
+
+void
+regex_put (regex_entry_t *entry)
+{
+  regex_cache_lock();
+
+  if (!--entry->refs && entry->evicted)
+    regex_entry_free(entry);
+
+  regex_cache_unlock();
+}
+
+void
+regex_cache_limit (size_t limit)
+{
+  regex_cache_lock();
+  regex_cache_size = max(limit, 1);
+  regex_evict(regex_cache_size);
+  regex_cache_unlock();
+}
+
+void
+regex_cache_clear ()
+{
+  regex_cache_lock();
+  regex_evict(0);
+  map_free(regex_cache);
+  regex_cache = NULL;
+  regex_cache_unlock();
+}
+
+void
+regex_match_init (regex_match_t *match)
+{
+  memset(match, 0, sizeof(regex_match_t));
+}
+
+void
+regex_match_clear (regex_match_t *match)
+{
+  free(match->groups);
+  regex_match_init(match);
+}
+
+int
+regex_exec_length (regex_entry_t *entry, char *subject, size_t length, regex_match_t *match)
+{
+  if (match)
+    match->count = 0;
+
+  if (entry->literal && !memmem(subject, length, entry->literal, entry->length))
+    return 0;
+
+  if (!match)
+    return regexec(&entry->regex, subject, 0, NULL, 0) == 0;
+
+  size_t count = entry->regex.re_nsub + 1;
+
+  if (match->limit < count)
+  {
+    match->groups = reallocate(match->groups, count * sizeof(regmatch_t));
+    match->limit = count;
+  }
+
+  match->subject = subject;
+  match->count = regexec(&entry->regex, subject, count, match->groups, 0) == 0 ? count: 0;
+
+  return match->count > 0;
+}
+
+int
+regex_exec (regex_entry_t *entry, char *subject, regex_match_t *match)
+{
+  return regex_exec_length(entry, subject, strlen(subject), match);
+}
+
+int
+regex_match (char *pattern, int flags, char *subject, regex_match_t *match)
+{
+  regex_entry_t *entry = regex_get(pattern, flags);
+
+  if (!entry)
+    return 0;
+
+  int rc = regex_exec(entry, subject, match);
+  regex_put(entry);
+  return rc;
+}
+
+// Copy of capture group n from the last successful match, or NULL
+char*
+regex_group (regex_match_t *match, size_t n)
+{
+  if (n >= match->count || match->groups[n].rm_so < 0)
+    return NULL;
+
+  return str_copy(match->subject + match->groups[n].rm_so, match->groups[n].rm_eo - match->groups[n].rm_so);
+}
+
+int
+text_regex (text_t *text, char *pattern, int flags, regex_match_t *match)
+{
+  if (!text->buffer)
+    return 0;
+
+  regex_entry_t *entry = regex_get(pattern, flags);
+
+  if (!entry)
+    return 0;
+
+  int rc = regex_exec_length(entry, text_pack(text) + text->cursor, text->bytes - text->cursor - 1, match);
+  regex_put(entry);
+  return rc;
+}
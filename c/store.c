@@ -0,0 +1,589 @@
+// Variable length records in slotted pool pages. Each page is one pool
+// slot holding a header and a directory of (offset, length) entries that
+// grows up from the bottom, and record data that grows down from the top.
+// A record id is the page slot and directory index, and never changes:
+// deleting a record leaves a hole that is squeezed out when the page next
+// needs room, and a record that outgrows its page is forwarded to another
+// page behind a stub.
+//
+// Records larger than a quarter page, or 4KB, live in a chain of overflow
+// pages. Pages with room after a delete are remembered so inserts reuse
+// them, and a page left empty goes back to the pool.
+//
+// The store is not locked; use the pool for syncing, journaling and
+// commits.
+
+#define STORE_PAGE 0x45474150
+#define STORE_OVERFLOW 0x574f4c46
+#define STORE_INDIRECT 0x8000
+#define STORE_FORWARD 0x4000
+#define STORE_MOVED 0x2000
+#define STORE_LENGTH 0x1fff
+
+typedef struct _store_page_t {
+  uint32_t kind;
+  uint16_t count;
+  uint16_t live;
+  uint16_t upper;
+  uint16_t garbage;
+  uint16_t used;
+  uint64_t next;
+} store_page_t;
+
+typedef struct _store_slot_t {
+  uint16_t offset;
+  uint16_t length;
+} store_slot_t;
+
+typedef struct _store_stub_t {
+  uint64_t length;
+  uint64_t first;
+} store_stub_t;
+
+typedef struct _store_record_t {
+  uint64_t id;
+  size_t length;
+  void *data;
+} store_record_t;
+
+typedef struct _store_t {
+  pool_t pool;
+  size_t page;
+  size_t inline_max;
+  off_t current;
+  off_t *listed;
+  size_t nlisted;
+  size_t limit;
+  uint64_t *marks;
+  size_t nmarks;
+  byte_t *buffer;
+  size_t bsize;
+  byte_t *scratch;
+} store_t;
+
+#define store_slots(page) ((store_slot_t*)((page) + 1))
+// record data is kept 8 byte aligned
+#define store_space(length) max((size_t)(((length) & STORE_LENGTH) + 7) & ~7UL, sizeof(store_stub_t))
+#define store_gap(page) ((page)->upper - sizeof(store_page_t) - (page)->count * sizeof(store_slot_t))
+#define store_room(page) (store_gap(page) + (page)->garbage)
+#define store_position(store,id) (sizeof(pool_header_t) + ((id) >> 16) * (store)->page)
+#define store_id(store,position,index) ((uint64_t)pool_slot(&(store)->pool, (position)) << 16 | (index))
+
+static inline store_page_t*
+store_page (store_t *store, off_t position)
+{
+  return store->pool.map + position;
+}
+
+static inline void
+store_log (store_t *store, off_t position, size_t offset, size_t bytes)
+{
+  if (store->pool.journal)
+    pool_log_write(&store->pool, position + offset, bytes);
+}
+
+static inline int
+store_valid (store_t *store, off_t position, uint32_t kind)
+{
+  return position >= sizeof(pool_header_t) && position < store->pool.head->pnext
+    && !pool_is_free(&store->pool, position) && store_page(store, position)->kind == kind;
+}
+
+// Pages on the listed stack are marked in memory, one bit per page slot
+static inline int
+store_marked (store_t *store, off_t position)
+{
+  size_t slot = pool_slot(&store->pool, position);
+  return slot / 64 < store->nmarks && store->marks[slot / 64] & 1ULL << (slot % 64);
+}
+
+static inline void
+store_mark (store_t *store, off_t position, int mark)
+{
+  size_t slot = pool_slot(&store->pool, position);
+
+  if (slot / 64 >= store->nmarks)
+  {
+    size_t nmarks = max(slot / 64 + 1, store->nmarks * 2);
+    store->marks = reallocate(store->marks, nmarks * sizeof(uint64_t));
+    memset(store->marks + store->nmarks, 0, (nmarks - store->nmarks) * sizeof(uint64_t));
+    store->nmarks = nmarks;
+  }
+
+  if (mark)
+    store->marks[slot / 64] |= 1ULL << (slot % 64);
+  else
+    store->marks[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+void
+store_list (store_t *store, off_t position)
+{
+  store_page_t *page = store_page(store, position);
+
+  if (store_marked(store, position) || store_room(page) < store->page / 4)
+    return;
+
+  if (store->nlisted == store->limit)
+  {
+    store->limit = store->limit ? store->limit * 2: 64;
+    store->listed = reallocate(store->listed, store->limit * sizeof(off_t));
+  }
+
+  store_mark(store, position, 1);
+  store->listed[store->nlisted++] = position;
+}
+
+// EXIT_FAILURE if the store is already open, see pool_open
+int
+store_open (store_t *store, char *name, size_t psize)
+{
+  psize = psize ? psize: 4096;
+
+  ensure(psize >= 256 && psize <= 32768)
+    errorf("store page size out of range: %lu %s", psize, name);
+
+  if (pool_open(&store->pool, name, psize, 256) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  store->page = psize;
+  store->inline_max = min(psize / 4, (size_t)4096);
+  store->current = 0;
+  store->listed = NULL;
+  store->nlisted = 0;
+  store->limit = 0;
+  store->marks = NULL;
+  store->nmarks = 0;
+  store->buffer = NULL;
+  store->bsize = 0;
+  store->scratch = allocate(psize);
+
+  pool_each(&store->pool, store_page_t *page)
+  {
+    if (page->kind != STORE_PAGE)
+      continue;
+
+    store_list(store, (byte_t*)page - (byte_t*)store->pool.map);
+  }
+  return EXIT_SUCCESS;
+}
+
+void
+store_close (store_t *store)
+{
+  pool_close(&store->pool);
+  free(store->listed);
+  free(store->marks);
+  free(store->buffer);
+  free(store->scratch);
+}
+
+// Squeeze holes out of the record data
+void
+store_compact_page (store_t *store, off_t position)
+{
+  store_page_t *page = store_page(store, position);
+  store_slot_t *slots = store_slots(page);
+  size_t upper = store->page;
+
+  for (size_t i = 0; i < page->count; i++)
+  {
+    if (!slots[i].offset)
+      continue;
+
+    size_t space = store_space(slots[i].length);
+    upper -= space;
+    memmove(store->scratch + upper, (byte_t*)page + slots[i].offset, space);
+    slots[i].offset = upper;
+  }
+
+  memmove((byte_t*)page + upper, store->scratch + upper, store->page - upper);
+  page->upper = upper;
+  page->garbage = 0;
+
+  store_log(store, position, 0, store->page);
+}
+
+// Write data to a new overflow chain, returning its first page
+off_t
+store_chain (store_t *store, void *data, size_t length)
+{
+  size_t payload = store->page - sizeof(store_page_t);
+  off_t first = 0, prev = 0;
+
+  for (size_t done = 0; done < length; )
+  {
+    size_t bytes = min(payload, length - done);
+    off_t position = pool_alloc(&store->pool);
+    store_page_t *page = store_page(store, position);
+
+    memset(page, 0, sizeof(store_page_t));
+    page->kind = STORE_OVERFLOW;
+    page->used = bytes;
+    memmove(page + 1, (byte_t*)data + done, bytes);
+    store_log(store, position, 0, sizeof(store_page_t) + bytes);
+
+    if (prev)
+    {
+      store_page(store, prev)->next = position;
+      store_log(store, prev, 0, sizeof(store_page_t));
+    }
+
+    first = first ? first: position;
+    prev = position;
+    done += bytes;
+  }
+  return first;
+}
+
+void
+store_unchain (store_t *store, off_t position)
+{
+  while (position)
+  {
+    ensure(store_valid(store, position, STORE_OVERFLOW))
+      errorf("store overflow chain corrupt: %lu %s", position, store->pool.name);
+
+    off_t next = store_page(store, position)->next;
+    pool_free(&store->pool, position);
+    position = next;
+  }
+}
+
+// Page with room for a record of space bytes and a directory entry
+off_t
+store_find (store_t *store, size_t space)
+{
+  size_t need = space + sizeof(store_slot_t);
+
+  if (store->current && store_valid(store, store->current, STORE_PAGE) && store_room(store_page(store, store->current)) >= need)
+    return store->current;
+
+  while (store->nlisted)
+  {
+    off_t position = store->listed[--store->nlisted];
+    store_mark(store, position, 0);
+
+    if (!store_valid(store, position, STORE_PAGE))
+      continue;
+
+    store_page_t *page = store_page(store, position);
+
+    if (store_room(page) >= need)
+      return (store->current = position);
+  }
+
+  off_t position = pool_alloc(&store->pool);
+  store_page_t *page = store_page(store, position);
+
+  memset(page, 0, sizeof(store_page_t));
+  page->kind = STORE_PAGE;
+  page->upper = store->page;
+
+  return (store->current = position);
+}
+
+// Take space bytes of record data from a page known to have room
+static inline size_t
+store_take (store_t *store, off_t position, size_t space)
+{
+  store_page_t *page = store_page(store, position);
+
+  if (store_gap(page) < space)
+    store_compact_page(store, position);
+
+  page->upper -= space;
+  return page->upper;
+}
+
+static inline store_slot_t*
+store_entry (store_t *store, uint64_t id)
+{
+  off_t position = store_position(store, id);
+
+  if (!store_valid(store, position, STORE_PAGE))
+    return NULL;
+
+  store_page_t *page = store_page(store, position);
+  size_t index = id & 0xffff;
+
+  return index < page->count && store_slots(page)[index].offset ? &store_slots(page)[index]: NULL;
+}
+
+// Directory entry for id, or NULL
+store_slot_t*
+store_slot (store_t *store, uint64_t id)
+{
+  store_slot_t *slot = store_entry(store, id);
+  return slot && !(slot->length & STORE_MOVED) ? slot: NULL;
+}
+
+static inline store_stub_t*
+store_stub (store_t *store, uint64_t id, store_slot_t *slot)
+{
+  return (void*)((byte_t*)store_page(store, store_position(store, id)) + slot->offset);
+}
+
+// Write a stub into a directory entry that has no data
+static void
+store_put_stub (store_t *store, off_t position, size_t index, uint16_t flag, uint64_t length, uint64_t first)
+{
+  size_t offset = store_take(store, position, sizeof(store_stub_t));
+  store_page_t *page = store_page(store, position);
+  store_slot_t *slot = &store_slots(page)[index];
+  store_stub_t stub = { length, first };
+
+  slot->offset = offset;
+  slot->length = flag | sizeof(store_stub_t);
+  memmove((byte_t*)page + offset, &stub, sizeof(store_stub_t));
+
+  store_log(store, position, offset, sizeof(store_stub_t));
+  store_log(store, position, 0, sizeof(store_page_t) + page->count * sizeof(store_slot_t));
+}
+
+// Write a record into a directory entry that has no data
+static void
+store_put (store_t *store, off_t position, size_t index, void *data, size_t length, uint16_t flag)
+{
+  if (length > store->inline_max)
+  {
+    store_put_stub(store, position, index, STORE_INDIRECT, length, store_chain(store, data, length));
+    return;
+  }
+
+  size_t offset = store_take(store, position, store_space(length));
+  store_page_t *page = store_page(store, position);
+  store_slot_t *slot = &store_slots(page)[index];
+
+  slot->offset = offset;
+  slot->length = flag | length;
+  memmove((byte_t*)page + offset, data, length);
+
+  store_log(store, position, offset, length);
+  store_log(store, position, 0, sizeof(store_page_t) + page->count * sizeof(store_slot_t));
+}
+
+static uint64_t
+store_add (store_t *store, void *data, size_t length, uint16_t flag)
+{
+  off_t position = store_find(store, length > store->inline_max ? sizeof(store_stub_t): store_space(length));
+  store_page_t *page = store_page(store, position);
+  store_slot_t *slots = store_slots(page);
+  size_t index = 0;
+
+  if (page->live < page->count)
+    while (slots[index].offset) index++;
+  else
+  {
+    if (store_gap(page) < sizeof(store_slot_t))
+      store_compact_page(store, position);
+
+    index = page->count++;
+    slots[index].offset = 0;
+  }
+
+  page->live++;
+  store_put(store, position, index, data, length, flag);
+
+  return store_id(store, position, index);
+}
+
+uint64_t
+store_insert (store_t *store, void *data, size_t length)
+{
+  return store_add(store, data, length, 0);
+}
+
+size_t
+store_length (store_t *store, uint64_t id)
+{
+  store_slot_t *slot = store_slot(store, id);
+
+  if (!slot)
+    return 0;
+
+  if (slot->length & (STORE_INDIRECT|STORE_FORWARD))
+    return store_stub(store, id, slot)->length;
+
+  return slot->length;
+}
+
+// Pointer to a record, valid until the store next changes. Overflow
+// records are gathered into a buffer owned by the store.
+void*
+store_get (store_t *store, uint64_t id, size_t *length)
+{
+  store_slot_t *slot = store_slot(store, id);
+
+  if (!slot)
+    return NULL;
+
+  if (slot->length & STORE_FORWARD)
+  {
+    id = store_stub(store, id, slot)->first;
+    slot = store_entry(store, id);
+
+    ensure(slot && slot->length & STORE_MOVED)
+      errorf("store forward corrupt: %lu %s", id, store->pool.name);
+  }
+
+  if (!(slot->length & STORE_INDIRECT))
+  {
+    if (length) *length = slot->length & STORE_LENGTH;
+    return store_stub(store, id, slot);
+  }
+
+  store_stub_t stub = *store_stub(store, id, slot);
+
+  if (store->bsize < stub.length)
+  {
+    store->bsize = stub.length;
+    store->buffer = reallocate(store->buffer, stub.length);
+  }
+
+  size_t done = 0;
+
+  for (off_t position = stub.first; position; )
+  {
+    ensure(store_valid(store, position, STORE_OVERFLOW) && done + store_page(store, position)->used <= stub.length)
+      errorf("store overflow chain corrupt: %lu %s", position, store->pool.name);
+
+    store_page_t *page = store_page(store, position);
+    memmove(store->buffer + done, page + 1, page->used);
+    done += page->used;
+    position = page->next;
+  }
+
+  if (length) *length = stub.length;
+  return store->buffer;
+}
+
+static void store_remove (store_t *store, uint64_t id);
+
+// Drop a record's data, leaving its directory entry in place
+static void
+store_drop (store_t *store, uint64_t id, store_slot_t *slot)
+{
+  store_stub_t stub = *store_stub(store, id, slot);
+  uint16_t length = slot->length;
+
+  store_page(store, store_position(store, id))->garbage += store_space(length);
+  slot->offset = 0;
+  slot->length = 0;
+
+  if (length & STORE_INDIRECT)
+    store_unchain(store, stub.first);
+
+  if (length & STORE_FORWARD)
+    store_remove(store, stub.first);
+}
+
+static void
+store_remove (store_t *store, uint64_t id)
+{
+  off_t position = store_position(store, id);
+  size_t index = id & 0xffff;
+
+  store_drop(store, id, store_entry(store, id));
+
+  store_page_t *page = store_page(store, position);
+  store_slot_t *slots = store_slots(page);
+
+  page->live--;
+
+  while (page->count && !slots[page->count-1].offset)
+    page->count--;
+
+  if (!page->live)
+  {
+    store->current = store->current == position ? 0: store->current;
+    pool_free(&store->pool, position);
+    return;
+  }
+
+  store_log(store, position, 0, sizeof(store_page_t) + index * sizeof(store_slot_t) + sizeof(store_slot_t));
+  store_list(store, position);
+}
+
+void
+store_update (store_t *store, uint64_t id, void *data, size_t length)
+{
+  store_slot_t *slot = store_slot(store, id);
+
+  ensure(slot)
+    errorf("store record not found: %lu %s", id, store->pool.name);
+
+  off_t position = store_position(store, id);
+  size_t index = id & 0xffff;
+
+  // same size or smaller inline records stay where they are
+  if (!(slot->length & ~STORE_LENGTH) && length <= store->inline_max && store_space(length) <= store_space(slot->length))
+  {
+    store_page_t *page = store_page(store, position);
+    page->garbage += store_space(slot->length) - store_space(length);
+    slot->length = length;
+    memmove((byte_t*)page + slot->offset, data, length);
+
+    store_log(store, position, slot->offset, length);
+    store_log(store, position, 0, sizeof(store_page_t) + page->count * sizeof(store_slot_t));
+    return;
+  }
+
+  store_drop(store, id, slot);
+
+  if (length > store->inline_max || store_room(store_page(store, position)) >= store_space(length))
+  {
+    store_put(store, position, index, data, length, 0);
+    return;
+  }
+
+  // a record that no longer fits its page is forwarded to another
+  store_put_stub(store, position, index, STORE_FORWARD, length, store_add(store, data, length, STORE_MOVED));
+}
+
+void
+store_delete (store_t *store, uint64_t id)
+{
+  ensure(store_slot(store, id))
+    errorf("store record not found: %lu %s", id, store->pool.name);
+
+  store_remove(store, id);
+}
+
+typedef struct { off_t index; store_t *store; off_t page; size_t slot; store_record_t record; int l1; } store_each_t;
+
+static inline int
+store_each_next (store_each_t *loop)
+{
+  store_t *store = loop->store;
+
+  for (;;)
+  {
+    store_page_t *page = loop->page ? store_page(store, loop->page): NULL;
+
+    while (page && page->kind == STORE_PAGE && loop->slot < page->count)
+    {
+      size_t index = loop->slot++;
+
+      if (!store_slots(page)[index].offset || store_slots(page)[index].length & STORE_MOVED)
+        continue;
+
+      loop->record.id = store_id(store, loop->page, index);
+      loop->record.data = store_get(store, loop->record.id, &loop->record.length);
+      return 1;
+    }
+
+    loop->page = pool_next(&store->pool, loop->page);
+    loop->slot = 0;
+
+    if (!loop->page)
+      return 0;
+  }
+}
+
+#define store_each(s,_rec_) for ( \
+  store_each_t loop = { 0, (s), 0, 0, { 0, 0, NULL }, 0 }; \
+    !loop.l1 && store_each_next(&loop) && (loop.l1 = 1); \
+    loop.index++ \
+  ) \
+    for (_rec_ = &loop.record; loop.l1; loop.l1 = !loop.l1)
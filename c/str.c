@@ -132,6 +132,99 @@ str_copy (char *s, size_t length)
   return a;
 }
 
+#define STR_UTF8_HIGH 0x8080808080808080ULL
+
+// number of UTF-8 continuation bytes (10xxxxxx) in a 64 bit word
+#define str_utf8_tails(w) __builtin_popcountll((w) & ~((w) << 1) & STR_UTF8_HIGH)
+
+int
+str_utf8_valid (char *str, size_t length)
+{
+  unsigned char *s = (unsigned char*)str;
+  size_t i = 0;
+
+  while (i < length)
+  {
+    uint64_t w;
+    if (i + 8 <= length && (memmove(&w, s + i, 8), !(w & STR_UTF8_HIGH)))
+    {
+      i += 8;
+      continue;
+    }
+
+    unsigned char c = s[i];
+
+    if (c < 0x80)
+    {
+      i++;
+      continue;
+    }
+
+    size_t n = 0;
+    uint32_t cp = 0, lo = 0;
+
+         if (c >= 0xC2 && c <= 0xDF) { n = 1; cp = c & 0x1F; lo = 0x80; }
+    else if (c >= 0xE0 && c <= 0xEF) { n = 2; cp = c & 0x0F; lo = 0x800; }
+    else if (c >= 0xF0 && c <= 0xF4) { n = 3; cp = c & 0x07; lo = 0x10000; }
+    else return 0;
+
+    if (i + n >= length)
+      return 0;
+
+    for (size_t j = 1; j <= n; j++)
+    {
+      if ((s[i+j] & 0xC0) != 0x80)
+        return 0;
+      cp = (cp << 6) | (s[i+j] & 0x3F);
+    }
+
+    if (cp < lo || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+      return 0;
+
+    i += n + 1;
+  }
+  return 1;
+}
+
+size_t
+str_utf8_count (char *s, size_t length)
+{
+  size_t n = 0, i = 0;
+
+  for (; i + 8 <= length; i += 8)
+  {
+    uint64_t w;
+    memmove(&w, s + i, 8);
+    n += 8 - str_utf8_tails(w);
+  }
+  for (; i < length; i++)
+    n += (s[i] & 0xC0) != 0x80;
+
+  return n;
+}
+
+// byte offset of code point n, or length if there are fewer code points
+size_t
+str_utf8_skip (char *s, size_t length, size_t n)
+{
+  size_t i = 0;
+
+  for (; i + 8 <= length; i += 8)
+  {
+    uint64_t w;
+    memmove(&w, s + i, 8);
+    size_t c = 8 - str_utf8_tails(w);
+    if (c > n) break;
+    n -= c;
+  }
+  for (; i < length; i++)
+  {
+    if ((s[i] & 0xC0) != 0x80 && !n--)
+      return i;
+  }
+  return length;
+}
+
 #define STR_ENCODE_HEX 1
 #define STR_ENCODE_SQL 2
 #define STR_ENCODE_DQUOTE 3
@@ -1,9 +1,21 @@
 typedef struct _text_t {
   char *buffer;
   size_t bytes;
+  size_t limit;
   off_t cursor;
+  off_t gap;
+  size_t *index;
+  size_t indexed;
+  size_t indexes;
 } text_t;
 
+// buffer holds bytes of content with a gap of (limit - bytes) at offset gap.
+// Edits move the gap to the cursor; readers move it to the end first.
+// index[k] is the byte offset of code point k * TEXT_INDEX_STEP, valid for
+// the first indexed entries and truncated by edits before those offsets.
+
+#define TEXT_INDEX_STEP 256
+
 static char *text_nil = "";
 
 void
@@ -12,9 +24,16 @@ text_clear (text_t *text)
   if (text->buffer)
     free(text->buffer);
 
-  text->buffer = NULL;
-  text->bytes  = 0;
-  text->cursor = 0;
+  free(text->index);
+
+  text->buffer  = NULL;
+  text->bytes   = 0;
+  text->limit   = 0;
+  text->cursor  = 0;
+  text->gap     = 0;
+  text->index   = NULL;
+  text->indexed = 0;
+  text->indexes = 0;
 }
 
 void
@@ -27,10 +46,54 @@ text_free (text_t *text)
   }
 }
 
+void
+text_gap (text_t *text, off_t pos)
+{
+  size_t gap = text->limit - text->bytes;
+
+  if (gap && pos < text->gap)
+    memmove(&text->buffer[pos + gap], &text->buffer[pos], text->gap - pos);
+  else
+  if (gap && pos > text->gap)
+    memmove(&text->buffer[text->gap], &text->buffer[text->gap + gap], pos - text->gap);
+
+  text->gap = pos;
+}
+
+void
+text_reserve (text_t *text, size_t bytes)
+{
+  if (text->limit - text->bytes >= bytes)
+    return;
+
+  size_t tail  = text->bytes - text->gap;
+  size_t limit = max(max(text->limit * 2, text->bytes + bytes), 32);
+
+  text->buffer = reallocate(text->buffer, limit);
+  memmove(&text->buffer[limit - tail], &text->buffer[text->limit - tail], tail);
+  text->limit = limit;
+}
+
+char*
+text_pack (text_t *text)
+{
+  if (text->gap != text->bytes)
+    text_gap(text, text->bytes);
+  return text->buffer;
+}
+
+void
+text_unindex (text_t *text, off_t pos)
+{
+  while (text->indexed && text->index[text->indexed-1] >= pos)
+    text->indexed--;
+}
+
 char*
 text_unwrap (text_t *text)
 {
-  char *str = text->buffer;
+  char *str = text_pack(text);
+  free(text->index);
   free(text);
   return str;
 }
@@ -39,14 +102,14 @@ char*
 text_at (text_t *text, off_t pos)
 {
   text->cursor = min(text->bytes - 1, max(0, pos));
-  return &text->buffer[text->cursor];
+  return &text_pack(text)[text->cursor];
 }
 
 char*
 text_go (text_t *text, int offset)
 {
   text->cursor = min(text->bytes - 1, max(0, (int64_t)text->cursor + offset));
-  return &text->buffer[text->cursor];
+  return &text_pack(text)[text->cursor];
 }
 
 off_t
@@ -61,54 +124,56 @@ text_set (text_t *text, char *str)
   text_clear(text);
 
   text->bytes = strlen(str) + 1;
+  text->limit = text->bytes;
+  text->gap = text->bytes;
   text->buffer = allocate(text->bytes);
   text->cursor = 0;
   strcpy(text->buffer, str);
 }
 
 void
-text_ins (text_t *text, char *str)
+text_ins_length (text_t *text, char *str, size_t new_bytes)
 {
   if (!text->buffer)
-  {
-    text_set(text, str);
-    text->cursor = text->bytes - 1;
-    return;
-  }
+    text_set(text, "");
 
-  size_t new_bytes = strlen(str);
-  text->buffer = reallocate(text->buffer, text->bytes + new_bytes);
-  memmove(&text->buffer[text->cursor + new_bytes], &text->buffer[text->cursor], text->bytes - text->cursor);
-  memmove(&text->buffer[text->cursor], str, new_bytes);
+  text_unindex(text, text->cursor);
+  text_reserve(text, new_bytes);
+  text_gap(text, text->cursor);
+  memmove(&text->buffer[text->gap], str, new_bytes);
+  text->gap += new_bytes;
   text->cursor += new_bytes;
   text->bytes += new_bytes;
 }
 
+void
+text_ins (text_t *text, char *str)
+{
+  text_ins_length(text, str, strlen(str));
+}
+
 void
 text_del (text_t *text, size_t bytes)
 {
   if (text->buffer)
   {
     bytes = min(text->bytes - text->cursor - 1, bytes);
-    memmove(&text->buffer[text->cursor],
-      &text->buffer[text->cursor + bytes],
-      text->bytes - text->cursor - bytes
-    );
+    text_unindex(text, text->cursor);
+    text_gap(text, text->cursor);
     text->bytes -= bytes;
-    text_at(text, text->cursor);
   }
 }
 
 char*
 text_get (text_t *text)
 {
-  return text->buffer ? text->buffer: text_nil;
+  return text->buffer ? text_pack(text): text_nil;
 }
 
 int
 text_cmp (text_t *text, char *str)
 {
-  return text->buffer ? strcmp(text->buffer, str): -1;
+  return text->buffer ? strcmp(text_pack(text), str): -1;
 }
 
 size_t
@@ -120,19 +185,55 @@ text_count (text_t *text)
 size_t
 text_len (text_t *text)
 {
-  if (text->buffer)
+  return text->buffer ? str_utf8_count(text_pack(text), text->bytes - 1): 0;
+}
+
+int
+text_valid (text_t *text)
+{
+  return text->buffer ? str_utf8_valid(text_pack(text), text->bytes - 1): 1;
+}
+
+// byte offset of code point n, or text_count if there are fewer
+size_t
+text_cp_offset (text_t *text, size_t n)
+{
+  if (!text->buffer)
+    return 0;
+
+  char *s = text_pack(text);
+  size_t bytes = text->bytes - 1;
+  size_t k = n / TEXT_INDEX_STEP;
+
+  if (!text->indexed)
   {
-    size_t i = 0, j = 0;
-    char *s = text->buffer;
-    while (s[i])
+    if (!text->index)
     {
-      if ((s[i] & 0xC0) != 0x80)
-        j++;
-      i++;
+      text->indexes = 16;
+      text->index = allocate(text->indexes * sizeof(size_t));
     }
-    return j;
+    text->index[text->indexed++] = 0;
   }
-  return 0;
+
+  while (text->indexed <= k)
+  {
+    size_t from = text->index[text->indexed-1];
+    size_t offset = from + str_utf8_skip(s + from, bytes - from, TEXT_INDEX_STEP);
+
+    if (offset >= bytes)
+      break;
+
+    if (text->indexed == text->indexes)
+    {
+      text->indexes *= 2;
+      text->index = reallocate(text->index, text->indexes * sizeof(size_t));
+    }
+    text->index[text->indexed++] = offset;
+  }
+
+  k = min(k, text->indexed-1);
+  size_t from = text->index[k];
+  return from + str_utf8_skip(s + from, bytes - from, n - k * TEXT_INDEX_STEP);
 }
 
 size_t
@@ -140,7 +241,7 @@ text_scan (text_t *text, str_cb_ischar cb)
 {
   if (text->buffer)
   {
-    size_t n = str_scan(text->buffer + text->cursor, cb);
+    size_t n = str_scan(text_pack(text) + text->cursor, cb);
     text->cursor += n;
     return n;
   }
@@ -152,7 +253,7 @@ text_skip (text_t *text, str_cb_ischar cb)
 {
   if (text->buffer)
   {
-    size_t n = str_skip(text->buffer + text->cursor, cb);
+    size_t n = str_skip(text_pack(text) + text->cursor, cb);
     text->cursor += n;
     return n;
   }
@@ -164,26 +265,115 @@ text_find (text_t *text, char *str)
 {
   if (text->buffer)
   {
-    char *s = strstr(text->buffer + text->cursor, str);
+    char *buffer = text_pack(text);
+    char *s = memmem(buffer + text->cursor, text->bytes - text->cursor - 1, str, strlen(str));
     if (s)
     {
-      text->cursor = s - text->buffer;
+      text->cursor = s - buffer;
       return 1;
     }
   }
   return 0;
 }
 
+// offsets of all non-overlapping matches in the whole text; caller frees
+off_t*
+text_find_all (text_t *text, char *str, size_t *count)
+{
+  off_t *offsets = NULL;
+  size_t len = strlen(str), n = 0, limit = 0;
+
+  if (text->buffer && len)
+  {
+    char *buffer = text_pack(text);
+    char *end = buffer + text->bytes - 1;
+
+    for (char *s = buffer; (s = memmem(s, end - s, str, len)); s += len)
+    {
+      if (n == limit)
+      {
+        limit = max(limit * 2, 16);
+        offsets = reallocate(offsets, limit * sizeof(off_t));
+      }
+      offsets[n++] = s - buffer;
+    }
+  }
+  if (count)
+    *count = n;
+  return offsets;
+}
+
+size_t
+text_replace_all (text_t *text, char *find, char *replace)
+{
+  size_t count = 0;
+  off_t *offsets = text_find_all(text, find, &count);
+
+  if (count)
+  {
+    size_t flen = strlen(find);
+    size_t rlen = strlen(replace);
+    size_t bytes = text->bytes - count * flen + count * rlen;
+
+    char *result = allocate(bytes);
+    char *dst = result;
+    off_t last = 0;
+    int64_t cursor = text->cursor;
+
+    for (size_t i = 0; i < count; i++)
+    {
+      memmove(dst, &text->buffer[last], offsets[i] - last);
+      dst += offsets[i] - last;
+      memmove(dst, replace, rlen);
+      dst += rlen;
+      last = offsets[i] + flen;
+
+      if (last <= text->cursor)
+        cursor += (int64_t)rlen - (int64_t)flen;
+    }
+    memmove(dst, &text->buffer[last], text->bytes - last);
+
+    text_unindex(text, offsets[0]);
+
+    free(text->buffer);
+    text->buffer = result;
+    text->bytes  = bytes;
+    text->limit  = bytes;
+    text->gap    = bytes;
+    text->cursor = min(bytes - 1, max(0, cursor));
+  }
+  free(offsets);
+  return count;
+}
+
+int
+text_char (text_t *text, off_t pos)
+{
+  return text->buffer[pos < text->gap ? pos: pos + text->limit - text->bytes];
+}
+
 size_t
 text_ltrim (text_t *text, str_cb_ischar cb)
 {
   if (text->buffer)
   {
-    str_ltrim(text->buffer, cb);
-    text->bytes = strlen(text->buffer) + 1;
-    text->cursor = min(text->bytes-1, text->cursor);
+    size_t n = 0;
+    while (n < text->bytes - 1 && cb(text_char(text, n)))
+      n++;
+
+    // widen the gap back over the prefix; only content between the prefix
+    // and the gap moves, none if the gap is within the prefix
+    if (n)
+    {
+      text_unindex(text, 0);
+      if (text->gap > n)
+        text_gap(text, n);
+      text->gap = 0;
+      text->bytes -= n;
+      text->cursor = text->cursor > n ? text->cursor - n: 0;
+    }
   }
-  return max(text->bytes-1, 0);
+  return text_count(text);
 }
 
 size_t
@@ -191,23 +381,45 @@ text_rtrim (text_t *text, str_cb_ischar cb)
 {
   if (text->buffer)
   {
-    str_rtrim(text->buffer, cb);
-    text->bytes = strlen(text->buffer) + 1;
-    text->cursor = min(text->bytes-1, text->cursor);
+    text_gap(text, text->bytes - 1);
+
+    while (text->gap > 0 && cb(text->buffer[text->gap - 1]))
+    {
+      text->gap--;
+      text->bytes--;
+    }
+    text_unindex(text, text->gap);
+    text->cursor = min(text->bytes - 1, text->cursor);
   }
-  return max(text->bytes-1, 0);
+  return text_count(text);
 }
 
 size_t
 text_trim (text_t *text, str_cb_ischar cb)
 {
-  if (text->buffer)
-  {
-    str_trim(text->buffer, cb);
-    text->bytes = strlen(text->buffer) + 1;
-    text->cursor = min(text->bytes-1, text->cursor);
-  }
-  return max(text->bytes-1, 0);
+  text_ltrim(text, cb);
+  return text_rtrim(text, cb);
+}
+
+// remove sep if it immediately precedes the cursor, eg a trailing comma
+int
+text_unsep (text_t *text, char *sep)
+{
+  size_t len = strlen(sep);
+
+  if (!text->buffer || !len || text->cursor < len)
+    return 0;
+
+  text_gap(text, text->cursor);
+
+  if (memcmp(&text->buffer[text->gap - len], sep, len))
+    return 0;
+
+  text->gap -= len;
+  text->bytes -= len;
+  text->cursor -= len;
+  text_unindex(text, text->gap);
+  return 1;
 }
 
 #define TEXT_HEX STR_ENCODE_HEX
@@ -219,7 +431,7 @@ text_encode (text_t *text, int type)
 {
   if (text->buffer)
   {
-    char *result = str_encode(text->buffer, type);
+    char *result = str_encode(text_pack(text), type);
     text_clear(text);
     text_set(text, result);
     return 1;
@@ -233,7 +445,7 @@ text_decode (text_t *text, int type)
   if (text->buffer)
   {
     char *err = NULL;
-    char *result = str_decode(text->buffer, &err, type);
+    char *result = str_decode(text_pack(text), &err, type);
     if (err == text->buffer + text->bytes - 1)
     {
       text_clear(text);
@@ -247,7 +459,7 @@ text_decode (text_t *text, int type)
 int
 text_match (text_t *text, regex_t *re)
 {
-  return text->buffer ? regmatch(re, text->buffer + text->cursor): 0;
+  return text->buffer ? regmatch(re, text_pack(text) + text->cursor): 0;
 }
 
 text_t*
@@ -255,7 +467,12 @@ text_init (text_t *text)
 {
   text->buffer = NULL;
   text->bytes = 0;
+  text->limit = 0;
   text->cursor = 0;
+  text->gap = 0;
+  text->index = NULL;
+  text->indexed = 0;
+  text->indexes = 0;
   return text;
 }
 
@@ -274,6 +491,8 @@ text_wrap (char *str)
   text_t *text = allocate(sizeof(text_t));
   text_init(text);
   text->bytes = strlen(str) + 1;
+  text->limit = text->bytes;
+  text->gap = text->bytes;
   text->buffer = str;
   text->cursor = 0;
   return text;
@@ -298,15 +517,33 @@ text_take (text_t *text, off_t pos, size_t len)
     len = len >= 0 ? min(len, available): max(0, available + len);
 
     new->bytes = len + 1;
+    new->limit = new->bytes;
+    new->gap = new->bytes;
     new->buffer = allocate(new->bytes);
-    memmove(new->buffer, &text->buffer[pos], len);
+    memmove(new->buffer, &text_pack(text)[pos], len);
     new->buffer[len] = 0;
   }
   return new;
 }
 
-void text_home (text_t *text) { text_at(text, 0); }
-off_t text_end (text_t *text) { text_at(text, text_count(text)); return text->cursor; }
+char*
+text_cp_at (text_t *text, size_t n)
+{
+  return text_at(text, text_cp_offset(text, n));
+}
+
+text_t*
+text_cp_take (text_t *text, off_t pos, size_t len)
+{
+  if (pos < 0)
+    pos = max(0, (int64_t)text_len(text) + pos);
+
+  size_t start = text_cp_offset(text, pos);
+  return text_take(text, start, text_cp_offset(text, pos + len) - start);
+}
+
+void text_home (text_t *text) { text->cursor = 0; }
+off_t text_end (text_t *text) { text->cursor = text_count(text); return text->cursor; }
 
 #define textf(...) ({ char *_s = strf(__VA_ARGS__); text_t *_t = text_new(_s); free(_s); text_end(_t); _t; })
 #define textf_set(o,...) ({ text_t *_t = (o); char *_s = strf(__VA_ARGS__); text_set(_t, _s); free(_s); _t; })
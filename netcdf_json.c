@@ -31,9 +31,6 @@ main (int argc, char *argv[])
   int unlimited_dimension_id = 0;
   int file_format            = 0;
 
-  // <file>
-  text_t *json = textf("{");
-
   if (nc_inq(id, &num_dimensions, &num_variables, &num_file_attributes, &unlimited_dimension_id) != NC_NOERR)
   {
     errorf("line %d nc_inq %s", __LINE__, path);
@@ -48,7 +45,15 @@ main (int argc, char *argv[])
     goto done_close;
   }
 
-  textf_ins(json, "\"format\": \"%s\",",
+  printf("%s\tnetcdf\t", path);
+
+  // <file>
+  json_writer_t json;
+  json_writer_file(&json, stdout);
+  json_writer_object(&json);
+
+  json_writer_key(&json, "format");
+  json_writer_string(&json,
     (file_format == NC_FORMAT_CLASSIC         ? "NC_FORMAT_CLASSIC":
     (file_format == NC_FORMAT_NETCDF4         ? "NC_FORMAT_NETCDF4":
     (file_format == NC_FORMAT_NETCDF4_CLASSIC ? "NC_FORMAT_NETCDF4_CLASSIC":
@@ -66,7 +71,8 @@ main (int argc, char *argv[])
   nc_type variable_type, attribute_type;
 
   // <variables>
-  text_ins(json, "\"variables\": {");
+  json_writer_key(&json, "variables");
+  json_writer_object(&json);
 
   for (int variable_id = 0; variable_id < num_variables; variable_id++)
   {
@@ -76,13 +82,25 @@ main (int argc, char *argv[])
       continue;
     }
 
+    int variable_dimensions[num_variable_dimensions];
+    size_t dimension_lengths[num_variable_dimensions];
+
+    memset(variable_dimensions,  0, num_variable_dimensions * sizeof(int));
+    memset(dimension_lengths, 0, num_variable_dimensions * sizeof(size_t));
+
+    if (nc_inq_var(id, variable_id, NULL, NULL, NULL, variable_dimensions, NULL) != NC_NOERR)
+    {
+      errorf("line %d nc_inq_var %s variable %d", __LINE__, path, variable_id);
+      continue;
+    }
+
     // <variable>
-    char *variable_name_quoted = str_encode(variable_name, STR_ENCODE_DQUOTE);
-    textf_ins(json, "%s: {", variable_name_quoted);
-    free(variable_name_quoted);
+    json_writer_key(&json, variable_name);
+    json_writer_object(&json);
 
     // <type>
-    textf_ins(json, "\"type\": \"%s\",",
+    json_writer_key(&json, "type");
+    json_writer_string(&json,
       (variable_type == NC_BYTE   ? "NC_BYTE":
       (variable_type == NC_UBYTE  ? "NC_UBYTE":
       (variable_type == NC_CHAR   ? "NC_CHAR":
@@ -98,19 +116,8 @@ main (int argc, char *argv[])
     );
 
     // <dimensions>
-    text_ins(json, "\"dimensions\": [");
-
-    int variable_dimensions[num_variable_dimensions];
-    size_t dimension_lengths[num_variable_dimensions];
-
-    memset(variable_dimensions,  0, num_variable_dimensions * sizeof(int));
-    memset(dimension_lengths, 0, num_variable_dimensions * sizeof(size_t));
-
-    if (nc_inq_var(id, variable_id, NULL, NULL, NULL, variable_dimensions, NULL) != NC_NOERR)
-    {
-      errorf("line %d nc_inq_var %s variable %d", __LINE__, path, variable_id);
-      continue;
-    }
+    json_writer_key(&json, "dimensions");
+    json_writer_array(&json);
 
     for (int dim = 0; dim < num_variable_dimensions; dim++)
     {
@@ -119,17 +126,15 @@ main (int argc, char *argv[])
         errorf("line %d nc_inq_dim %s variable %d dimension %d", __LINE__, path, variable_id, variable_dimensions[dim]);
         continue;
       }
-      char *dimension_name_quoted = str_encode(dimension_name, STR_ENCODE_DQUOTE);
-      textf_ins(json, "%s,", dimension_name_quoted);
-      free(dimension_name_quoted);
+      json_writer_string(&json, dimension_name);
     }
 
     // </dimensions>
-    text_trim(json, iscomma);
-    text_ins(json, " ],");
+    json_writer_array_end(&json);
 
     // <attributes>
-    text_ins(json, "\"attributes\": {");
+    json_writer_key(&json, "attributes");
+    json_writer_object(&json);
 
     for (int attribute_id = 0; attribute_id < num_variable_attributes; attribute_id++)
     {
@@ -145,8 +150,6 @@ main (int argc, char *argv[])
         continue;
       }
 
-      char *attribute_name_quoted = str_encode(attribute_name, STR_ENCODE_DQUOTE);
-
       if (attribute_type == NC_CHAR)
       {
         char buffer[attribute_length+1];
@@ -159,9 +162,8 @@ main (int argc, char *argv[])
 
         buffer[attribute_length] = 0;
 
-        char *buffer_quoted = str_encode(buffer, STR_ENCODE_DQUOTE);
-        textf_ins(json, "%s: %s,", attribute_name_quoted, buffer_quoted);
-        free(buffer_quoted);
+        json_writer_key(&json, attribute_name);
+        json_writer_string(&json, buffer);
       }
       else
       if (attribute_type == NC_STRING)
@@ -174,17 +176,13 @@ main (int argc, char *argv[])
           continue;
         }
 
-        textf_ins(json, "%s: [", attribute_name_quoted);
+        json_writer_key(&json, attribute_name);
+        json_writer_array(&json);
 
         for (int attr = 0; attr < attribute_length; attr++)
-        {
-          char *s = str_encode(buffer[attr], STR_ENCODE_DQUOTE);
-          textf_ins(json, "%s,", s);
-          free(s);
-        }
+          json_writer_string(&json, buffer[attr]);
 
-        text_trim(json, iscomma);
-        text_ins(json, " ]");
+        json_writer_array_end(&json);
       }
       else
       if (
@@ -209,67 +207,66 @@ main (int argc, char *argv[])
           continue;
         }
 
+        json_writer_key(&json, attribute_name);
+
         switch (attribute_type)
         {
           case NC_BYTE:
-            textf_ins(json, "%s: %d,", attribute_name_quoted, (int32_t)*((int8_t*)ptr));
+            json_writer_integer(&json, *((int8_t*)ptr));
             break;
 
           case NC_UBYTE:
-            textf_ins(json, "%s: %u,", attribute_name_quoted, (uint32_t)*((uint8_t*)ptr));
+            json_writer_integer(&json, *((uint8_t*)ptr));
             break;
 
           case NC_SHORT:
-            textf_ins(json, "%s: %d,", attribute_name_quoted, (int32_t)*((int16_t*)ptr));
+            json_writer_integer(&json, *((int16_t*)ptr));
             break;
 
           case NC_USHORT:
-            textf_ins(json, "%s: %u,", attribute_name_quoted, (uint32_t)*((uint16_t*)ptr));
+            json_writer_integer(&json, *((uint16_t*)ptr));
             break;
 
           case NC_INT:
-            textf_ins(json, "%s: %d,", attribute_name_quoted, *((int32_t*)ptr));
+            json_writer_integer(&json, *((int32_t*)ptr));
             break;
 
           case NC_UINT:
-            textf_ins(json, "%s: %u,", attribute_name_quoted, *((uint32_t*)ptr));
+            json_writer_integer(&json, *((uint32_t*)ptr));
             break;
 
           case NC_INT64:
-            textf_ins(json, "%s: %ld,", attribute_name_quoted, *((int64_t*)ptr));
+            json_writer_integer(&json, *((int64_t*)ptr));
             break;
 
           case NC_UINT64:
-            textf_ins(json, "%s: %lu,", attribute_name_quoted, *((uint64_t*)ptr));
+            json_writer_unsigned(&json, *((uint64_t*)ptr));
             break;
 
           case NC_FLOAT:
-            textf_ins(json, "%s: %10e,", attribute_name_quoted, *((float*)ptr));
+            json_writer_float(&json, *((float*)ptr));
             break;
 
           case NC_DOUBLE:
-            textf_ins(json, "%s: %10e,", attribute_name_quoted, *((double*)ptr));
+            json_writer_double(&json, *((double*)ptr));
             break;
         }
       }
-      free(attribute_name_quoted);
     }
 
     // </attributes>
-    text_trim(json, iscomma);
-    text_ins(json, " },");
+    json_writer_object_end(&json);
 
     // </variable>
-    text_trim(json, iscomma);
-    text_ins(json, " },");
+    json_writer_object_end(&json);
   }
 
   // </variables>
-  text_trim(json, iscomma);
-  text_ins(json, " },");
+  json_writer_object_end(&json);
 
   // <dimensions>
-  text_ins(json, "\"dimensions\": {");
+  json_writer_key(&json, "dimensions");
+  json_writer_object(&json);
 
   for (int dimension_id = 0; dimension_id < num_dimensions; dimension_id++)
   {
@@ -279,27 +276,25 @@ main (int argc, char *argv[])
       continue;
     }
 
-    char *dimension_name_quoted = str_encode(dimension_name, STR_ENCODE_DQUOTE);
-
-    textf_ins(json, "%s: { \"length\": %lu, \"unlimited\": %s },",
-      dimension_name_quoted, dimension_length, unlimited_dimension_id == dimension_id ? "true": "false"
-    );
-
-    free(dimension_name_quoted);
+    json_writer_key(&json, dimension_name);
+    json_writer_object(&json);
+    json_writer_key(&json, "length");
+    json_writer_integer(&json, dimension_length);
+    json_writer_key(&json, "unlimited");
+    json_writer_boolean(&json, unlimited_dimension_id == dimension_id);
+    json_writer_object_end(&json);
   }
 
   // </dimensions>
-  text_trim(json, iscomma);
-  text_ins(json, " }");
+  json_writer_object_end(&json);
 
   // </file>
-  text_trim(json, iscomma);
-  text_ins(json, " }");
+  json_writer_object_end(&json);
 
-  printf("%s\tnetcdf\t%s", path, text_get(json));
-  fflush(stdout);
+  if (json_writer_clear(&json) != 0)
+    rc = EXIT_FAILURE;
 
-  text_free(json);
+  fflush(stdout);
 
 done_close:
   nc_close(id);
@@ -1,6 +1,7 @@
 //#define TOOLBELT_DB
 //#define TOOLBELT_THREAD
 #include "toolbelt.c"
+#include <malloc.h>
 
 int
 map_cmp_int (void *a, void *b)
@@ -19,6 +20,95 @@ map_hash_int (void *a)
   return ai;
 }
 
+int
+ndjson_check (json_t *record, void *payload)
+{
+  int64_t *seen = payload;
+  int64_t id = json_is_array(record) ? json_integer(record->children): json_integer(json_object_get(record, "id"));
+  if (id != seen[0] + 1 + (id == 501)) seen[2]++;
+  seen[0] = id;
+  return id == seen[1];
+}
+
+int
+json_path_sum (json_t *json, void *payload)
+{
+  *(int64_t*)payload += json_integer(json);
+  return 0;
+}
+
+typedef struct {
+  pool_t *pool;
+  off_t *index;
+} pool_index_t;
+
+void
+pool_compact_index (off_t from, off_t to, size_t bytes, void *payload)
+{
+  pool_index_t *pi = payload;
+  for (size_t i = 0; i < bytes; i += sizeof(uint64_t))
+    pi->index[*(uint64_t*)(pi->pool->map + to + i)] = to + i;
+}
+
+void
+pool_compact_shift (off_t from, off_t to, size_t bytes, void *payload)
+{
+  off_t *chunks = payload;
+  for (int i = 0; i < 100; i++)
+    if (chunks[i] >= from && chunks[i] < from + bytes) chunks[i] += to - from;
+}
+
+#ifdef TOOLBELT_THREAD
+typedef struct {
+  pool_t *pool;
+  uint64_t id;
+  int errors;
+} pool_worker_t;
+
+// Mixes locked and cached allocs and frees with chunks that grow the pool
+void*
+pool_worker (void *payload)
+{
+  pool_worker_t *worker = payload;
+  pool_t *pool = worker->pool;
+  pool_cache_t cache;
+  pool_cache_init(&cache, pool);
+  off_t kept = 0;
+
+  for (uint64_t i = 0; i < 20000; i++)
+  {
+    uint64_t val = worker->id * 100000 + i;
+    off_t pos = i % 2 ? pool_cache_alloc(&cache): pool_alloc(pool);
+    pool_write(pool, pos, &val);
+
+    if (i % 3 == 0)
+      kept = pos;
+    else
+    if (i % 2)
+      pool_cache_free(&cache, pos);
+    else
+      pool_free(pool, pos);
+
+    if (i % 100 == 0)
+      pool_free_chunk(pool, pool_alloc_chunk(pool, 40 * sizeof(uint64_t)), 40 * sizeof(uint64_t));
+
+    if (kept && pool_is_free(pool, kept))
+      worker->errors++;
+  }
+
+  pool_cache_flush(&cache);
+  return NULL;
+}
+#endif
+
+size_t
+store_sample (char *buf, uint64_t i, size_t length)
+{
+  for (size_t j = 0; j < length; j++)
+    buf[j] = 'a' + (i + j) % 26;
+  return length;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -103,6 +193,18 @@ main (int argc, char *argv[])
   ensure(map_get(map, &i4) == NULL)
     errorf("map_get 3");
 
+  // map_del used to leak the node it removed
+  size_t mheap = mallinfo2().uordblks;
+
+  for (int i = 0; i < 10000; i++)
+  {
+    map_set(map, &i4, &i1);
+    map_del(map, &i4);
+  }
+
+  ensure(mallinfo2().uordblks < mheap + 10000 && map_count(map) == 2)
+    errorf("map_del leak");
+
   map_free(map);
 
   map = map_new();
@@ -149,16 +251,485 @@ main (int argc, char *argv[])
 
   json_free(json);
 
+  json = json_parse("{\"plain\": \"hello\", \"escaped\": \"say \\\"hi\\\"\"}");
+
+  size_t jlen = 0;
+  ensure(json && (jval = json_object_get(json, "plain")) && !strncmp(json_string_view(jval, &jlen), "hello", jlen) && jlen == 5)
+    errorf("json_string_view");
+
+  ensure((jval = json_object_get(json, "escaped")) && !json_string_view(jval, &jlen) && (item = json_string(jval)) && !strcmp(item, "say \"hi\""))
+    errorf("json_string escaped");
+
+  free(item);
+  json_free(json);
+
+  text_t *jtext = textf("[");
+  for (int i = 0; i < 10000; i++)
+    textf_ins(jtext, "{\"id\": %d, \"name\": \"item %d\"},", i, i);
+  text_unsep(jtext, ",");
+  text_ins(jtext, "]");
+
+  json = json_parse_arena(text_get(jtext));
+
+  ensure(json && json->flags & JSON_ARENA && (jval = json_object_get(json_array_get(json, 9999), "id")) && json_integer(jval) == 9999)
+    errorf("json_parse_arena");
+
+  json_free(json);
+
+  json = json_parse_fast(text_get(jtext));
+
+  int64_t jsum = 0;
+  json_array_each(json, json_t *jitem)
+    jsum += json_integer(json_array_get(json, loop.index)->children->sibling) - json_integer(json_object_get(jitem, "id"));
+
+  ensure(json_array_count(json) == 10000 && jsum == 0 && json->index && !json_array_get(json, 10000))
+    errorf("json_array_each");
+
+  ensure(json && (jval = json_object_get(json_array_get(json, 5000), "name")) && (item = json_string(jval)) && !strcmp(item, "item 5000"))
+    errorf("json_parse_fast");
+
+  free(item);
+
+  size_t jcount = 0;
+
+  ensure(!json_structure("", (size_t)UINT32_MAX, &jcount))
+    errorf("json_structure too large");
+  json_free(json);
+  text_free(jtext);
+
+  jtext = textf("{");
+  for (int i = 0; i < 10000; i++)
+    textf_ins(jtext, "\"key%d\": %d,", i, i);
+  text_ins(jtext, "\"esc\\\"aped\": -1}");
+
+  for (int i = 0; i < 2; i++)
+  {
+    json = i ? json_parse_fast(text_get(jtext)): json_parse(text_get(jtext));
+
+    ensure(json->flags & JSON_INDEXED && json->index && json_integer(json_object_get(json, "key1234")) == 1234 && json_integer(json_object_get(json, "esc\"aped")) == -1 && !json_object_get(json, "key10000"))
+      errorf("json_object_get index");
+
+    json_free(json);
+  }
+  text_free(jtext);
+
+  // hand built arrays may leave count unset
+  json_t jhand[4] = { { .type = JSON_ARRAY, .children = &jhand[1] }, { .type = JSON_INTEGER, .sibling = &jhand[2] },
+    { .type = JSON_INTEGER, .sibling = &jhand[3] }, { .type = JSON_INTEGER } };
+
+  ensure(json_array_get(&jhand[0], 2) == &jhand[3] && !json_array_get(&jhand[0], 3) && json_array_count(&jhand[0]) == 3)
+    errorf("json_array_get hand built");
+
+  // and numbers set only their text
+  json_t jtyped[2] = { { .type = JSON_INTEGER, .start = "42", .length = 2 }, { .type = JSON_DOUBLE, .start = "2.5", .length = 3 } };
+
+  ensure(json_integer(&jtyped[0]) == 42 && json_double(&jtyped[1]) == 2.5 && json_double(&jtyped[0]) == 42)
+    errorf("json_integer hand built");
+
+  char *jnumbers[] = { "0", "-0", "42", "-9223372036854775808", "9223372036854775807", "9223372036854775808",
+    "0x1F", "010", "1.", ".5", "-2.5e-3", "0.1", "0.000123", "1e23", "123456789.123456789", "1e", "-", "12345678901234567890123",
+    "1.7976931348623157e308", "4.9e-324", "1e400", "3.14159265358979323846", "9007199254740993", "1E+2" };
+
+  for (int i = 0; i < 24 + 10000; i++)
+  {
+    char jnum[32];
+
+    if (i >= 24)
+      snprintf(jnum, sizeof(jnum), "%.*g", 1 + i % 17, (double)rand() / rand() * (i % 3 ? 1e-5: 1e5));
+
+    char *subject = i < 24 ? jnumbers[i]: jnum;
+    char *e1 = NULL, *e2 = NULL;
+    int64_t i1 = 0, i2 = 0;
+    double d1 = 0, d2 = 0;
+    int t1 = json_number(subject, &e1, &i1, &d1);
+    int t2 = json_number_libc(subject, &e2, &i2, &d2);
+
+    ensure(t1 == t2 && e1 == e2 && i1 == i2 && !memcmp(&d1, &d2, sizeof(double)))
+      errorf("json_number %s", subject);
+  }
+
+  json = json_parse("[12345678, -1.25, \"7\"]");
+
+  ensure(json_integer(json->children) == 12345678 && json_double(json->children->sibling) == -1.25 && json_integer(json->children->sibling) == -1)
+    errorf("json_integer json_double");
+
+  json_free(json);
+
+  char *jdoc = "{\"a\": [1, -2.5, \"x\\\"y\\u00e9\"], \"b\": {\"c\": null, \"d\": true}, e: word} [12345]";
+  text_t *jevents[2];
+
+  for (int i = 0; i < 2; i++)
+  {
+    json_reader_t reader;
+    json_reader_init(&reader);
+    jevents[i] = textf("");
+
+    size_t fed = 0, chunk = i ? 1: strlen(jdoc);
+    int event = JSON_READ_MORE;
+
+    while (event != JSON_READ_END && event != JSON_READ_ERROR)
+    {
+      event = json_reader_next(&reader);
+
+      if (event == JSON_READ_MORE)
+      {
+        if (fed < strlen(jdoc))
+        {
+          json_reader_feed(&reader, jdoc + fed, min(chunk, strlen(jdoc) - fed));
+          fed += min(chunk, strlen(jdoc) - fed);
+        }
+        else
+          json_reader_end(&reader);
+        continue;
+      }
+
+      textf_ins(jevents[i], "%d:%s:%lu,", event, event > JSON_READ_ARRAY_END ? reader.token: "", reader.depth);
+    }
+
+    ensure(event == JSON_READ_END && reader.length == 5 && reader.integer == 12345)
+      errorf("json_reader_next");
+
+    json_reader_clear(&reader);
+  }
+
+  ensure(!strcmp(text_get(jevents[0]), text_get(jevents[1]))
+    && strstr(text_get(jevents[1]), "7:x\"y\xc3\xa9:2,") && strstr(text_get(jevents[1]), "6:e:1,7:word:1,3::0,4::1"))
+    errorf("json_reader chunks %s", text_get(jevents[1]));
+
+  text_free(jevents[0]);
+  text_free(jevents[1]);
+
+  char jescape[] = "\\ud83d\\ude00\\ud800\\uE000";
+  size_t jescaped = json_unescape(jescape, jescape, strlen(jescape));
+
+  ensure(jescaped == 10 && !memcmp(jescape, "\xf0\x9f\x98\x80\xed\xa0\x80\xee\x80\x80", 10))
+    errorf("json_unescape surrogates");
+
+  FILE *jfile = fopen("ndjson", "w");
+  for (int i = 0; i < 1000; i++)
+    fprintf(jfile, i == 500 ? "\n": "{\"id\": %d, \"tags\": [\"a\"]}\n", i);
+  fprintf(jfile, "[1000]");
+  fclose(jfile);
+
+  ndjson_t *ndjson = ndjson_open("ndjson");
+  int64_t jseen[3] = { -1, -1, 0 };
+
+  ensure(ndjson && ndjson_each(ndjson, 1, 0, ndjson_check, jseen) == 1000 && jseen[0] == 1000 && !jseen[2] && !ndjson->errors)
+    errorf("ndjson_each");
+
+  jseen[0] = -1;
+  jseen[1] = 10;
+
+  ensure(ndjson_each(ndjson, 1, 0, ndjson_check, jseen) == 11 && jseen[0] == 10 && !jseen[2])
+    errorf("ndjson_each stop");
+
+  ndjson_close(ndjson);
+  unlink("ndjson");
+
+  jfile = fopen("ndjson", "w");
+  fprintf(jfile, "{\"id\": 0}\n{\"b\":\"oops}\n{\"id\": 1, \"c\": \"c\"}\n{\"e\": \"x\"\"}\n\n{\"id\": 2, \"d\": \"d\"}\n");
+  fclose(jfile);
+
+  ndjson = ndjson_open("ndjson");
+  jseen[0] = -1;
+  jseen[1] = -1;
+
+  ensure(ndjson && ndjson_each(ndjson, 1, 0, ndjson_check, jseen) == 3 && jseen[0] == 2 && !jseen[2] && ndjson->errors == 2)
+    errorf("ndjson_each unterminated string %ld", jseen[0]);
+
+  ndjson_close(ndjson);
+  unlink("ndjson");
+
+  json_writer_t writer;
+  jtext = text_new("");
+  json_writer_text(&writer, jtext);
+
+  json_writer_object(&writer);
+  json_writer_key(&writer, "a\"b");
+  json_writer_array(&writer);
+  json_writer_integer(&writer, -42);
+  json_writer_double(&writer, 0.1);
+  json_writer_double(&writer, 3);
+  json_writer_double(&writer, 1.0/3);
+  json_writer_string(&writer, "tab\there\x01");
+  json_writer_null(&writer);
+  json_writer_array_end(&writer);
+  json_writer_key(&writer, "b");
+  json_writer_object(&writer);
+  json_writer_object_end(&writer);
+  json_writer_key(&writer, "c");
+  json_writer_boolean(&writer, 1);
+  json_writer_object_end(&writer);
+
+  ensure(!json_writer_clear(&writer) && !strcmp(text_get(jtext), "{\"a\\\"b\":[-42,0.1,3.0,0.3333333333333333,\"tab\\there\\u0001\",null],\"b\":{},\"c\":true}"))
+    errorf("json_writer %s", text_get(jtext));
+
+  json = json_parse(text_get(jtext));
+  text_t *jcopy = text_new("");
+  json_writer_text(&writer, jcopy);
+  json_writer_json(&writer, json);
+  json_writer_clear(&writer);
+
+  ensure(!strcmp(text_get(jcopy), text_get(jtext)))
+    errorf("json_writer_json %s", text_get(jcopy));
+
+  json_free(json);
+  text_free(jcopy);
+  text_free(jtext);
+
+  jtext = text_new("");
+  json_writer_text(&writer, jtext);
+  json_writer_array(&writer);
+  json_writer_unsigned(&writer, UINT64_MAX);
+  json_writer_array_end(&writer);
+
+  ensure(!json_writer_clear(&writer) && !strcmp(text_get(jtext), "[18446744073709551615]"))
+    errorf("json_writer_unsigned %s", text_get(jtext));
+
+  text_free(jtext);
+
+  jtext = text_new("");
+  json_writer_text(&writer, jtext);
+  json_writer_array(&writer);
+  json_writer_float(&writer, 0.1f);
+  json_writer_float(&writer, 16777216.0f);
+  json_writer_float(&writer, 3.4028235e38f);
+  json_writer_array_end(&writer);
+
+  ensure(!json_writer_clear(&writer) && !strcmp(text_get(jtext), "[0.1,16777216.0,3.4028235e+38]"))
+    errorf("json_writer_float %s", text_get(jtext));
+
+  text_free(jtext);
+
+  json_t junterminated = { .type = JSON_STRING, .start = "\"oops\\\"", .length = 7 };
+
+  jtext = text_new("");
+  json_writer_text(&writer, jtext);
+  json_writer_json(&writer, &junterminated);
+
+  ensure(json_writer_clear(&writer) && !strcmp(text_get(jtext), "\"oops\\\\\\\"\""))
+    errorf("json_writer_json unterminated %s", text_get(jtext));
+
+  text_free(jtext);
+
+  jtext = text_new("");
+  json = json_parse("{\"s\": \"plain\", \"e\": \"a\\\"b\", \"n\": [0, -1, 200, -40000, 5000000000, -5000000000, 1.5, 0.1, null, true, false],"
+    " \"long\": \"0123456789012345678901234567890123456789\", \"o\": {}}");
+
+  json_writer_text(&writer, jtext);
+  json_writer_json(&writer, json);
+  json_writer_clear(&writer);
+
+  size_t jsize = 0;
+  char *jpacked = msgpack_encode(json, &jsize);
+  json_free(json);
+
+  json = msgpack_decode(jpacked, jsize);
+  jcopy = text_new("");
+  json_writer_text(&writer, jcopy);
+  json_writer_json(&writer, json);
+  json_writer_clear(&writer);
+
+  ensure(json && !strcmp(text_get(jcopy), text_get(jtext)) && jsize < text_count(jtext)
+    && (jval = json_object_get(json, "s")) && jval->flags & JSON_RAW && jval->start > jpacked && jval->start < jpacked + jsize)
+    errorf("msgpack %s", text_get(jcopy));
+
+  json_free(json);
+
+  ensure(!msgpack_decode(jpacked, jsize - 1))
+    errorf("msgpack_decode truncated");
+
+  free(jpacked);
+
+  json_t jbuilt[5] = { { .type = JSON_OBJECT, .children = &jbuilt[1] }, { .type = JSON_STRING, .start = "\"k\"", .length = 3, .sibling = &jbuilt[2] },
+    { .type = JSON_ARRAY, .children = &jbuilt[3] }, { .type = JSON_INTEGER, .start = "7", .length = 1, .value.integer = 7, .sibling = &jbuilt[4] },
+    { .type = JSON_INTEGER, .start = "8", .length = 1, .value.integer = 8 } };
+
+  jpacked = msgpack_encode(&jbuilt[0], &jsize);
+  json = msgpack_decode(jpacked, jsize);
+
+  ensure(json && (jval = json_object_get(json, "k")) && json_array_count(jval) == 2 && json_integer(json_array_get(jval, 1)) == 8)
+    errorf("msgpack hand-built");
+
+  json_free(json);
+  free(jpacked);
+
+  ensure(!msgpack_decode("\xcf\xff\xff\xff\xff\xff\xff\xff\xff", 9))
+    errorf("msgpack_decode uint64");
+  text_free(jcopy);
+  text_free(jtext);
+
+  char *jsubject = "{\"skip\": {\"items\": [{\"id\": 100}]}, \"items\": [{\"id\": 1, \"x\": \"}]\\\"\"}, {\"name\": \"no id\"}, {\"i\\u0064\": 3}, {\"id\": 4}], \"a/b\": [5, 6]}";
+  char *jpaths[] = { "$.items[*].id", "$['items'][3]['id']", "/a~1b/1", "$.*[0]", "$.items[9]", "$.items[4294967296].id" };
+  int64_t jexpect[] = { 8, 4, 6, 5, 0, 0 };
+
+  json = json_parse(jsubject);
+
+  for (int i = 0; i < 6; i++)
+  {
+    json_path_t *path = json_path_compile(jpaths[i]);
+    int64_t sum = 0;
+
+    json_path_each(path, json, json_path_sum, &sum);
+
+    json_t *matches = json_path_select(path, jsubject);
+    int64_t sum2 = 0;
+
+    json_array_each(matches, json_t *match)
+      sum2 += json_integer(match);
+
+    ensure(path && sum == jexpect[i] && sum2 == jexpect[i])
+      errorf("json_path %s %ld %ld", jpaths[i], sum, sum2);
+
+    json_free(matches);
+    json_path_free(path);
+  }
+
+  ensure(!json_path_compile("items") && !json_path_compile("$.items[") && !json_path_compile("$..x"))
+    errorf("json_path_compile invalid");
+
+  json_free(json);
+
+  jtext = textf("$.");
+  jcopy = textf("{\"");
+  for (int i = 0; i < 1000; i++)
+  {
+    textf_ins(jtext, "k");
+    textf_ins(jcopy, "\\u006b");
+  }
+  textf_ins(jcopy, "\": 7}");
+
+  json_path_t *jlong = json_path_compile(text_get(jtext));
+  json_t *jmatches = json_path_select(jlong, text_get(jcopy));
+
+  ensure(json_array_count(jmatches) == 1 && json_integer(jmatches->children) == 7)
+    errorf("json_path long escaped key");
+
+  json_free(jmatches);
+  json_path_free(jlong);
+  text_free(jtext);
+  text_free(jcopy);
+
+  jtext = textf("{\"tag\": \"a\\\"b\", \"items\": [");
+  for (int i = 0; i < 100; i++)
+    textf_ins(jtext, "{\"id\": %d, \"k%d\": %d.5, \"ok\": %s, \"v\": null},", i, i, i, i % 2 ? "true": "false");
+  text_unsep(jtext, ",");
+  text_ins(jtext, "], \"wide\": {");
+  for (int i = 0; i < 40; i++)
+    textf_ins(jtext, "\"w%d\": %d,", i, i);
+  text_unsep(jtext, ",");
+  text_ins(jtext, "}}");
+
+  json = json_parse(text_get(jtext));
+  json_t *jitems = json_object_get(json, "items");
+
+  unlink("tape");
+  ensure(json_tape_save(json, "tape") == EXIT_SUCCESS)
+    errorf("json_tape_save");
+
+  json_t *jtape1 = json_tape_open("tape");
+  json_t *jtape2 = json_tape_open("tape");
+
+  json_t *jtapes[] = { jtape1, jtape2 };
+
+  for (json_t **jt = jtapes; jt < jtapes + 2; jt++)
+  {
+    jcopy = text_new("");
+    json_writer_text(&writer, jcopy);
+    json_writer_json(&writer, *jt);
+    json_writer_clear(&writer);
+
+    text_t *jorig = text_new("");
+    json_writer_text(&writer, jorig);
+    json_writer_json(&writer, json);
+    json_writer_clear(&writer);
+
+    json_t *jtitems = json_object_get(*jt, "items");
+
+    ensure(*jt && (*jt)->flags & JSON_TAPE && !strcmp(text_get(jcopy), text_get(jorig))
+      && json_array_count(jtitems) == json_array_count(jitems)
+      && json_integer(json_object_get(json_array_get(jtitems, 77), "id")) == 77
+      && json_double(json_object_get(json_array_get(jtitems, 42), "k42")) == 42.5
+      && json_integer(json_object_get(json_object_get(*jt, "wide"), "w33")) == 33
+      && !json_object_get(json_object_get(*jt, "wide"), "w40"))
+      errorf("json_tape %s", text_get(jcopy));
+
+    text_free(jorig);
+    text_free(jcopy);
+  }
+
+  ensure(jtape1 != jtape2)
+    errorf("json_tape_open shared");
+
+  json_free(jtape1);
+  json_free(jtape2);
+
+  struct stat jst;
+  stat("tape", &jst);
+
+  char *jbytes = allocate(jst.st_size);
+  FILE *jtfile = fopen("tape", "r");
+  ensure(fread(jbytes, 1, jst.st_size, jtfile) == jst.st_size) errorf("tape read");
+  fclose(jtfile);
+
+  json_tape_header_t *jheader = (json_tape_header_t*)jbytes;
+  json_t *jnodes = (json_t*)(jbytes + JSON_TAPE_NODES);
+
+  // a huge count, a truncated file, a link outside the file, an empty
+  // quoted string, and text running up to the end of the file
+  for (int bad = 0; bad < 10; bad++)
+  {
+    json_t *jhold = bad % 2 ? json_tape_open("tape"): NULL;
+    char *jcorrupt = allocate(jst.st_size);
+    memmove(jcorrupt, jbytes, jst.st_size);
+
+    size_t jsize = jst.st_size;
+    json_tape_header_t *jch = (json_tape_header_t*)jcorrupt;
+    json_t *jcn = (json_t*)(jcorrupt + JSON_TAPE_NODES);
+
+    if (bad / 2 == 0)
+      jch->count = 1ULL << 40;
+    if (bad / 2 == 1)
+      jch->size = jsize = JSON_TAPE_NODES + jheader->count / 2 * sizeof(json_t);
+    if (bad / 2 == 2)
+      jcn[1].sibling = (json_t*)(uintptr_t)(jheader->base + jst.st_size + sizeof(json_t));
+    if (bad / 2 == 3)
+      jcn[1].length = 0;
+    if (bad / 2 == 4)
+      jcn[1].start = (char*)(uintptr_t)(jheader->base + jst.st_size - jcn[1].length);
+
+    jtfile = fopen("tape.bad", "w");
+    fwrite(jcorrupt, 1, jsize, jtfile);
+    fclose(jtfile);
+
+    ensure(!json_tape_open("tape.bad") && jnodes[0].flags & JSON_TAPE_ROOT)
+      errorf("json_tape_open corrupt %d", bad);
+
+    free(jcorrupt);
+    if (jhold) json_free(jhold);
+  }
+
+  free(jbytes);
+  unlink("tape.bad");
+
+  json_free(json);
+  text_free(jtext);
+  unlink("tape");
+
   pool_t pool;
   unlink("pool");
+  unlink("pool.free");
   pool_open(&pool, "pool", sizeof(uint32_t), 1000);
 
   uint32_t pc1 = 0;
+  uint32_t *pfirst = NULL;
 
   for (uint32_t i = 0; i < 2000; i++)
   {
     off_t pos = pool_alloc(&pool);
-    pool_write(&pool, pos, &i);
+    uint64_t val = i;
+    pool_write(&pool, pos, &val);
+    pfirst = pfirst ? pfirst: pool_read(&pool, pos, NULL);
     pc1 += i;
   }
 
@@ -170,9 +741,30 @@ main (int argc, char *argv[])
   ensure(pc1 == pc2)
     errorf("pool_next %u %u", pc1, pc2);
 
+  ensure(pfirst == pool_read(&pool, sizeof(pool_header_t), NULL) && pool.head->psize == sizeof(pool_header_t) + 2000 * 8)
+    errorf("pool_grow moved %p", pfirst);
+
+  for (uint32_t i = 0; i < 2000; i++)
+  {
+    if ((i > 100 && i < 900) || i % 3 == 1)
+    {
+      pool_free(&pool, sizeof(pool_header_t) + i * 8);
+      pc1 -= i;
+    }
+  }
+
+  pc2 = 0;
+
+  pool_each(&pool, uint32_t *i)
+    pc2 += *i;
+
+  ensure(pc1 == pc2 && pool_is_free(&pool, sizeof(pool_header_t) + 500 * 8) && !pool_is_free(&pool, sizeof(pool_header_t) + 999 * 8))
+    errorf("pool_next sparse %u %u", pc1, pc2);
+
   pool_close(&pool);
 
   unlink("pool");
+  unlink("pool.free");
   pool_open(&pool, "pool", 4, 1000);
 
   strcpy(pool_read_chunk(&pool, pool_alloc_chunk(&pool, 6), 6, NULL), "hello");
@@ -180,8 +772,404 @@ main (int argc, char *argv[])
   strcpy(pool_read_chunk(&pool, pool_alloc_chunk(&pool, 17), 17, NULL), "once upon a time");
   strcpy(pool_read_chunk(&pool, pool_alloc_chunk(&pool, 2), 2, NULL), "A");
 
+  while (pool_slot(&pool, pool.head->pnext) % 8)
+    pool_alloc(&pool);
+
+  off_t pslots[8];
+  for (int i = 0; i < 8; i++)
+    pslots[i] = pool_alloc(&pool);
+  for (int i = 0; i < 8; i++)
+    pool_free(&pool, pslots[i]);
+
+  off_t pchunk = pool_alloc_chunk(&pool, 64);
+
+  ensure(pchunk == pslots[0] && pool_alloc(&pool) == pslots[7] + 8)
+    errorf("pool_alloc_chunk coalesce %ld %ld", pchunk, pslots[0]);
+
+  pool_free_chunk(&pool, pchunk, 64);
+  pool_close(&pool);
+
+  pool_open(&pool, "pool", 4, 1000);
+
+  ensure(pool_alloc_chunk(&pool, 40) == pchunk && pool_alloc_chunk(&pool, 16) == pchunk + 48 && pool_alloc(&pool) == pchunk + 40)
+    errorf("pool_alloc_chunk reopen");
+
   pool_close(&pool);
 
+  pool_open(&pool, "pool", 4, 1000);
+  off_t ptail = pool.head->pnext;
+  pool_free(&pool, pchunk);
+
+  int pfd = open("pool.free", O_RDWR);
+  pool_free_header_t pfh;
+
+  ensure(pread(pfd, &pfh, sizeof(pfh), 0) == sizeof(pfh) && !pfh.clean)
+    errorf("pool_dirty");
+
+  pool_close(&pool);
+
+  ensure(pwrite(pfd, "x", 1, 8) == 1 && close(pfd) == 0)
+    errorf("pool.free");
+
+  pool_open(&pool, "pool", 4, 1000);
+
+  ensure(pool_alloc(&pool) == ptail && !pool_is_free(&pool, pchunk))
+    errorf("pool_free_repair");
+
+  pool_close(&pool);
+
+  unlink("pool");
+  unlink("pool.free");
+  unlink("pool.wal");
+
+  pid_t pcrash = fork();
+
+  if (!pcrash)
+  {
+    pool_open(&pool, "pool", sizeof(uint64_t), 1000);
+
+    for (uint64_t i = 0; i < 10; i++)
+      pool_write(&pool, pool_alloc(&pool), &i);
+
+    for (uint64_t i = 0; i < 10; i += 2)
+      pool_free(&pool, sizeof(pool_header_t) + i * 8);
+
+    pool_sync(&pool);
+
+    uint64_t kept = 100;
+    pool_write(&pool, pool_alloc(&pool), &kept);
+    _exit(EXIT_SUCCESS);
+  }
+
+  ensure(pcrash > 0 && waitpid(pcrash, NULL, 0) == pcrash)
+    errorf("fork");
+
+  pool_open(&pool, "pool", sizeof(uint64_t), 1000);
+
+  uint64_t pkept = 0;
+  off_t pend = pool.head->pnext;
+
+  pool_each(&pool, uint64_t *val)
+    pkept += *val;
+
+  off_t preuse = pool_alloc(&pool);
+
+  ensure(pkept == 1 + 3 + 5 + 7 + 9 + 100 && preuse < pend && pool.head->pnext == pend)
+    errorf("pool_free_rebuild %lu", pkept);
+
+  pool_close(&pool);
+
+  unlink("pool");
+  unlink("pool.free");
+
+  pid_t pchild = fork();
+
+  if (!pchild)
+  {
+    pool_open(&pool, "pool", sizeof(uint64_t), 1000);
+    pool_journal(&pool);
+
+    for (uint64_t i = 0; i < 3000; i++)
+      pool_write(&pool, pool_alloc(&pool), &i);
+
+    for (uint64_t i = 0; i < 3000; i += 2)
+      pool_free(&pool, sizeof(pool_header_t) + i * 8);
+
+    pool_commit(&pool);
+
+    uint64_t lost = 1000000;
+    pool_write(&pool, pool_alloc(&pool), &lost);
+    _exit(EXIT_SUCCESS);
+  }
+
+  ensure(pchild > 0 && waitpid(pchild, NULL, 0) == pchild)
+    errorf("fork");
+
+  for (int journaled = 1; journaled >= 0; journaled--)
+  {
+    pool_open(&pool, "pool", sizeof(uint64_t), 1000);
+
+    if (journaled)
+      pool_journal(&pool);
+
+    uint64_t psum = 0;
+
+    pool_each(&pool, uint64_t *val)
+      psum += *val;
+
+    ensure(psum == 1500 * 1500 && pool_is_free(&pool, sizeof(pool_header_t)) && !pool_is_free(&pool, sizeof(pool_header_t) + 8))
+      errorf("pool_journal replay %lu", psum);
+
+    pool_close(&pool);
+  }
+
+  struct stat pst;
+
+  ensure(stat("pool.wal", &pst) == 0 && pst.st_size == 0 && stat("pool.wal.old", &pst) != 0)
+    errorf("pool_checkpoint");
+
+  unlink("pool");
+  unlink("pool.free");
+  pool_open(&pool, "pool", sizeof(uint64_t), 1000);
+
+  pool_cache_t pcache;
+  pool_cache_init(&pcache, &pool);
+
+  for (uint64_t i = 0; i < 100; i++)
+    pool_write(&pool, pool_cache_alloc(&pcache), &i);
+
+  // the rest of the last batch stays reserved
+  off_t preserved = pool_alloc(&pool);
+
+  for (uint64_t i = 0; i < 100; i += 2)
+    pool_cache_free(&pcache, sizeof(pool_header_t) + i * 8);
+
+  uint64_t pcount = 0;
+
+  pool_each(&pool, uint64_t *val)
+    pcount += *val % 2;
+
+  ensure(pcount == 50 && preserved == sizeof(pool_header_t) + 128 * 8)
+    errorf("pool_cache %lu", pcount);
+
+  pool_cache_flush(&pcache);
+  pool_close(&pool);
+
+  pool_open(&pool, "pool", sizeof(uint64_t), 1000);
+  off_t pnext = pool.head->pnext;
+
+  ensure(pool_alloc(&pool) < pnext && pool.head->pnext == pnext)
+    errorf("pool_cache_flush");
+
+  pool_close(&pool);
+
+  pool_t pother;
+  pool_open(&pool, "pool", sizeof(uint64_t), 1000);
+
+#ifdef TOOLBELT_THREAD
+  ensure(pool_open(&pother, "pool", sizeof(uint64_t), 1000) == EXIT_SUCCESS && pother.head->pnext == pool.head->pnext)
+    errorf("pool_open shared");
+
+  pool_close(&pother);
+#else
+  ensure(pool_open(&pother, "pool", sizeof(uint64_t), 1000) == EXIT_FAILURE && pool_alloc(&pool))
+    errorf("pool_open in use");
+#endif
+
+  pool_close(&pool);
+
+#ifdef TOOLBELT_THREAD
+  unlink("pool");
+  unlink("pool.free");
+
+  for (uint64_t p = 0; p < 4; p++)
+  {
+    if (!fork())
+    {
+      pool_open(&pool, "pool", sizeof(uint64_t), 100);
+      pool_cache_init(&pcache, &pool);
+
+      for (uint64_t i = 0; i < 10000; i++)
+      {
+        uint64_t val = p * 10000 + i;
+        off_t pos = pool_cache_alloc(&pcache);
+        pool_write(&pool, pos, &val);
+
+        if (i % 3 == 0)
+          pool_cache_free(&pcache, pos);
+      }
+
+      pool_cache_flush(&pcache);
+      pool_close(&pool);
+      _exit(EXIT_SUCCESS);
+    }
+  }
+
+  while (wait(NULL) > 0);
+
+  pool_open(&pool, "pool", sizeof(uint64_t), 100);
+
+  uint64_t psum = 0, pexpect = 0;
+  pcount = 0;
+
+  for (uint64_t i = 0; i < 40000; i++)
+    pexpect += i % 10000 % 3 ? i: 0;
+
+  pool_each(&pool, uint64_t *val)
+  {
+    psum += *val;
+    pcount++;
+  }
+
+  ensure(pcount == 4 * 6666 && psum == pexpect)
+    errorf("pool shared %lu %lu", pcount, psum);
+
+  pool_close(&pool);
+
+  unlink("pool");
+  unlink("pool.free");
+  pool_open(&pool, "pool", sizeof(uint64_t), 100);
+
+  pthread_t pthreads[4];
+  pool_worker_t pworkers[4];
+
+  for (uint64_t p = 0; p < 4; p++)
+  {
+    pworkers[p] = (pool_worker_t){ &pool, p, 0 };
+    pthread_create(&pthreads[p], NULL, pool_worker, &pworkers[p]);
+  }
+
+  psum = pexpect = pcount = 0;
+
+  for (uint64_t p = 0; p < 4; p++)
+  {
+    pthread_join(pthreads[p], NULL);
+    ensure(!pworkers[p].errors)
+      errorf("pool threads live slot freed");
+
+    for (uint64_t i = 0; i < 20000; i += 3)
+      pexpect += p * 100000 + i;
+  }
+
+  pool_each(&pool, uint64_t *val)
+  {
+    psum += *val;
+    pcount++;
+  }
+
+  ensure(pcount == 4 * 6667 && psum == pexpect)
+    errorf("pool threads %lu %lu", pcount, psum);
+
+  pool_close(&pool);
+#endif
+
+  unlink("pool");
+  unlink("pool.free");
+  pool_open(&pool, "pool", sizeof(uint64_t), 1000);
+
+  off_t pindex[3000];
+
+  for (uint64_t i = 0; i < 3000; i++)
+    pool_write(&pool, (pindex[i] = pool_alloc(&pool)), &i);
+
+  for (uint64_t i = 0; i < 3000; i++)
+    if (i % 3) pool_free(&pool, pindex[i]);
+
+  pool_index_t pi = { .pool = &pool, .index = pindex };
+  pool_compact_t compact;
+  pool_compact_init(&compact, &pool, 1, pool_compact_index, &pi);
+
+  int steps = 0;
+  while (pool_compact_step(&compact, 100)) steps++;
+
+  uint64_t pval = 0;
+  pcount = 0;
+
+  for (uint64_t i = 0; i < 3000; i += 3)
+  {
+    pool_read(&pool, pindex[i], &pval);
+    pcount += pval == i;
+  }
+
+  ensure(pcount == 1000 && steps >= 6 && pool.head->pnext == sizeof(pool_header_t) + 1000 * 8 && stat("pool", &pst) == 0 && pst.st_size == pool.head->pnext)
+    errorf("pool_compact %lu %d", pcount, steps);
+
+  pool_close(&pool);
+
+  unlink("pool");
+  unlink("pool.free");
+  pool_open(&pool, "pool", 16, 100);
+
+  off_t chunks[100];
+  char chunk[256];
+
+  for (int i = 0; i < 100; i++)
+  {
+    snprintf(chunk, sizeof(chunk), "%0*d", 10 + i % 7 * 20, i);
+    chunks[i] = pool_alloc_chunk(&pool, strlen(chunk) + 1);
+    pool_write_chunk(&pool, chunks[i], strlen(chunk) + 1, chunk);
+  }
+
+  for (int i = 0; i < 100; i += 2)
+  {
+    snprintf(chunk, sizeof(chunk), "%0*d", 10 + i % 7 * 20, i);
+    pool_free_chunk(&pool, chunks[i], strlen(chunk) + 1);
+    chunks[i] = 0;
+  }
+
+  off_t psize = pool.head->pnext;
+  pool_compact(&pool, 0, pool_compact_shift, chunks);
+  pcount = 0;
+
+  for (int i = 1; i < 100; i += 2)
+  {
+    char expect[256];
+    snprintf(expect, sizeof(expect), "%0*d", 10 + i % 7 * 20, i);
+    pool_read_chunk(&pool, chunks[i], strlen(expect) + 1, chunk);
+    pcount += !strcmp(chunk, expect);
+  }
+
+  ensure(pcount == 50 && pool.head->pnext < psize)
+    errorf("pool_compact chunks %lu", pcount);
+
+  pool_close(&pool);
+
+  unlink("store");
+  unlink("store.free");
+
+  store_t store;
+  store_open(&store, "store", 0);
+
+  uint64_t ids[1000];
+  char sample[8000];
+  char *record;
+  size_t rlen;
+
+  for (uint64_t i = 0; i < 1000; i++)
+    ids[i] = store_insert(&store, sample, store_sample(sample, i, i % 97 ? 10 + i % 50 * 8: 6000));
+
+  for (uint64_t i = 0; i < 1000; i += 2)
+    store_delete(&store, ids[i]);
+
+  off_t snext = store.pool.head->pnext;
+
+  // grown records move out of full pages, shrunk ones stay put
+  for (uint64_t i = 1; i < 1000; i += 2)
+    store_update(&store, ids[i], sample, store_sample(sample, i, i % 97 == 0 ? 7000: i % 3 ? 5: 900));
+
+  for (uint64_t i = 0; i < 1000; i += 2)
+    ids[i] = store_insert(&store, sample, store_sample(sample, i, 30));
+
+  for (int reopen = 0; reopen < 2; reopen++)
+  {
+    pcount = 0;
+
+    for (uint64_t i = 0; i < 1000; i++)
+    {
+      size_t expect = store_sample(sample, i, i % 2 ? (i % 97 == 0 ? 7000: i % 3 ? 5: 900): 30);
+      record = store_get(&store, ids[i], &rlen);
+      pcount += rlen == expect && store_length(&store, ids[i]) == expect && !memcmp(record, sample, expect);
+    }
+
+    uint64_t seen = 0;
+
+    store_each(&store, store_record_t *rec)
+      seen += rec->length == store_length(&store, rec->id);
+
+    ensure(pcount == 1000 && seen == 1000 && store.pool.head->pnext < snext + 16 * 4096)
+      errorf("store %lu %lu", pcount, seen);
+
+    store_close(&store);
+    store_open(&store, "store", 0);
+  }
+
+  store_delete(&store, ids[1]);
+
+  ensure(!store_get(&store, ids[1], NULL) && !store_length(&store, ids[1]))
+    errorf("store_delete");
+
+  store_close(&store);
+
   vector_t *v = vector_new();
   vector_push(v, "hello");
   vector_push(v, "world");
@@ -222,6 +1210,95 @@ main (int argc, char *argv[])
   text_free(text3);
   text_free(text4);
 
+  text = textf("");
+  for (int i = 0; i < 1000; i++)
+    textf_ins(text, "%d,", i % 10);
+  text_at(text, 4);
+  text_del(text, 4);
+  text_ins(text, "x");
+  text_home(text);
+  text_ins(text, "[");
+
+  ensure(text_count(text) == 1998 && !strncmp(text_get(text), "[0,1,x4,5,", 10))
+    errorf("text_ins gap");
+
+  text_end(text);
+  ensure(text_unsep(text, ",") && !text_unsep(text, ",") && text_count(text) == 1997)
+    errorf("text_unsep");
+
+  text_ins(text, ",,");
+  ensure(text_trim(text, iscomma) == 1997 && text_cmp(text, "[") > 0)
+    errorf("text_trim");
+
+  text_at(text, 0);
+  ensure(text_ltrim(text, ispunct) == 1996 && text_pos(text) == 0 && *text_get(text) == '0')
+    errorf("text_ltrim");
+
+  text_home(text);
+  text_ins(text, " ");
+  text_at(text, 3);
+  text_home(text);
+  text_ins(text, "  ");
+
+  ensure(text->gap == 2 && text_ltrim(text, isspace) == 1996 && text->gap == 0 && !strncmp(text_get(text), "0,1,x4", 6))
+    errorf("text_ltrim gap");
+
+  size_t found = 0;
+  off_t *offsets = text_find_all(text, "4,5", &found);
+
+  ensure(found == 100 && offsets[0] == 5 && offsets[1] == 25)
+    errorf("text_find_all");
+
+  free(offsets);
+
+  text_at(text, 10);
+  ensure(text_find(text, "x") == 0 && text_find(text, "9,0") && text_pos(text) == 15)
+    errorf("text_find");
+
+  ensure(text_replace_all(text, ",", ", ") == 997 && text_count(text) == 2993 && !strncmp(text_get(text), "0, 1, x4, 5", 11))
+    errorf("text_replace_all");
+
+  text_free(text);
+
+  regex_match_t match;
+  regex_match_init(&match);
+
+  ensure(regex_match("([a-z]+)=([0-9]+)", REG_EXTENDED, "key foo=42;", &match) && (item = regex_group(&match, 2)) && !strcmp(item, "42"))
+    errorf("regex_match");
+
+  free(item);
+
+  ensure(!regex_match("([a-z]+)=([0-9]+)", REG_EXTENDED, "foo:42", &match) && !regex_group(&match, 1))
+    errorf("regex_match prefilter");
+
+  regex_match_clear(&match);
+
+  regex_cache_limit(2);
+  regex_entry_t *ra = regex_get("a+", 0), *rb = regex_get("b+", 0);
+  regex_put(regex_get("a+", 0));
+  regex_entry_t *rc = regex_get("c+", 0);
+
+  ensure(!ra->evicted && rb->evicted && !rc->evicted && regex_cache_oldest == ra && regex_cache_newest == rc)
+    errorf("regex_evict");
+
+  regex_put(ra);
+  regex_put(rb);
+  regex_put(rc);
+  regex_cache_limit(64);
+  regex_cache_clear();
+
+  text = textf("h\xc3\xa9llo w\xc3\xb6rld \xe2\x82\xacuro");
+  text2 = text_cp_take(text, -4, 2);
+
+  ensure(text_len(text) == 16 && text_valid(text) && !text_cmp(text2, "\xe2\x82\xacu") && !strcmp(text_cp_at(text, 7), "\xc3\xb6rld \xe2\x82\xacuro"))
+    errorf("text_cp_take");
+
+  ensure(!str_utf8_valid("\xed\xa0\x80", 3) && !str_utf8_valid("ab\xe2\x82", 4))
+    errorf("str_utf8_valid");
+
+  text_free(text);
+  text_free(text2);
+
   file_t *file = file_open("fubar", FILE_CREATE);
   file_write(file, "fu\n", 3);
   file_write(file, "bar\n", 4);
@@ -236,6 +1313,10 @@ main (int argc, char *argv[])
 
   unlink("fubar");
   unlink("pool");
+  unlink("pool.free");
+  unlink("pool.wal");
+  unlink("store");
+  unlink("store.free");
 
   return EXIT_SUCCESS;
 }
@@ -10,6 +10,7 @@
 #include <regex.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <math.h>
 #include <sys/stat.h>
 
 #define PRIME_1000 997
@@ -78,10 +79,20 @@ djb_hash (char *str)
 #include "c/vector.c"
 #include "c/list.c"
 #include "c/map.c"
+#include "c/regex.c"
 #include "c/json.c"
+#include "c/json_fast.c"
+#include "c/json_reader.c"
+#include "c/json_writer.c"
+#include "c/msgpack.c"
+#include "c/json_path.c"
+#include "c/json_tape.c"
 #include "c/pool.c"
+#include "c/pool_journal.c"
+#include "c/store.c"
 #include "c/db.c"
 #include "c/thread.c"
+#include "c/ndjson.c"
 
 #include <sys/wait.h>
 